@@ -45,6 +45,19 @@
 #define ARENA_BACKEND ARENA_BACKEND_LIBC_MALLOC
 #endif // ARENA_BACKEND
 
+// An Arena is not safe to share between threads. Give every thread its own with
+// `static ARENA_THREAD_LOCAL Arena a;` and hand whatever has to outlive the thread
+// to a longer lived arena with arena_merge().
+#ifndef ARENA_THREAD_LOCAL
+#  if defined(__cplusplus)
+#    define ARENA_THREAD_LOCAL thread_local
+#  elif defined(_MSC_VER)
+#    define ARENA_THREAD_LOCAL __declspec(thread)
+#  else
+#    define ARENA_THREAD_LOCAL _Thread_local
+#  endif
+#endif // ARENA_THREAD_LOCAL
+
 typedef struct Region Region;
 
 struct Region {
@@ -81,6 +94,10 @@ void arena_reset(Arena *a);
 void arena_rewind(Arena *a, Arena_Mark m);
 void arena_free(Arena *a);
 void arena_trim(Arena *a);
+void arena_merge(Arena *dst, Arena *src);
+#ifndef ARENA_NOATOMIC
+void *arena_alloc_atomic(Arena *a, size_t size_bytes);
+#endif // ARENA_NOATOMIC
 
 #define ARENA_DA_INIT_CAP 256
 
@@ -343,4 +360,77 @@ void arena_trim(Arena *a){
     a->end->next = NULL;
 }
 
+// Moves all the regions of `src` into `dst` and leaves `src` empty. Everything allocated
+// in `src` stays where it is and is freed with `dst` from now on, which is how a thread
+// hands the results in its own arena over to someone who outlives it. The two arenas
+// must not be used by anyone else meanwhile. Rewinding `dst` to a mark taken before the
+// merge drops the merged allocations as well.
+void arena_merge(Arena *dst, Arena *src)
+{
+    if (src->begin == NULL) return;
+
+    if (dst->end == NULL) {
+        ARENA_ASSERT(dst->begin == NULL);
+        *dst = *src;
+    } else {
+        Region *last = src->end;
+        while (last->next != NULL) last = last->next;
+        last->next = dst->end->next;
+        dst->end->next = src->begin;
+        dst->end = src->end;
+    }
+
+    src->begin = NULL;
+    src->end = NULL;
+}
+
+#ifndef ARENA_NOATOMIC
+// Same as arena_alloc() but safe to call from many threads on the same arena at once,
+// lock-free through compare-and-swap on the count of the current region. No other
+// function may touch the arena until all of them are done. A region is never filled
+// past its capacity, so afterwards the arena can be used as usual.
+void *arena_alloc_atomic(Arena *a, size_t size_bytes)
+{
+    size_t size = (size_bytes + sizeof(uintptr_t) - 1)/sizeof(uintptr_t);
+    size_t capacity = REGION_DEFAULT_CAPACITY;
+    if (capacity < size) capacity = size;
+
+    for (;;) {
+        Region *r = __atomic_load_n(&a->end, __ATOMIC_ACQUIRE);
+        if (r == NULL) {
+            Region *begin = __atomic_load_n(&a->begin, __ATOMIC_ACQUIRE);
+            if (begin == NULL) {
+                Region *fresh = new_region(capacity);
+                if (__atomic_compare_exchange_n(&a->begin, &begin, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                    begin = fresh;
+                } else {
+                    free_region(fresh);
+                }
+            }
+            __atomic_compare_exchange_n(&a->end, &r, begin, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+            continue;
+        }
+
+        size_t count = __atomic_load_n(&r->count, __ATOMIC_RELAXED);
+        while (count + size <= r->capacity) {
+            if (__atomic_compare_exchange_n(&r->count, &count, count + size, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                return &r->data[count];
+            }
+        }
+
+        // The region is full, move the end of the arena on, appending a region if it was the last one
+        Region *next = __atomic_load_n(&r->next, __ATOMIC_ACQUIRE);
+        if (next == NULL) {
+            Region *fresh = new_region(capacity);
+            if (__atomic_compare_exchange_n(&r->next, &next, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                next = fresh;
+            } else {
+                free_region(fresh);
+            }
+        }
+        __atomic_compare_exchange_n(&a->end, &r, next, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    }
+}
+#endif // ARENA_NOATOMIC
+
 #endif // ARENA_IMPLEMENTATION
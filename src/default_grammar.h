@@ -0,0 +1,82 @@
+// Generated by `randomart grammar-c`, do not edit
+
+static Node default_grammar_nodes[14] = {
+    {.kind = NK_TRIPLE, .file_path = __FILE__, .line = __LINE__, .as.triple = {&default_grammar_nodes[1], &default_grammar_nodes[2], &default_grammar_nodes[3]}},
+    {.kind = NK_RULE, .file_path = __FILE__, .line = __LINE__, .as.rule = 2},
+    {.kind = NK_RULE, .file_path = __FILE__, .line = __LINE__, .as.rule = 2},
+    {.kind = NK_RULE, .file_path = __FILE__, .line = __LINE__, .as.rule = 2},
+    {.kind = NK_RANDOM, .file_path = __FILE__, .line = __LINE__},
+    {.kind = NK_X, .file_path = __FILE__, .line = __LINE__},
+    {.kind = NK_Y, .file_path = __FILE__, .line = __LINE__},
+    {.kind = NK_RULE, .file_path = __FILE__, .line = __LINE__, .as.rule = 1},
+    {.kind = NK_ADD, .file_path = __FILE__, .line = __LINE__, .as.binop = {&default_grammar_nodes[9], &default_grammar_nodes[10]}},
+    {.kind = NK_RULE, .file_path = __FILE__, .line = __LINE__, .as.rule = 2},
+    {.kind = NK_RULE, .file_path = __FILE__, .line = __LINE__, .as.rule = 2},
+    {.kind = NK_MULT, .file_path = __FILE__, .line = __LINE__, .as.binop = {&default_grammar_nodes[12], &default_grammar_nodes[13]}},
+    {.kind = NK_RULE, .file_path = __FILE__, .line = __LINE__, .as.rule = 2},
+    {.kind = NK_RULE, .file_path = __FILE__, .line = __LINE__, .as.rule = 2},
+};
+
+static Grammar_Branch default_grammar_branches_0[] = {
+    {.node = &default_grammar_nodes[0], .probability = 0x1p+0f, .min_depth = 4},
+};
+static size_t default_grammar_level_branches_0_0[] = {0};
+static uint32_t default_grammar_threshold_0_0[] = {4294967295};
+static uint32_t default_grammar_alias_0_0[] = {0};
+static uint32_t default_grammar_threshold_0_1[] = {4294967295};
+static uint32_t default_grammar_alias_0_1[] = {0};
+static Grammar_Level default_grammar_levels_0[] = {
+    {.min_depth = 4, .branches = default_grammar_level_branches_0_0, .count = 1, .alias = {default_grammar_threshold_0_0, default_grammar_alias_0_0}},
+};
+
+static Grammar_Branch default_grammar_branches_1[] = {
+    {.node = &default_grammar_nodes[4], .probability = 0x1.555556p-2f, .min_depth = 0},
+    {.node = &default_grammar_nodes[5], .probability = 0x1.555556p-2f, .min_depth = 0},
+    {.node = &default_grammar_nodes[6], .probability = 0x1.555556p-2f, .min_depth = 0},
+};
+static size_t default_grammar_level_branches_1_0[] = {0, 1, 2};
+static uint32_t default_grammar_threshold_1_0[] = {4294967295, 4294967295, 4294967295};
+static uint32_t default_grammar_alias_1_0[] = {0, 1, 2};
+static uint32_t default_grammar_threshold_1_1[] = {4294967295, 4294967295, 4294967295};
+static uint32_t default_grammar_alias_1_1[] = {0, 1, 2};
+static Grammar_Level default_grammar_levels_1[] = {
+    {.min_depth = 0, .branches = default_grammar_level_branches_1_0, .count = 3, .alias = {default_grammar_threshold_1_0, default_grammar_alias_1_0}},
+};
+
+static Grammar_Branch default_grammar_branches_2[] = {
+    {.node = &default_grammar_nodes[7], .probability = 0x1p-2f, .min_depth = 2},
+    {.node = &default_grammar_nodes[8], .probability = 0x1.8p-2f, .min_depth = 4},
+    {.node = &default_grammar_nodes[11], .probability = 0x1.8p-2f, .min_depth = 4},
+};
+static size_t default_grammar_level_branches_2_0[] = {0};
+static uint32_t default_grammar_threshold_2_0[] = {4294967295};
+static uint32_t default_grammar_alias_2_0[] = {0};
+static size_t default_grammar_level_branches_2_1[] = {0, 1, 2};
+static uint32_t default_grammar_threshold_2_1[] = {3221225472, 4294967295, 3758096384};
+static uint32_t default_grammar_alias_2_1[] = {2, 1, 1};
+static uint32_t default_grammar_threshold_2_2[] = {3221225472, 4294967295, 3758096384};
+static uint32_t default_grammar_alias_2_2[] = {2, 1, 1};
+static Grammar_Level default_grammar_levels_2[] = {
+    {.min_depth = 2, .branches = default_grammar_level_branches_2_0, .count = 1, .alias = {default_grammar_threshold_2_0, default_grammar_alias_2_0}},
+    {.min_depth = 4, .branches = default_grammar_level_branches_2_1, .count = 3, .alias = {default_grammar_threshold_2_1, default_grammar_alias_2_1}},
+};
+
+static Grammar_Branches default_grammar_rules[3] = {
+    {
+        .items = default_grammar_branches_0, .capacity = 1, .count = 1,
+        .alias = {default_grammar_threshold_0_1, default_grammar_alias_0_1},
+        .min_depth = 5, .levels = default_grammar_levels_0, .levels_count = 1,
+    },
+    {
+        .items = default_grammar_branches_1, .capacity = 3, .count = 3,
+        .alias = {default_grammar_threshold_1_1, default_grammar_alias_1_1},
+        .min_depth = 1, .levels = default_grammar_levels_1, .levels_count = 1,
+    },
+    {
+        .items = default_grammar_branches_2, .capacity = 3, .count = 3,
+        .alias = {default_grammar_threshold_2_2, default_grammar_alias_2_2},
+        .min_depth = 3, .levels = default_grammar_levels_2, .levels_count = 2,
+    },
+};
+
+static const Grammar default_grammar = {.items = default_grammar_rules, .capacity = 3, .count = 3};
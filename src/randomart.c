@@ -1,11 +1,31 @@
+#define _GNU_SOURCE
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <linux/io_uring.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
 #include <time.h>
+#include <unistd.h>
 #define NOB_IMPLEMENTATION
 #define NOB_STRIP_PREFIX
 #include "nob.h"
@@ -17,7 +37,8 @@
 #define WIDTH 800
 #define HEIGHT WIDTH
 
-static Arena node_arena = {0};
+// Every thread generates into its own, see arena_merge() for handing trees over to another thread
+static ARENA_THREAD_LOCAL Arena node_arena = {0};
 
 typedef enum {
     NK_X,
@@ -92,12 +113,31 @@ typedef union {
 typedef struct {
     Node *node;
     float probability;
+    int min_depth; // filled in by grammar_compile()
 } Grammar_Branch;
 
+typedef struct {
+    uint32_t *threshold;
+    uint32_t *alias;
+} Alias_Table;
+
+typedef struct {
+    int min_depth;
+    size_t *branches;
+    size_t count;
+    Alias_Table alias;
+} Grammar_Level;
+
 typedef struct {
     Grammar_Branch *items;
     size_t capacity;
     size_t count;
+
+    // Filled in by grammar_compile()
+    Alias_Table alias;
+    int min_depth;
+    Grammar_Level *levels;
+    size_t levels_count;
 } Grammar_Branches;
 
 typedef struct {
@@ -113,6 +153,18 @@ struct Node {
     Node_As as;
 };
 
+// How many bytes were allocated in `a` since `mark` was taken
+size_t arena_bytes_since(Arena *a, Arena_Mark mark) {
+    Region *r = mark.region != NULL ? mark.region : a->begin;
+    if (r == NULL) return 0;
+    size_t words = r->count - mark.count;
+    while (r != a->end) {
+        r = r->next;
+        words += r->count;
+    }
+    return words*sizeof(uintptr_t);
+}
+
 Node *node_loc(const char *file_path, int line, Node_Kind kind) {
     Node *node = arena_alloc(&node_arena, sizeof(Node));
     node->kind = kind;
@@ -184,95 +236,234 @@ Node *node_if_loc(const char *file_path, int line, Node *cond, Node *then, Node
 
 #define node_if(cond, then, elze) node_if_loc(__FILE__, __LINE__, cond, then, elze)
 
-void node_print(Node *node) {
-    switch (node->kind) {
+size_t node_arity(Node_Kind kind) {
+    switch (kind) {
         case NK_X:
-            printf("x");
-            break;
         case NK_Y:
-            printf("y");
-            break;
+        case NK_RANDOM:
+        case NK_RULE:
         case NK_NUMBER:
-            printf("%f", node->as.number);
-            break;
+        case NK_BOOLEAN:
+            return 0;
+
         case NK_ADD:
-            printf("add(");
-            node_print(node->as.binop.lhs);
-            printf(",");
-            node_print(node->as.binop.rhs);
-            printf(")");
-            break;
         case NK_MULT:
-            printf("mult(");
-            node_print(node->as.binop.lhs);
-            printf(",");
-            node_print(node->as.binop.rhs);
-            printf(")");
-            break;
         case NK_MOD:
-            printf("mod(");
-            node_print(node->as.binop.lhs);
-            printf(",");
-            node_print(node->as.binop.rhs);
-            printf(")");
-            break;
-        case NK_BOOLEAN:
-            printf("%s", node->as.boolean ? "true" : "false");
-            break;
         case NK_GT:
-            printf("gt(");
-            node_print(node->as.binop.lhs);
-            printf(",");
-            node_print(node->as.binop.rhs);
-            printf(")");
-            break;
         case NK_LT:
-            printf("lt(");
-            node_print(node->as.binop.lhs);
-            printf(",");
-            node_print(node->as.binop.rhs);
-            printf(")");
-            break;
         case NK_GTEQ:
-            printf("gteq(");
-            node_print(node->as.binop.lhs);
-            printf(",");
-            node_print(node->as.binop.rhs);
-            printf(")");
-            break;
         case NK_LTEQ:
-            printf("lteq(");
-            node_print(node->as.binop.lhs);
-            printf(",");
-            node_print(node->as.binop.rhs);
-            printf(")");
-            break;
+            return 2;
+
         case NK_TRIPLE:
-            printf("(");
-            node_print(node->as.triple.first);
-            printf(",");
-            node_print(node->as.triple.second);
-            printf(",");
-            node_print(node->as.triple.third);
-            printf(")");
-            break;
         case NK_IF:
-            printf("if ");
-            node_print(node->as.iff.cond);
-            printf(" then ");
-            node_print(node->as.iff.then);
-            printf(" else ");
-            node_print(node->as.iff.elze);
-            break;
-        case NK_RULE:
-            printf("rule(%d)", node->as.rule);
-            break;
+            return 3;
+
+        case COUNT_NK:
+        default: UNREACHABLE("node_arity");
+    }
+}
+
+// The field holding the i-th child of `node`, i < node_arity(node->kind)
+Node **node_child(Node *node, size_t i) {
+    switch (node->kind) {
+        case NK_ADD:
+        case NK_MULT:
+        case NK_MOD:
+        case NK_GT:
+        case NK_LT:
+        case NK_GTEQ:
+        case NK_LTEQ:
+            return i == 0 ? &node->as.binop.lhs : &node->as.binop.rhs;
+
+        case NK_TRIPLE:
+            return i == 0 ? &node->as.triple.first : i == 1 ? &node->as.triple.second : &node->as.triple.third;
+        case NK_IF:
+            return i == 0 ? &node->as.iff.cond : i == 1 ? &node->as.iff.then : &node->as.iff.elze;
+
+        case NK_X:
+        case NK_Y:
         case NK_RANDOM:
-            printf("random");
-            break;
+        case NK_RULE:
+        case NK_NUMBER:
+        case NK_BOOLEAN:
         case COUNT_NK:
-        default: UNREACHABLE("node_print");
+        default: UNREACHABLE("node_child");
+    }
+}
+
+typedef struct {
+    Node **items;
+    size_t count;
+    size_t capacity;
+} Node_Stack;
+
+// Walks the tree with an explicit stack, so it works on trees of any depth
+void node_kind_counts(Node *node, size_t counts[COUNT_NK]) {
+    Arena scratch = {0};
+    Node_Stack stack = {0};
+    arena_da_append(&scratch, &stack, node);
+    while (stack.count > 0) {
+        node = stack.items[--stack.count];
+        counts[node->kind] += 1;
+        switch (node->kind) {
+            case NK_X:
+            case NK_Y:
+            case NK_RANDOM:
+            case NK_RULE:
+            case NK_NUMBER:
+            case NK_BOOLEAN:
+                break;
+
+            case NK_ADD:
+            case NK_MULT:
+            case NK_MOD:
+            case NK_GT:
+            case NK_LT:
+            case NK_GTEQ:
+            case NK_LTEQ:
+                arena_da_append(&scratch, &stack, node->as.binop.lhs);
+                arena_da_append(&scratch, &stack, node->as.binop.rhs);
+                break;
+
+            case NK_TRIPLE:
+                arena_da_append(&scratch, &stack, node->as.triple.first);
+                arena_da_append(&scratch, &stack, node->as.triple.second);
+                arena_da_append(&scratch, &stack, node->as.triple.third);
+                break;
+            case NK_IF:
+                arena_da_append(&scratch, &stack, node->as.iff.cond);
+                arena_da_append(&scratch, &stack, node->as.iff.then);
+                arena_da_append(&scratch, &stack, node->as.iff.elze);
+                break;
+
+            case COUNT_NK:
+            default: UNREACHABLE("node_kind_counts");
+        }
+    }
+    arena_free(&scratch);
+}
+
+size_t node_count(Node *node) {
+    size_t counts[COUNT_NK] = {0};
+    node_kind_counts(node, counts);
+    size_t count = 0;
+    for (size_t k = 0; k < COUNT_NK; ++k) count += counts[k];
+    return count;
+}
+
+// A node that waits for its children while a tree is read
+typedef struct {
+    Node *node;
+    size_t filled; // children parsed so far
+} Parse_Frame;
+
+typedef struct {
+    Parse_Frame *items;
+    size_t count;
+    size_t capacity;
+} Parse_Stack;
+
+typedef struct {
+    Node *node;       // the node to print, or NULL for `text`
+    const char *text;
+} Print_Item;
+
+typedef struct {
+    Print_Item *items;
+    size_t count;
+    size_t capacity;
+} Print_Stack;
+
+// Appends the text form of `node`, which parse_node() reads back. Numbers are printed with 9 significant digits,
+// which is what it takes for every float to read back as the exact same float. Walks the tree with an explicit
+// stack, what comes after a node (separators, closing parens and the remaining children) is pushed in reverse.
+void node_sb_append(String_Builder *sb, Node *node) {
+    Arena scratch = {0};
+    Print_Stack stack = {0};
+    arena_da_append(&scratch, &stack, ((Print_Item) {.node = node}));
+
+#define PRINT_PUSH_TEXT(t) arena_da_append(&scratch, &stack, ((Print_Item) {.text = (t)}))
+#define PRINT_PUSH_NODE(n) arena_da_append(&scratch, &stack, ((Print_Item) {.node = (n)}))
+    while (stack.count > 0) {
+        Print_Item item = stack.items[--stack.count];
+        if (item.node == NULL) {
+            sb_append_cstr(sb, item.text);
+            continue;
+        }
+
+        node = item.node;
+        switch (node->kind) {
+            case NK_X:
+            case NK_Y:
+            case NK_RANDOM:
+                sb_append_cstr(sb, nk_names[node->kind]);
+                break;
+            case NK_NUMBER: {
+                char buf[32];
+                int n = snprintf(buf, sizeof(buf), "%.9g", node->as.number);
+                sb_append_buf(sb, buf, n);
+                break;
+            }
+            case NK_BOOLEAN:
+                sb_append_cstr(sb, node->as.boolean ? "true" : "false");
+                break;
+            case NK_RULE: {
+                char buf[32];
+                int n = snprintf(buf, sizeof(buf), "rule(%d)", node->as.rule);
+                sb_append_buf(sb, buf, n);
+                break;
+            }
+
+            case NK_ADD:
+            case NK_MULT:
+            case NK_MOD:
+            case NK_GT:
+            case NK_LT:
+            case NK_GTEQ:
+            case NK_LTEQ:
+                sb_append_cstr(sb, nk_names[node->kind]);
+                sb_append_cstr(sb, "(");
+                PRINT_PUSH_TEXT(")");
+                PRINT_PUSH_NODE(node->as.binop.rhs);
+                PRINT_PUSH_TEXT(",");
+                PRINT_PUSH_NODE(node->as.binop.lhs);
+                break;
+
+            case NK_TRIPLE:
+                sb_append_cstr(sb, "(");
+                PRINT_PUSH_TEXT(")");
+                PRINT_PUSH_NODE(node->as.triple.third);
+                PRINT_PUSH_TEXT(",");
+                PRINT_PUSH_NODE(node->as.triple.second);
+                PRINT_PUSH_TEXT(",");
+                PRINT_PUSH_NODE(node->as.triple.first);
+                break;
+            case NK_IF:
+                sb_append_cstr(sb, "if ");
+                PRINT_PUSH_NODE(node->as.iff.elze);
+                PRINT_PUSH_TEXT(" else ");
+                PRINT_PUSH_NODE(node->as.iff.then);
+                PRINT_PUSH_TEXT(" then ");
+                PRINT_PUSH_NODE(node->as.iff.cond);
+                break;
+
+            case COUNT_NK:
+            default: UNREACHABLE("node_sb_append");
+        }
     }
+#undef PRINT_PUSH_TEXT
+#undef PRINT_PUSH_NODE
+
+    arena_free(&scratch);
+}
+
+// Formats the whole tree first and writes it out in one go
+void node_print(Node *node) {
+    String_Builder sb = {0};
+    node_sb_append(&sb, node);
+    fwrite(sb.items, 1, sb.count, stdout);
+    sb_free(sb);
 }
 
 #define node_print_ln(node) (node_print(node), printf("\n"))
@@ -294,161 +485,283 @@ typedef struct {
     float r, g, b;
 } Color;
 
-bool expect_number(Node *expr) {
-    if (expr->kind != NK_NUMBER) {
-        nob_log(ERROR, "%s:%d: expected a number.", expr->file_path, expr->line);
-        return false;
+// Compiled functions
+//
+// Before rendering, a function is flattened into a postfix Program that runs on a small value stack, so
+// evaluating a pixel is a single loop without recursion or allocation. Compilation walks the tree with an
+// explicit stack and checks the types of all the operands once, instead of on every pixel.
+
+typedef enum {
+    VALUE_NUMBER,
+    VALUE_BOOLEAN,
+    VALUE_TRIPLE,
+} Value_Type;
+
+typedef struct {
+    float x, y, z; // a number or a boolean (0 or 1) only uses x
+} Value;
+
+typedef struct {
+    Node_Kind kind;
+    float number; // the value of NK_NUMBER and NK_BOOLEAN
+} Instr;
+
+typedef struct {
+    Instr *items;
+    size_t count;
+    size_t capacity;
+    size_t stack_size; // the deepest the value stack gets
+} Program;
+
+typedef struct {
+    Node *node;
+    bool visited;
+} Compile_Frame;
+
+typedef struct {
+    Compile_Frame *items;
+    size_t count;
+    size_t capacity;
+} Compile_Stack;
+
+typedef struct {
+    Value_Type *items;
+    size_t count;
+    size_t capacity;
+} Type_Stack;
+
+static const char *value_type_names[] = {
+    [VALUE_NUMBER] = "a number",
+    [VALUE_BOOLEAN] = "a boolean",
+    [VALUE_TRIPLE] = "a triple",
+};
+
+// Replaces the types of the operands of `kind`, which are on top of `types`, with the type of its result. On a
+// mismatch returns false with the operand that is wrong and the type it should have been. `types` must have
+// room for one more item.
+bool value_types_apply(Node_Kind kind, Type_Stack *types, size_t *operand, Value_Type *expected) {
+    size_t arity = node_arity(kind);
+    if (types->count < arity) UNREACHABLE("value_types_apply");
+    Value_Type *args = &types->items[types->count - arity];
+    Value_Type result;
+    switch (kind) {
+        case NK_X:
+        case NK_Y:
+        case NK_NUMBER:
+            result = VALUE_NUMBER;
+            break;
+        case NK_BOOLEAN:
+            result = VALUE_BOOLEAN;
+            break;
+
+        case NK_ADD:
+        case NK_MULT:
+        case NK_MOD:
+        case NK_GT:
+        case NK_LT:
+        case NK_GTEQ:
+        case NK_LTEQ:
+        case NK_TRIPLE:
+            for (size_t i = 0; i < arity; ++i) {
+                if (args[i] != VALUE_NUMBER) {
+                    *operand = i;
+                    *expected = VALUE_NUMBER;
+                    return false;
+                }
+            }
+            if      (kind == NK_TRIPLE)                                        result = VALUE_TRIPLE;
+            else if (kind == NK_ADD || kind == NK_MULT || kind == NK_MOD)      result = VALUE_NUMBER;
+            else                                                               result = VALUE_BOOLEAN;
+            break;
+        case NK_IF:
+            if (args[0] != VALUE_BOOLEAN) {
+                *operand = 0;
+                *expected = VALUE_BOOLEAN;
+                return false;
+            }
+            // The branches may be of any type as long as it is the same one, the pixel only ever sees one of them
+            if (args[2] != args[1]) {
+                *operand = 2;
+                *expected = args[1];
+                return false;
+            }
+            result = args[1];
+            break;
+
+        case NK_RANDOM:
+        case NK_RULE:
+        case COUNT_NK:
+        default: UNREACHABLE("value_types_apply");
     }
+    types->count -= arity;
+    types->items[types->count++] = result;
     return true;
 }
 
-bool expect_triple(Node *expr) {
-    if (expr->kind != NK_TRIPLE) {
-        nob_log(ERROR, "%s:%d: expected a triple.", expr->file_path, expr->line);
+// Checks the operands of `node`, which are on top of `types`, and replaces them with the type of the result
+bool compile_check_types(Node *node, Type_Stack *types) {
+    if (node->kind == NK_RANDOM || node->kind == NK_RULE) {
+        nob_log(ERROR, "%s:%d: cannot evaluate a grammar-only node.", node->file_path, node->line);
         return false;
     }
-    return true;
-}
-
-bool expect_boolean(Node *expr) {
-    if (expr->kind != NK_BOOLEAN) {
-        nob_log(ERROR, "%s:%d: expected a boolean.", expr->file_path, expr->line);
+    size_t operand;
+    Value_Type expected;
+    if (!value_types_apply(node->kind, types, &operand, &expected)) {
+        Node *expr = *node_child(node, operand);
+        nob_log(ERROR, "%s:%d: expected %s.", expr->file_path, expr->line, value_type_names[expected]);
         return false;
     }
     return true;
 }
 
-Node *eval(Node *expr, float x, float y) {
-    switch (expr->kind) {
-        case NK_X:      return node_number_loc(expr->file_path, expr->line, x);
-        case NK_Y:      return node_number_loc(expr->file_path, expr->line, y);
-        case NK_BOOLEAN:
-        case NK_NUMBER: return expr;
-        case NK_RANDOM:
-        case NK_RULE: {
-            nob_log(ERROR, "%s:%d: cannot evaluate a grammar-only node.", expr->file_path, expr->line);
-            return NULL;
-        }
-        case NK_ADD: {
-            Node *lhs = eval(expr->as.binop.lhs, x, y);
-            if (!lhs) return NULL;
-            if (!expect_number(lhs)) return NULL;
-            Node *rhs = eval(expr->as.binop.rhs, x, y);
-            if (!rhs) return NULL;
-            if (!expect_number(rhs)) return NULL;
-            return node_number_loc(expr->file_path, expr->line, lhs->as.number + rhs->as.number);
-        }
-        case NK_MULT: {
-            Node *lhs = eval(expr->as.binop.lhs, x, y);
-            if (!lhs) return NULL;
-            if (!expect_number(lhs)) return NULL;
-            Node *rhs = eval(expr->as.binop.rhs, x, y);
-            if (!rhs) return NULL;
-            if (!expect_number(rhs)) return NULL;
-            return node_number_loc(expr->file_path, expr->line, lhs->as.number * rhs->as.number);
-        }
-        case NK_MOD: {
-            Node *lhs = eval(expr->as.binop.lhs, x, y);
-            if (!lhs) return NULL;
-            if (!expect_number(lhs)) return NULL;
-            Node *rhs = eval(expr->as.binop.rhs, x, y);
-            if (!rhs) return NULL;
-            if (!expect_number(rhs)) return NULL;
-            return node_number_loc(expr->file_path, expr->line, fmodf(lhs->as.number, rhs->as.number));
-        }
-        case NK_GT: {
-            Node *lhs = eval(expr->as.binop.lhs, x, y);
-            if (!lhs) return NULL;
-            if (!expect_number(lhs)) return NULL;
-            Node *rhs = eval(expr->as.binop.rhs, x, y);
-            if (!rhs) return NULL;
-            if (!expect_number(rhs)) return NULL;
-            return node_boolean_loc(expr->file_path, expr->line, lhs->as.number > rhs->as.number);
-        }
-        case NK_LT: {
-            Node *lhs = eval(expr->as.binop.lhs, x, y);
-            if (!lhs) return NULL;
-            if (!expect_number(lhs)) return NULL;
-            Node *rhs = eval(expr->as.binop.rhs, x, y);
-            if (!rhs) return NULL;
-            if (!expect_number(rhs)) return NULL;
-            return node_boolean_loc(expr->file_path, expr->line, lhs->as.number < rhs->as.number);
-        }
-        case NK_GTEQ: {
-            Node *lhs = eval(expr->as.binop.lhs, x, y);
-            if (!lhs) return NULL;
-            if (!expect_number(lhs)) return NULL;
-            Node *rhs = eval(expr->as.binop.rhs, x, y);
-            if (!rhs) return NULL;
-            if (!expect_number(rhs)) return NULL;
-            return node_boolean_loc(expr->file_path, expr->line, lhs->as.number >= rhs->as.number);
-        }
-        case NK_LTEQ: {
-            Node *lhs = eval(expr->as.binop.lhs, x, y);
-            if (!lhs) return NULL;
-            if (!expect_number(lhs)) return NULL;
-            Node *rhs = eval(expr->as.binop.rhs, x, y);
-            if (!rhs) return NULL;
-            if (!expect_number(rhs)) return NULL;
-            return node_boolean_loc(expr->file_path, expr->line, lhs->as.number <= rhs->as.number);
-        }
-        case NK_TRIPLE: {
-            Node *first = eval(expr->as.triple.first, x, y);
-            if (!first) return NULL;
-            Node *second = eval(expr->as.triple.second, x, y);
-            if (!second) return NULL;
-            Node *third = eval(expr->as.triple.third, x, y);
-            if (!third) return NULL;
-            return node_triple_loc(expr->file_path, expr->line, first, second, third);
+bool program_compile(Arena *a, Node *f, Program *program) {
+    bool result = true;
+    Arena scratch = {0};
+    Compile_Stack stack = {0};
+    Type_Stack types = {0};
+    memset(program, 0, sizeof(*program));
+
+    arena_da_append(&scratch, &stack, ((Compile_Frame) {.node = f}));
+    while (stack.count > 0) {
+        Compile_Frame frame = stack.items[--stack.count];
+        Node *node = frame.node;
+
+        Node *children[3];
+        size_t children_count = 0;
+        switch (node->kind) {
+            case NK_X:
+            case NK_Y:
+            case NK_RANDOM:
+            case NK_RULE:
+            case NK_NUMBER:
+            case NK_BOOLEAN:
+                break;
+            case NK_ADD:
+            case NK_MULT:
+            case NK_MOD:
+            case NK_GT:
+            case NK_LT:
+            case NK_GTEQ:
+            case NK_LTEQ:
+                children[children_count++] = node->as.binop.lhs;
+                children[children_count++] = node->as.binop.rhs;
+                break;
+            case NK_TRIPLE:
+                children[children_count++] = node->as.triple.first;
+                children[children_count++] = node->as.triple.second;
+                children[children_count++] = node->as.triple.third;
+                break;
+            case NK_IF:
+                children[children_count++] = node->as.iff.cond;
+                children[children_count++] = node->as.iff.then;
+                children[children_count++] = node->as.iff.elze;
+                break;
+            case COUNT_NK:
+            default: UNREACHABLE("program_compile");
         }
-        case NK_IF: {
-            Node *cond = eval(expr->as.iff.cond, x, y);
-            if (!cond) return NULL;
-            if (!expect_boolean(cond)) return NULL;
-            Node *then = eval(expr->as.iff.then, x, y);
-            if (!then) return NULL;
-            // if (!expect_boolean(then)) return NULL;
-            Node *elze = eval(expr->as.iff.elze, x, y);
-            if (!elze) return NULL;
-            // if (!expect_boolean(elze)) return NULL;
-            return cond->as.boolean ? then : elze;
+
+        if (!frame.visited && children_count > 0) {
+            arena_da_append(&scratch, &stack, ((Compile_Frame) {.node = node, .visited = true}));
+            for (size_t i = children_count; i > 0; --i) {
+                arena_da_append(&scratch, &stack, ((Compile_Frame) {.node = children[i - 1]}));
+            }
+            continue;
         }
-        case COUNT_NK:
-        default:
-            UNREACHABLE("eval()");
+
+        // Make room for the value a leaf pushes, every other node pops at least as many as it pushes
+        arena_da_append(&scratch, &types, VALUE_NUMBER);
+        types.count -= 1;
+        if (!compile_check_types(node, &types)) return_defer(false);
+        if (types.count > program->stack_size) program->stack_size = types.count;
+
+        Instr instr = {.kind = node->kind};
+        if (node->kind == NK_NUMBER) instr.number = node->as.number;
+        if (node->kind == NK_BOOLEAN) instr.number = node->as.boolean;
+        arena_da_append(a, program, instr);
+    }
+
+    assert(types.count == 1);
+    if (types.items[0] != VALUE_TRIPLE) {
+        nob_log(ERROR, "%s:%d: expected %s.", f->file_path, f->line, value_type_names[VALUE_TRIPLE]);
+        return_defer(false);
     }
+
+defer:
+    arena_free(&scratch);
+    return result;
 }
 
-bool eval_func(Node *f, float x, float y, Color *c) {
-    Node *res = eval(f, x, y);
-    if (res == NULL) return false;
-    if (!expect_triple(res)) return false;
-    if (!expect_number(res->as.triple.first)) return false;
-    if (!expect_number(res->as.triple.second)) return false;
-    if (!expect_number(res->as.triple.third)) return false;
+// `stack` must have room for program->stack_size values
+void program_run(const Program *program, Value *stack, float x, float y, Color *c) {
+    size_t sp = 0;
+    for (size_t i = 0; i < program->count; ++i) {
+        const Instr *instr = &program->items[i];
+        switch (instr->kind) {
+            case NK_X:       stack[sp++].x = x; break;
+            case NK_Y:       stack[sp++].x = y; break;
+            case NK_NUMBER:
+            case NK_BOOLEAN: stack[sp++].x = instr->number; break;
 
-    c->r = res->as.triple.first->as.number;
-    c->g = res->as.triple.second->as.number;
-    c->b = res->as.triple.third->as.number;
-    return true;
+            case NK_ADD:  sp -= 1; stack[sp - 1].x = stack[sp - 1].x + stack[sp].x; break;
+            case NK_MULT: sp -= 1; stack[sp - 1].x = stack[sp - 1].x * stack[sp].x; break;
+            case NK_MOD:  sp -= 1; stack[sp - 1].x = fmodf(stack[sp - 1].x, stack[sp].x); break;
+            case NK_GT:   sp -= 1; stack[sp - 1].x = stack[sp - 1].x >  stack[sp].x; break;
+            case NK_LT:   sp -= 1; stack[sp - 1].x = stack[sp - 1].x <  stack[sp].x; break;
+            case NK_GTEQ: sp -= 1; stack[sp - 1].x = stack[sp - 1].x >= stack[sp].x; break;
+            case NK_LTEQ: sp -= 1; stack[sp - 1].x = stack[sp - 1].x <= stack[sp].x; break;
+
+            case NK_TRIPLE:
+                sp -= 2;
+                stack[sp - 1].y = stack[sp].x;
+                stack[sp - 1].z = stack[sp + 1].x;
+                break;
+            case NK_IF:
+                sp -= 2;
+                stack[sp - 1] = stack[sp - 1].x != 0.0f ? stack[sp] : stack[sp + 1];
+                break;
+
+            case NK_RANDOM:
+            case NK_RULE:
+            case COUNT_NK:
+            default: UNREACHABLE("program_run");
+        }
+    }
+    assert(sp == 1);
+    c->r = stack[0].x;
+    c->g = stack[0].y;
+    c->b = stack[0].z;
 }
 
-bool render_pixels(Node *f) {
-    for (size_t y = 0; y < HEIGHT; ++y) {
-        float ny = (float)y / HEIGHT * 2.0f - 1;
-        for (size_t x = 0; x < WIDTH; ++x) {
-            float nx = (float)x / WIDTH * 2.0f - 1;
+// Renders the `width`x`height` block of a `full_width`x`full_height` image that starts at (`x0`, `y0`).
+// Rows of the block are written `stride` pixels apart, so the block can live inside a larger buffer.
+void render_pixels_rect(const Program *program, RGBA32 *out, size_t stride,
+                        size_t x0, size_t y0, size_t width, size_t height,
+                        size_t full_width, size_t full_height) {
+    Arena scratch = {0};
+    Value *stack = arena_alloc(&scratch, program->stack_size*sizeof(Value));
+    for (size_t y = 0; y < height; ++y) {
+        float ny = (float)(y0 + y) / full_height * 2.0f - 1;
+        for (size_t x = 0; x < width; ++x) {
+            float nx = (float)(x0 + x) / full_width * 2.0f - 1;
             Color c;
-            if (!eval_func(f, nx, ny, &c)) return false;
-            size_t index = y * WIDTH + x;
-            pixels[index].r = (c.r + 1) / 2 * 255;
-            pixels[index].g = (c.g + 1) / 2 * 255;
-            pixels[index].b = (c.b + 1) / 2 * 255;
-            pixels[index].a = 255;
-
+            program_run(program, stack, nx, ny, &c);
+            size_t index = y * stride + x;
+            out[index].r = (c.r + 1) / 2 * 255;
+            out[index].g = (c.g + 1) / 2 * 255;
+            out[index].b = (c.b + 1) / 2 * 255;
+            out[index].a = 255;
         }
     }
-    return true;
+    arena_free(&scratch);
+}
+
+bool render_pixels(Node *f) {
+    Arena_Mark mark = arena_snapshot(&node_arena);
+    Program program;
+    bool ok = program_compile(&node_arena, f, &program);
+    if (ok) render_pixels_rect(&program, pixels, WIDTH, 0, 0, WIDTH, HEIGHT, WIDTH, HEIGHT);
+    arena_rewind(&node_arena, mark);
+    return ok;
 }
 
 void grammar_print(Grammar grammar) {
@@ -458,65 +771,683 @@ void grammar_print(Grammar grammar) {
         for (size_t j = 0; j < branches->count; ++j) {
             if (j > 0) printf(" | ");
             node_print(branches->items[j].node);
-            printf(" [%.02f]", branches->items[j].probability);
+            printf(" [%g]", branches->items[j].probability);
         }
         printf("\n");
     }
 }
 
-float rand_float(void) {
-    return (float)rand()/RAND_MAX;
+// Counter-based random numbers (Philox4x32-10, Salmon et al. "Parallel Random Numbers: As Easy as 1, 2, 3")
+//
+// A number is a pure function of the seed (the Philox key) and of where in the derivation it is drawn (the
+// counter), so there is no global state. Every place that draws gets its own stream: rng_split() derives the
+// stream of the i-th child from the stream of its parent, and a stream counts the draws made from it. That
+// makes every subtree independent of the order (or the thread) in which its siblings are generated, while the
+// tree for a seed stays bit-identical.
+
+typedef struct {
+    uint32_t key[2];
+    uint64_t path;      // position in the derivation
+    uint32_t counter;   // blocks already drawn at this position
+    uint32_t block[4];
+    size_t block_count; // how many numbers of `block` are still unused
+} Rng;
+
+#define PHILOX_M0 0xD2511F53
+#define PHILOX_M1 0xCD9E8D57
+#define PHILOX_W0 0x9E3779B9
+#define PHILOX_W1 0xBB67AE85
+
+void philox4x32_10(const uint32_t key[2], const uint32_t counter[4], uint32_t out[4]) {
+    uint32_t k0 = key[0], k1 = key[1];
+    uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+    for (size_t round = 0; round < 10; ++round) {
+        uint64_t p0 = (uint64_t)PHILOX_M0*c0;
+        uint64_t p1 = (uint64_t)PHILOX_M1*c2;
+        c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+        c1 = (uint32_t)p1;
+        c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+        c3 = (uint32_t)p0;
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
 }
 
-Node *gen_rule(Grammar grammar, size_t rule, int depth);
+Rng rng_new(uint64_t seed) {
+    Rng rng = {0};
+    rng.key[0] = (uint32_t)seed;
+    rng.key[1] = (uint32_t)(seed >> 32);
+    return rng;
+}
 
-Node *gen_node(Grammar grammar, Node *node, int depth) {
-    switch (node->kind) {
-        case NK_X:
-        case NK_Y:
-        case NK_NUMBER:
-        case NK_BOOLEAN:
-            return node;
+// splitmix64 finalizer, spreads the child index over all bits of the path
+uint64_t rng_mix(uint64_t x) {
+    x = (x ^ (x >> 30))*0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27))*0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
 
-        case NK_ADD:
-        case NK_MULT:
-        case NK_MOD:
-        case NK_GT:
-        case NK_LT:
-        case NK_GTEQ:
-        case NK_LTEQ: {
-            Node *lhs = gen_node(grammar, node->as.binop.lhs, depth);
-            if (!lhs) return NULL;
-            Node *rhs = gen_node(grammar, node->as.binop.rhs, depth);
-            if (!rhs) return NULL;
-            return node_binop_loc(node->file_path, node->line, node->kind, lhs, rhs);
-        }
+Rng rng_split(Rng rng, uint64_t index) {
+    Rng child = {0};
+    memcpy(child.key, rng.key, sizeof(child.key));
+    child.path = rng_mix(rng.path + 0x9E3779B97F4A7C15ULL*(index + 1));
+    return child;
+}
 
-        case NK_TRIPLE: {
-            Node *first = gen_node(grammar, node->as.triple.first, depth);
-            if (!first) return NULL;
-            Node *second = gen_node(grammar, node->as.triple.second, depth);
-            if (!second) return NULL;
-            Node *third = gen_node(grammar, node->as.triple.third, depth);
-            if (!third) return NULL;
-            return node_triple_loc(node->file_path, node->line, first, second, third);
-        }
+uint32_t rng_u32(Rng *rng) {
+    if (rng->block_count == 0) {
+        uint32_t counter[4] = {rng->counter, 0, (uint32_t)rng->path, (uint32_t)(rng->path >> 32)};
+        philox4x32_10(rng->key, counter, rng->block);
+        rng->counter += 1;
+        rng->block_count = 4;
+    }
+    return rng->block[4 - rng->block_count--];
+}
+
+// Uniform in [0, 1)
+float rng_float(Rng *rng) {
+    return (rng_u32(rng) >> 8)*(1.0f/(1 << 24));
+}
+
+// Vose's alias method (M. D. Vose, "A linear algorithm for generating random numbers with a given distribution")
+//
+// Every branch gets a column. Column i keeps its own branch with probability threshold[i]/2^32 and hands the
+// rest of its share over to alias[i], so picking a branch costs one column draw and one coin flip no matter how
+// many branches the rule has.
+bool alias_table_build(Arena *a, const Grammar_Branch *branches, size_t count, Alias_Table *table) {
+    double sum = 0.0;
+    for (size_t i = 0; i < count; ++i) {
+        if (!(branches[i].probability >= 0.0f)) {
+            nob_log(ERROR, "%s:%d: branch probability must not be negative, got %f",
+                    branches[i].node->file_path, branches[i].node->line, branches[i].probability);
+            return false;
+        }
+        sum += branches[i].probability;
+    }
+    if (count == 0 || sum <= 0.0) {
+        nob_log(ERROR, "the probabilities of a rule must not add up to zero");
+        return false;
+    }
+
+    table->threshold = arena_alloc(a, count*sizeof(*table->threshold));
+    table->alias = arena_alloc(a, count*sizeof(*table->alias));
+
+    double *scaled = malloc(count*sizeof(*scaled));
+    size_t *small = malloc(count*sizeof(*small));
+    size_t *large = malloc(count*sizeof(*large));
+    assert(scaled != NULL && small != NULL && large != NULL && "Buy more RAM lol");
+
+    size_t small_count = 0, large_count = 0;
+    for (size_t i = 0; i < count; ++i) {
+        scaled[i] = branches[i].probability/sum*count;
+        if (scaled[i] < 1.0) small[small_count++] = i;
+        else                 large[large_count++] = i;
+    }
+
+    while (small_count > 0 && large_count > 0) {
+        size_t s = small[--small_count];
+        size_t l = large[--large_count];
+        table->threshold[s] = scaled[s]*4294967296.0;
+        table->alias[s] = l;
+        scaled[l] -= 1.0 - scaled[s];
+        if (scaled[l] < 1.0) small[small_count++] = l;
+        else                 large[large_count++] = l;
+    }
+    // Whatever is left is 1.0 up to rounding errors, such columns never hand over to their alias
+    while (large_count > 0) {
+        size_t l = large[--large_count];
+        table->threshold[l] = UINT32_MAX;
+        table->alias[l] = l;
+    }
+    while (small_count > 0) {
+        size_t s = small[--small_count];
+        table->threshold[s] = UINT32_MAX;
+        table->alias[s] = s;
+    }
+
+    free(scaled);
+    free(small);
+    free(large);
+    return true;
+}
+
+size_t alias_table_sample(const Alias_Table *table, size_t count, Rng *rng) {
+    size_t column = ((uint64_t)rng_u32(rng)*count) >> 32;
+    return rng_u32(rng) < table->threshold[column] ? column : table->alias[column];
+}
+
+// Minimum depth analysis
+//
+// gen_rule() needs depth >= 1 and passes depth - 1 to the branch, and gen_node() passes depth - 1 to every rule it
+// refers to. So a branch needs 1 more than the neediest rule it refers to (0 if it refers to none), and a rule
+// needs 1 more than its least needy branch. Iterating that from "never terminates" reaches the least fixpoint.
+
+#define MIN_DEPTH_NEVER INT_MAX
+
+int node_min_depth(Grammar *grammar, Node *node) {
+    switch (node->kind) {
+        case NK_X:
+        case NK_Y:
+        case NK_RANDOM:
+        case NK_NUMBER:
+        case NK_BOOLEAN:
+            return 0;
+
+        case NK_RULE: {
+            assert((size_t)node->as.rule < grammar->count);
+            int rule_min_depth = grammar->items[node->as.rule].min_depth;
+            return rule_min_depth == MIN_DEPTH_NEVER ? MIN_DEPTH_NEVER : rule_min_depth + 1;
+        }
+
+        case NK_ADD:
+        case NK_MULT:
+        case NK_MOD:
+        case NK_GT:
+        case NK_LT:
+        case NK_GTEQ:
+        case NK_LTEQ: {
+            int lhs = node_min_depth(grammar, node->as.binop.lhs);
+            int rhs = node_min_depth(grammar, node->as.binop.rhs);
+            return lhs > rhs ? lhs : rhs;
+        }
+
+        case NK_TRIPLE:
+        case NK_IF: {
+            Node *children[3];
+            if (node->kind == NK_TRIPLE) {
+                children[0] = node->as.triple.first;
+                children[1] = node->as.triple.second;
+                children[2] = node->as.triple.third;
+            } else {
+                children[0] = node->as.iff.cond;
+                children[1] = node->as.iff.then;
+                children[2] = node->as.iff.elze;
+            }
+            int result = 0;
+            for (size_t i = 0; i < ARRAY_LEN(children); ++i) {
+                int child = node_min_depth(grammar, children[i]);
+                if (child > result) result = child;
+            }
+            return result;
+        }
+
+        case COUNT_NK:
+        default: UNREACHABLE("node_min_depth");
+    }
+}
+
+bool grammar_analyze_min_depth(Grammar *grammar) {
+    for (size_t i = 0; i < grammar->count; ++i) grammar->items[i].min_depth = MIN_DEPTH_NEVER;
+
+    for (bool changed = true; changed; ) {
+        changed = false;
+        for (size_t i = 0; i < grammar->count; ++i) {
+            Grammar_Branches *branches = &grammar->items[i];
+            int rule_min_depth = MIN_DEPTH_NEVER;
+            for (size_t j = 0; j < branches->count; ++j) {
+                Grammar_Branch *branch = &branches->items[j];
+                branch->min_depth = node_min_depth(grammar, branch->node);
+                if (branch->min_depth != MIN_DEPTH_NEVER && branch->min_depth + 1 < rule_min_depth) {
+                    rule_min_depth = branch->min_depth + 1;
+                }
+            }
+            if (rule_min_depth < branches->min_depth) {
+                branches->min_depth = rule_min_depth;
+                changed = true;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < grammar->count; ++i) {
+        if (grammar->items[i].min_depth == MIN_DEPTH_NEVER) {
+            nob_log(ERROR, "rule %zu can never terminate", i);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Groups the branches of a rule by the depth they need. Level k holds every branch that needs at most
+// levels[k].min_depth, so the generator picks the last level that fits into the depth it has left and
+// samples from the renormalized weights of that level alone.
+bool grammar_build_levels(Arena *a, Grammar_Branches *branches) {
+    bool result = true;
+    Grammar_Branch *candidates = malloc(branches->count*sizeof(*candidates));
+    assert(candidates != NULL && "Buy more RAM lol");
+
+    branches->levels = arena_alloc(a, branches->count*sizeof(*branches->levels));
+    branches->levels_count = 0;
+
+    int previous = -1;
+    for (;;) {
+        // The next level is the smallest depth requirement above the previous level
+        int next = MIN_DEPTH_NEVER;
+        for (size_t j = 0; j < branches->count; ++j) {
+            int d = branches->items[j].min_depth;
+            if (d > previous && d < next) next = d;
+        }
+        if (next == MIN_DEPTH_NEVER) break;
+
+        Grammar_Level *level = &branches->levels[branches->levels_count++];
+        level->min_depth = next;
+        level->branches = arena_alloc(a, branches->count*sizeof(*level->branches));
+        level->count = 0;
+        for (size_t j = 0; j < branches->count; ++j) {
+            if (branches->items[j].min_depth <= next) {
+                candidates[level->count] = branches->items[j];
+                level->branches[level->count] = j;
+                level->count += 1;
+            }
+        }
+        if (!alias_table_build(a, candidates, level->count, &level->alias)) return_defer(false);
+        previous = next;
+    }
+
+defer:
+    free(candidates);
+    return result;
+}
+
+// The level gen_rule() samples from when it has `depth` left, `depth` must be at least branches->min_depth
+Grammar_Level *grammar_level_for_depth(Grammar_Branches *branches, int depth) {
+    assert(depth >= branches->min_depth);
+    size_t l = branches->levels_count;
+    while (branches->levels[l - 1].min_depth > depth - 1) l -= 1;
+    return &branches->levels[l - 1];
+}
+
+// Precomputes everything about the grammar that does not depend on the seed. Must be called once after the
+// grammar is built and before any generation.
+bool grammar_compile(Arena *a, Grammar *grammar) {
+    if (!grammar_analyze_min_depth(grammar)) return false;
+    for (size_t i = 0; i < grammar->count; ++i) {
+        Grammar_Branches *branches = &grammar->items[i];
+        if (!alias_table_build(a, branches->items, branches->count, &branches->alias) ||
+            !grammar_build_levels(a, branches)) {
+            nob_log(ERROR, "could not compile rule %zu", i);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Tree size and cost estimation
+//
+// Under the min-depth generator the subtrees of a node are independent and their distribution depends only on
+// the rule and the depth they are generated at, so the generator is a branching process indexed by depth. The
+// expectation of the number of nodes of every kind, and the second moment of the tree size, follow from simple
+// recurrences over (rule, depth), computed bottom-up from depth 0:
+//
+//     E[S(rule, d)]   = sum of p(b | d) * E[S(b, d - 1)] over the branches b that fit into depth d
+//     E[S(node, d)]   = 1 + sum of E[S(child, d)]            (children are independent)
+//     Var[S(node, d)] = sum of Var[S(child, d)]
+//     E[S(rule, d)^2] = sum of p(b | d) * E[S(b, d - 1)^2]  (a rule is a mixture of its branches)
+
+// Relative cost of evaluating one node of every kind. Only the ratios matter, `estimate` calibrates the absolute
+// time of a unit by rendering a few samples.
+static const double node_eval_cost[COUNT_NK] = {
+    [NK_X]       = 1.0,
+    [NK_Y]       = 1.0,
+    [NK_RANDOM]  = 1.0,
+    [NK_RULE]    = 1.0,
+    [NK_NUMBER]  = 1.0,
+    [NK_BOOLEAN] = 1.0,
+    [NK_ADD]     = 1.0,
+    [NK_MULT]    = 1.0,
+    [NK_MOD]     = 4.0,
+    [NK_GT]      = 1.0,
+    [NK_LT]      = 1.0,
+    [NK_GTEQ]    = 1.0,
+    [NK_LTEQ]    = 1.0,
+    [NK_TRIPLE]  = 1.0,
+    [NK_IF]      = 1.0,
+};
+
+typedef struct {
+    double kinds[COUNT_NK]; // expected number of nodes of every kind
+    double size;            // expected number of nodes
+    double size_sq;         // expected square of the number of nodes
+} Tree_Estimate;
+
+typedef struct {
+    Grammar grammar;
+    int depth;
+    Tree_Estimate *items; // items[d*grammar.count + rule] for every depth 0..depth
+} Grammar_Estimates;
+
+// Deepest table grammar_estimate() is asked for, a few MiB per rule
+#define ESTIMATE_MAX_DEPTH 16384
+
+double tree_estimate_cost(const Tree_Estimate *e) {
+    double cost = 0.0;
+    for (size_t k = 0; k < COUNT_NK; ++k) cost += e->kinds[k]*node_eval_cost[k];
+    return cost;
+}
+
+Tree_Estimate *grammar_estimate_at(Grammar_Estimates *estimates, size_t rule, int depth) {
+    assert(0 <= depth && depth <= estimates->depth);
+    return &estimates->items[depth*estimates->grammar.count + rule];
+}
+
+// Estimate of the subtree that gen_node() produces out of `node` at `depth`
+Tree_Estimate node_estimate(Grammar_Estimates *estimates, Node *node, int depth) {
+    Tree_Estimate e = {0};
+    switch (node->kind) {
+        case NK_X:
+        case NK_Y:
+        case NK_NUMBER:
+        case NK_BOOLEAN:
+            e.kinds[node->kind] = 1.0;
+            e.size = 1.0;
+            e.size_sq = 1.0;
+            return e;
+
+        case NK_RANDOM:
+            e.kinds[NK_NUMBER] = 1.0;
+            e.size = 1.0;
+            e.size_sq = 1.0;
+            return e;
+
+        case NK_RULE:
+            return *grammar_estimate_at(estimates, node->as.rule, depth - 1);
+
+        case NK_ADD:
+        case NK_MULT:
+        case NK_MOD:
+        case NK_GT:
+        case NK_LT:
+        case NK_GTEQ:
+        case NK_LTEQ:
+        case NK_TRIPLE:
+        case NK_IF: {
+            Node *children[3];
+            size_t children_count = 0;
+            if (node->kind == NK_TRIPLE) {
+                children[children_count++] = node->as.triple.first;
+                children[children_count++] = node->as.triple.second;
+                children[children_count++] = node->as.triple.third;
+            } else if (node->kind == NK_IF) {
+                children[children_count++] = node->as.iff.cond;
+                children[children_count++] = node->as.iff.then;
+                children[children_count++] = node->as.iff.elze;
+            } else {
+                children[children_count++] = node->as.binop.lhs;
+                children[children_count++] = node->as.binop.rhs;
+            }
+
+            e.kinds[node->kind] = 1.0;
+            e.size = 1.0;
+            double variance = 0.0;
+            for (size_t i = 0; i < children_count; ++i) {
+                Tree_Estimate child = node_estimate(estimates, children[i], depth);
+                for (size_t k = 0; k < COUNT_NK; ++k) e.kinds[k] += child.kinds[k];
+                e.size += child.size;
+                variance += child.size_sq - child.size*child.size;
+            }
+            e.size_sq = variance + e.size*e.size;
+            return e;
+        }
+
+        case COUNT_NK:
+        default: UNREACHABLE("node_estimate");
+    }
+}
+
+Grammar_Estimates grammar_estimate(Grammar grammar, int depth) {
+    Grammar_Estimates estimates = {
+        .grammar = grammar,
+        .depth = depth,
+    };
+    estimates.items = calloc((depth + 1)*grammar.count, sizeof(*estimates.items));
+    assert(estimates.items != NULL && "Buy more RAM lol");
+
+    for (int d = 0; d <= depth; ++d) {
+        for (size_t rule = 0; rule < grammar.count; ++rule) {
+            Grammar_Branches *branches = &grammar.items[rule];
+            if (d < branches->min_depth) continue;
+
+            Grammar_Level *level = grammar_level_for_depth(branches, d);
+
+            double sum = 0.0;
+            for (size_t i = 0; i < level->count; ++i) sum += branches->items[level->branches[i]].probability;
+
+            Tree_Estimate *e = grammar_estimate_at(&estimates, rule, d);
+            for (size_t i = 0; i < level->count; ++i) {
+                Grammar_Branch *branch = &branches->items[level->branches[i]];
+                double p = branch->probability/sum;
+                Tree_Estimate b = node_estimate(&estimates, branch->node, d - 1);
+                for (size_t k = 0; k < COUNT_NK; ++k) e->kinds[k] += p*b.kinds[k];
+                e->size += p*b.size;
+                e->size_sq += p*b.size_sq;
+            }
+        }
+    }
+    return estimates;
+}
+
+// Budgeted generation
+//
+// Caps the cost of every generated tree, where a tree costs the sum of cost[kind] over its nodes (1 for every
+// kind caps the node count, node_eval_cost caps the per-pixel evaluation cost). min_cost[d*grammar.count + rule]
+// is the cheapest tree gen_rule() can possibly produce for `rule` at depth `d`. While generating, the cheapest
+// completion of every subtree that is still pending is held in reserve, and a rule only picks among the
+// branches whose cheapest completion fits into what is left, so the cap is never exceeded. On top of that the
+// weight of a branch is scaled down once its expected cost no longer fits, which favors terminals as the budget
+// runs out.
+
+typedef struct {
+    double cost[COUNT_NK];
+    double limit;
+    int depth;
+    double *min_cost;
+    Grammar_Estimates estimates;
+} Gen_Budget;
+
+double gen_budget_min_cost_at(Gen_Budget *budget, size_t rule, int depth) {
+    if (depth < 0) return INFINITY;
+    assert(depth <= budget->depth);
+    return budget->min_cost[depth*budget->estimates.grammar.count + rule];
+}
+
+// Cheapest subtree gen_node() can produce out of `node` at `depth`
+double node_min_cost(Gen_Budget *budget, Node *node, int depth) {
+    switch (node->kind) {
+        case NK_X:
+        case NK_Y:
+        case NK_NUMBER:
+        case NK_BOOLEAN:
+            return budget->cost[node->kind];
+        case NK_RANDOM:
+            return budget->cost[NK_NUMBER];
+        case NK_RULE:
+            return gen_budget_min_cost_at(budget, node->as.rule, depth - 1);
+
+        case NK_ADD:
+        case NK_MULT:
+        case NK_MOD:
+        case NK_GT:
+        case NK_LT:
+        case NK_GTEQ:
+        case NK_LTEQ:
+            return budget->cost[node->kind] + node_min_cost(budget, node->as.binop.lhs, depth) + node_min_cost(budget, node->as.binop.rhs, depth);
+        case NK_TRIPLE:
+            return budget->cost[node->kind] + node_min_cost(budget, node->as.triple.first, depth) +
+                   node_min_cost(budget, node->as.triple.second, depth) + node_min_cost(budget, node->as.triple.third, depth);
+        case NK_IF:
+            return budget->cost[node->kind] + node_min_cost(budget, node->as.iff.cond, depth) +
+                   node_min_cost(budget, node->as.iff.then, depth) + node_min_cost(budget, node->as.iff.elze, depth);
+
+        case COUNT_NK:
+        default: UNREACHABLE("node_min_cost");
+    }
+}
+
+// `cost` is the cost of one node of every kind, `limit` the most a single tree may cost
+void gen_budget_init(Gen_Budget *budget, Grammar grammar, int depth, const double cost[COUNT_NK], double limit) {
+    memcpy(budget->cost, cost, sizeof(budget->cost));
+    budget->limit = limit;
+    budget->depth = depth;
+    budget->estimates = grammar_estimate(grammar, depth);
+    budget->min_cost = malloc((depth + 1)*grammar.count*sizeof(*budget->min_cost));
+    assert(budget->min_cost != NULL && "Buy more RAM lol");
+
+    for (int d = 0; d <= depth; ++d) {
+        for (size_t rule = 0; rule < grammar.count; ++rule) {
+            Grammar_Branches *branches = &grammar.items[rule];
+            double min_cost = INFINITY;
+            if (d >= branches->min_depth) {
+                Grammar_Level *level = grammar_level_for_depth(branches, d);
+                for (size_t i = 0; i < level->count; ++i) {
+                    double branch_cost = node_min_cost(budget, branches->items[level->branches[i]].node, d - 1);
+                    if (branch_cost < min_cost) min_cost = branch_cost;
+                }
+            }
+            budget->min_cost[d*grammar.count + rule] = min_cost;
+        }
+    }
+}
+
+void gen_budget_free(Gen_Budget *budget) {
+    free(budget->min_cost);
+    free(budget->estimates.items);
+}
+
+// Expected cost of the subtree gen_node() produces out of `node` at `depth` without a budget
+double node_expected_cost(Gen_Budget *budget, Node *node, int depth) {
+    Tree_Estimate e = node_estimate(&budget->estimates, node, depth);
+    double cost = 0.0;
+    for (size_t k = 0; k < COUNT_NK; ++k) cost += e.kinds[k]*budget->cost[k];
+    return cost;
+}
+
+typedef struct {
+    Grammar grammar;
+    // Sample from all the branches of a rule and start over when the depth runs out, the way generation worked
+    // before the min-depth analysis. Only kept around to compare against.
+    bool retry;
+    size_t attempts;        // rule expansions started
+    size_t failures;        // rule expansions that ran out of depth
+    size_t bytes_discarded; // node_arena bytes of failed attempts that were rewound
+
+    // When not NULL, the tree costs at most budget->limit. Only supported by the min-depth generator.
+    Gen_Budget *budget;
+    double budget_left;     // what the tree may still spend
+    double reserved;        // the part of budget_left held for the cheapest completion of pending subtrees
+} Gen;
+
+void gen_pay(Gen *gen, Node_Kind kind) {
+    if (gen->budget != NULL) gen->budget_left -= gen->budget->cost[kind];
+}
+
+// Holds (or with a negative `sign`, releases) the cheapest completion of a subtree that is generated later
+void gen_reserve(Gen *gen, Node *node, int depth, double sign) {
+    if (gen->budget != NULL) gen->reserved += sign*node_min_cost(gen->budget, node, depth);
+}
+
+// Sampling weight of `branch` under the budget, negative when its cheapest completion does not fit
+double gen_branch_weight(Gen *gen, Grammar_Branch *branch, int depth, double available) {
+    if (node_min_cost(gen->budget, branch->node, depth - 1) > available) return -1.0;
+    double weight = branch->probability;
+    double expected = node_expected_cost(gen->budget, branch->node, depth - 1);
+    if (expected > available) weight *= available/expected;
+    return weight;
+}
+
+// Picks a branch of `level` whose cheapest completion fits into the budget
+size_t gen_choose_budgeted(Gen *gen, Grammar_Branches *branches, Grammar_Level *level, int depth, Rng *rng) {
+    double available = gen->budget_left - gen->reserved;
+
+    double sum = 0.0;
+    size_t last = level->count;
+    for (size_t i = 0; i < level->count; ++i) {
+        double weight = gen_branch_weight(gen, &branches->items[level->branches[i]], depth, available);
+        if (weight < 0.0) continue;
+        sum += weight;
+        last = i;
+    }
+    // The caller keeps at least the cheapest completion of the rule available, so something always fits
+    assert(last < level->count);
+
+    double target = rng_float(rng)*sum;
+    for (size_t i = 0; i < level->count; ++i) {
+        double weight = gen_branch_weight(gen, &branches->items[level->branches[i]], depth, available);
+        if (weight < 0.0) continue;
+        if (target < weight) return level->branches[i];
+        target -= weight;
+    }
+    return level->branches[last];
+}
+
+Node *gen_rule(Gen *gen, size_t rule, int depth, Rng rng);
+
+// Every child of `node` draws from its own stream split off `rng` by the child's position, so the children
+// could be generated in any order without changing the result.
+Node *gen_node(Gen *gen, Node *node, int depth, Rng rng) {
+    switch (node->kind) {
+        case NK_X:
+        case NK_Y:
+        case NK_NUMBER:
+        case NK_BOOLEAN:
+            gen_pay(gen, node->kind);
+            return node;
+
+        case NK_ADD:
+        case NK_MULT:
+        case NK_MOD:
+        case NK_GT:
+        case NK_LT:
+        case NK_GTEQ:
+        case NK_LTEQ: {
+            gen_pay(gen, node->kind);
+            gen_reserve(gen, node->as.binop.rhs, depth, 1);
+            Node *lhs = gen_node(gen, node->as.binop.lhs, depth, rng_split(rng, 0));
+            if (!lhs) return NULL;
+            gen_reserve(gen, node->as.binop.rhs, depth, -1);
+            Node *rhs = gen_node(gen, node->as.binop.rhs, depth, rng_split(rng, 1));
+            if (!rhs) return NULL;
+            return node_binop_loc(node->file_path, node->line, node->kind, lhs, rhs);
+        }
+
+        case NK_TRIPLE: {
+            gen_pay(gen, node->kind);
+            gen_reserve(gen, node->as.triple.second, depth, 1);
+            gen_reserve(gen, node->as.triple.third, depth, 1);
+            Node *first = gen_node(gen, node->as.triple.first, depth, rng_split(rng, 0));
+            if (!first) return NULL;
+            gen_reserve(gen, node->as.triple.second, depth, -1);
+            Node *second = gen_node(gen, node->as.triple.second, depth, rng_split(rng, 1));
+            if (!second) return NULL;
+            gen_reserve(gen, node->as.triple.third, depth, -1);
+            Node *third = gen_node(gen, node->as.triple.third, depth, rng_split(rng, 2));
+            if (!third) return NULL;
+            return node_triple_loc(node->file_path, node->line, first, second, third);
+        }
         case NK_IF: {
-            Node *cond = gen_node(grammar, node->as.iff.cond, depth);
+            gen_pay(gen, node->kind);
+            gen_reserve(gen, node->as.iff.then, depth, 1);
+            gen_reserve(gen, node->as.iff.elze, depth, 1);
+            Node *cond = gen_node(gen, node->as.iff.cond, depth, rng_split(rng, 0));
             if (!cond) return NULL;
-            Node *then = gen_node(grammar, node->as.iff.then, depth);
+            gen_reserve(gen, node->as.iff.then, depth, -1);
+            Node *then = gen_node(gen, node->as.iff.then, depth, rng_split(rng, 1));
             if (!then) return NULL;
-            Node *elze = gen_node(grammar, node->as.iff.elze, depth);
+            gen_reserve(gen, node->as.iff.elze, depth, -1);
+            Node *elze = gen_node(gen, node->as.iff.elze, depth, rng_split(rng, 2));
             if (!elze) return NULL;
             return node_if_loc(node->file_path, node->line, cond, then, elze);
             break;
         }
 
         case NK_RULE: {
-            return gen_rule(grammar, node->as.rule, depth - 1);
+            return gen_rule(gen, node->as.rule, depth - 1, rng);
         }
         case NK_RANDOM: {
-            return node_number_loc(node->file_path, node->line, rand_float() * 2.0f - 1.0f);
+            gen_pay(gen, NK_NUMBER);
+            return node_number_loc(node->file_path, node->line, rng_float(&rng) * 2.0f - 1.0f);
         }
 
         case COUNT_NK:
@@ -525,38 +1456,166 @@ Node *gen_node(Grammar grammar, Node *node, int depth) {
     }
 }
 
-#define GEN_RULE_MAX_ATTEMPTS 10
+// The branch of `rule` that the min-depth generator expands at `depth`, NULL when `depth` is not enough for any.
+// `branch_rng` receives the stream the branch is expanded with.
+Node *gen_rule_branch(Gen *gen, size_t rule, int depth, Rng rng, Rng *branch_rng) {
+    Grammar_Branches *branches = &gen->grammar.items[rule];
+    gen->attempts += 1;
+    if (depth < branches->min_depth) {
+        gen->failures += 1;
+        return NULL;
+    }
+    Grammar_Level *level = grammar_level_for_depth(branches, depth);
+    Rng choice = rng_split(rng, 0);
+    size_t i = gen->budget != NULL
+        ? gen_choose_budgeted(gen, branches, level, depth, &choice)
+        : level->branches[alias_table_sample(&level->alias, level->count, &choice)];
+    *branch_rng = rng_split(choice, 0);
+    return branches->items[i].node;
+}
 
-Node *gen_rule(Grammar grammar, size_t rule, int depth) {
-    if (depth <= 0) return NULL;
+typedef struct {
+    Node *node;     // the grammar node to expand
+    int depth;
+    Rng rng;
+    Node **dest;    // where the generated subtree goes
+    bool reserved;  // the cheapest completion of `node` is held in gen->reserved
+} Gen_Task;
+
+typedef struct {
+    Gen_Task *items;
+    size_t count;
+    size_t capacity;
+} Gen_Tasks;
+
+// The min-depth generator without recursion, so the depth of the tree is only limited by memory. It produces
+// the same tree as gen_node() would out of the same streams: a node is allocated before its children, which are
+// pushed in reverse so the first one is expanded (with all of its subtree) first, and the budget is paid,
+// reserved and released in the same order.
+Node *gen_tree(Gen *gen, size_t rule, int depth, Rng rng) {
+    Node *result = NULL;
+    Arena scratch = {0};
+    Gen_Tasks tasks = {0};
+
+    Rng branch_rng;
+    Node *branch = gen_rule_branch(gen, rule, depth, rng, &branch_rng);
+    if (branch == NULL) return NULL;
+    arena_da_append(&scratch, &tasks, ((Gen_Task) {branch, depth - 1, branch_rng, &result, false}));
+
+    while (tasks.count > 0) {
+        Gen_Task task = tasks.items[--tasks.count];
+        Node *node = task.node;
+        if (task.reserved) gen_reserve(gen, node, task.depth, -1);
 
-    assert(rule < grammar.count);
+        switch (node->kind) {
+            case NK_X:
+            case NK_Y:
+            case NK_NUMBER:
+            case NK_BOOLEAN:
+                gen_pay(gen, node->kind);
+                *task.dest = node;
+                break;
+
+            case NK_ADD:
+            case NK_MULT:
+            case NK_MOD:
+            case NK_GT:
+            case NK_LT:
+            case NK_GTEQ:
+            case NK_LTEQ: {
+                gen_pay(gen, node->kind);
+                gen_reserve(gen, node->as.binop.rhs, task.depth, 1);
+                Node *out = node_binop_loc(node->file_path, node->line, node->kind, NULL, NULL);
+                *task.dest = out;
+                arena_da_append(&scratch, &tasks, ((Gen_Task) {node->as.binop.rhs, task.depth, rng_split(task.rng, 1), &out->as.binop.rhs, true}));
+                arena_da_append(&scratch, &tasks, ((Gen_Task) {node->as.binop.lhs, task.depth, rng_split(task.rng, 0), &out->as.binop.lhs, false}));
+                break;
+            }
+
+            case NK_TRIPLE: {
+                gen_pay(gen, node->kind);
+                gen_reserve(gen, node->as.triple.second, task.depth, 1);
+                gen_reserve(gen, node->as.triple.third, task.depth, 1);
+                Node *out = node_triple_loc(node->file_path, node->line, NULL, NULL, NULL);
+                *task.dest = out;
+                arena_da_append(&scratch, &tasks, ((Gen_Task) {node->as.triple.third,  task.depth, rng_split(task.rng, 2), &out->as.triple.third,  true}));
+                arena_da_append(&scratch, &tasks, ((Gen_Task) {node->as.triple.second, task.depth, rng_split(task.rng, 1), &out->as.triple.second, true}));
+                arena_da_append(&scratch, &tasks, ((Gen_Task) {node->as.triple.first,  task.depth, rng_split(task.rng, 0), &out->as.triple.first,  false}));
+                break;
+            }
+            case NK_IF: {
+                gen_pay(gen, node->kind);
+                gen_reserve(gen, node->as.iff.then, task.depth, 1);
+                gen_reserve(gen, node->as.iff.elze, task.depth, 1);
+                Node *out = node_if_loc(node->file_path, node->line, NULL, NULL, NULL);
+                *task.dest = out;
+                arena_da_append(&scratch, &tasks, ((Gen_Task) {node->as.iff.elze, task.depth, rng_split(task.rng, 2), &out->as.iff.elze, true}));
+                arena_da_append(&scratch, &tasks, ((Gen_Task) {node->as.iff.then, task.depth, rng_split(task.rng, 1), &out->as.iff.then, true}));
+                arena_da_append(&scratch, &tasks, ((Gen_Task) {node->as.iff.cond, task.depth, rng_split(task.rng, 0), &out->as.iff.cond, false}));
+                break;
+            }
+
+            case NK_RULE: {
+                branch = gen_rule_branch(gen, node->as.rule, task.depth - 1, task.rng, &branch_rng);
+                if (branch == NULL) return_defer(NULL);
+                arena_da_append(&scratch, &tasks, ((Gen_Task) {branch, task.depth - 2, branch_rng, task.dest, false}));
+                break;
+            }
+            case NK_RANDOM: {
+                gen_pay(gen, NK_NUMBER);
+                *task.dest = node_number_loc(node->file_path, node->line, rng_float(&task.rng) * 2.0f - 1.0f);
+                break;
+            }
+
+            case COUNT_NK:
+            default:
+                UNREACHABLE("gen_tree()");
+        }
+    }
+
+defer:
+    arena_free(&scratch);
+    return result;
+}
+
+#define GEN_RULE_MAX_ATTEMPTS 10
+#define GEN_DEPTH 20
+
+Node *gen_rule(Gen *gen, size_t rule, int depth, Rng rng) {
+    assert(rule < gen->grammar.count);
 
-    Grammar_Branches *branches = &grammar.items[rule];
+    Grammar_Branches *branches = &gen->grammar.items[rule];
     assert(branches->count > 0);
 
+    // Only the branches that can terminate within the remaining depth are candidates, so the first choice of
+    // every rule succeeds and the tree can be generated in one go
+    if (!gen->retry) return gen_tree(gen, rule, depth, rng);
+
+    if (depth <= 0) return NULL;
+
     Node *node = NULL;
     for (size_t attempts = 0; node == NULL && attempts < GEN_RULE_MAX_ATTEMPTS; ++attempts) {
-        float p = rand_float();
-        float t = 0.0f;
-        for (size_t i = 0; i < branches->count; ++i) {
-            t += branches->items[i].probability;
-            if (t >= p) {
-                node = gen_node(grammar, branches->items[i].node, depth - 1);
-                break;
-            }
+        gen->attempts += 1;
+        Rng attempt = rng_split(rng, attempts);
+        size_t i = alias_table_sample(&branches->alias, branches->count, &attempt);
+        // A failed attempt may have generated a good part of its subtree already, none of which is reachable
+        Arena_Mark mark = arena_snapshot(&node_arena);
+        node = gen_node(gen, branches->items[i].node, depth - 1, rng_split(attempt, 0));
+        if (node == NULL) {
+            gen->failures += 1;
+            gen->bytes_discarded += arena_bytes_since(&node_arena, mark);
+            arena_rewind(&node_arena, mark);
         }
-    };
+    }
     return node;
 }
 
 
-int main(void) {
-    srand(time(0));
+// Index of the rule that build_default_grammar() uses as the start symbol
+#define GRAMMAR_ENTRY 0
 
-    Grammar grammar = {0};
+void build_default_grammar(Grammar *grammar) {
     Grammar_Branches branches = {0};
-    int e = 0;
     int a = 1;
     int c = 2;
 
@@ -564,7 +1623,7 @@ int main(void) {
         .node = node_triple(node_rule(c), node_rule(c), node_rule(c)),
         .probability = 1.0f,
     }));
-    arena_da_append(&node_arena, &grammar, branches);
+    arena_da_append(&node_arena, grammar, branches);
     memset(&branches, 0, sizeof(branches));
 
     arena_da_append(&node_arena, &branches, ((Grammar_Branch) {
@@ -579,7 +1638,7 @@ int main(void) {
         .node = node_y(),
         .probability = 1.0f/3.0f,
     }));
-    arena_da_append(&node_arena, &grammar, branches);
+    arena_da_append(&node_arena, grammar, branches);
     memset(&branches, 0, sizeof(branches));
 
     arena_da_append(&node_arena, &branches, ((Grammar_Branch) {
@@ -597,10 +1656,6446 @@ int main(void) {
         .probability = 3.0f/8.0f,
         // .probability = 1.0f/4.0f,
     }));
-    arena_da_append(&node_arena, &grammar, branches);
+    arena_da_append(&node_arena, grammar, branches);
     memset(&branches, 0, sizeof(branches));
+}
+
+// build_default_grammar() baked into the binary by `grammar-c`, defines `default_grammar`
+#include "default_grammar.h"
+
+// Generates the function of `seed` starting from the entry rule of the grammar. `budget` may be NULL, otherwise
+// it must have been initialized for at least `depth`.
+Node *gen_function(Grammar grammar, uint64_t seed, int depth, Gen_Budget *budget) {
+    int min_depth = grammar.items[GRAMMAR_ENTRY].min_depth;
+    if (depth < min_depth) {
+        nob_log(ERROR, "the grammar needs a depth of at least %d to terminate, got %d", min_depth, depth);
+        return NULL;
+    }
+    Gen gen = {.grammar = grammar};
+    if (budget != NULL) {
+        assert(depth <= budget->depth);
+        double min_cost = gen_budget_min_cost_at(budget, GRAMMAR_ENTRY, depth);
+        if (min_cost > budget->limit) {
+            nob_log(ERROR, "the cheapest tree of the grammar costs %g, which exceeds the budget of %g", min_cost, budget->limit);
+            return NULL;
+        }
+        gen.budget = budget;
+        gen.budget_left = budget->limit;
+    }
+    return gen_rule(&gen, GRAMMAR_ENTRY, depth, rng_new(seed));
+}
+
+bool sv_start_with(String_View sv, const char *cstr) {
+    size_t cstr_count = strlen(cstr);
+    return sv.count >= cstr_count && memcmp(sv.data, cstr, cstr_count) == 0;
+}
+
+bool parse_seed(String_View sv, uint64_t *seed) {
+    const char *cstr = temp_sv_to_cstr(sv);
+    char *end = NULL;
+    *seed = strtoull(cstr, &end, 0);
+    return *cstr != '\0' && *end == '\0';
+}
+
+bool parse_positive_float(const char *flag, const char *cstr, double *out) {
+    char *end = NULL;
+    double value = strtod(cstr, &end);
+    if (*cstr == '\0' || *end != '\0' || !(value > 0.0)) {
+        nob_log(ERROR, "%s expects a positive number, got `%s`", flag, cstr);
+        return false;
+    }
+    *out = value;
+    return true;
+}
+
+bool parse_size(const char *flag, const char *cstr, size_t *out) {
+    char *end = NULL;
+    unsigned long long value = strtoull(cstr, &end, 10);
+    if (*cstr == '\0' || *end != '\0' || value == 0) {
+        nob_log(ERROR, "%s expects a positive integer, got `%s`", flag, cstr);
+        return false;
+    }
+    *out = value;
+    return true;
+}
+
+// Deep Zoom Image pyramid (https://learn.microsoft.com/en-us/previous-versions/windows/silverlight/dotnet-windows-silverlight/cc645077(v=vs.95))
+//
+// Level `max_level` is the full resolution image, every level below it is half the size (rounded up) of the one
+// above, down to 1x1 at level 0. Only the finest level is ever rendered. It is produced one strip of tiles at a
+// time, and each finished strip is box-filtered into the strip of the level below, so a coarser strip is complete
+// (and written out) as soon as both of its source strips are. That keeps only one strip per level in memory.
+
+#define DZI_DEFAULT_TILE_SIZE 256
+#define DZI_MAX_LEVELS 64
+
+typedef struct {
+    size_t width;
+    size_t height;
+    RGBA32 *strip;      // tile_size rows of this level, `width` pixels each
+    size_t strip_index; // which row of tiles `strip` currently holds
+    size_t rows;        // how many rows of `strip` are filled
+} Dzi_Level;
+
+typedef struct {
+    const char *files_dir;
+    size_t tile_size;
+    size_t levels_count;
+    Dzi_Level levels[DZI_MAX_LEVELS];
+} Dzi;
+
+// Averages the up to 2x2 block of `src` that lands on every pixel of the `dst` rows. Pixels past the right or
+// bottom edge of an odd sized level are simply left out of the average.
+void dzi_downsample(Dzi_Level *src, Dzi_Level *dst, size_t dst_row) {
+    size_t dst_rows = (src->rows + 1)/2;
+    for (size_t y = 0; y < dst_rows; ++y) {
+        for (size_t x = 0; x < dst->width; ++x) {
+            unsigned int r = 0, g = 0, b = 0, a = 0, n = 0;
+            for (size_t sy = 2*y; sy < 2*y + 2 && sy < src->rows; ++sy) {
+                for (size_t sx = 2*x; sx < 2*x + 2 && sx < src->width; ++sx) {
+                    RGBA32 p = src->strip[sy*src->width + sx];
+                    r += p.r;
+                    g += p.g;
+                    b += p.b;
+                    a += p.a;
+                    n += 1;
+                }
+            }
+            RGBA32 *q = &dst->strip[(dst_row + y)*dst->width + x];
+            q->r = (r + n/2)/n;
+            q->g = (g + n/2)/n;
+            q->b = (b + n/2)/n;
+            q->a = (a + n/2)/n;
+        }
+    }
+    dst->rows = dst_row + dst_rows;
+}
+
+// Writes every tile of the strip that `level` holds and feeds it into the level below
+bool dzi_flush_strip(Dzi *dzi, size_t level) {
+    Dzi_Level *l = &dzi->levels[level];
+    size_t tile_size = dzi->tile_size;
+
+    for (size_t col = 0; col*tile_size < l->width; ++col) {
+        size_t tile_width = l->width - col*tile_size;
+        if (tile_width > tile_size) tile_width = tile_size;
+
+        size_t checkpoint = temp_save();
+        const char *tile_path = temp_sprintf("%s/%zu/%zu_%zu.png", dzi->files_dir, level, col, l->strip_index);
+        bool ok = stbi_write_png(tile_path, tile_width, l->rows, 4, l->strip + col*tile_size, l->width*sizeof(RGBA32));
+        temp_rewind(checkpoint);
+        if (!ok) {
+            nob_log(ERROR, "could not save tile %zu_%zu of level %zu", col, l->strip_index, level);
+            return false;
+        }
+    }
+
+    if (level > 0) {
+        Dzi_Level *below = &dzi->levels[level - 1];
+        below->strip_index = l->strip_index/2;
+        dzi_downsample(l, below, (l->strip_index%2)*(tile_size/2));
+
+        bool last = (l->strip_index + 1)*tile_size >= l->height;
+        if (l->strip_index%2 == 1 || last) {
+            if (!dzi_flush_strip(dzi, level - 1)) return false;
+        }
+    }
+
+    l->rows = 0;
+    return true;
+}
+
+bool render_dzi(Node *f, const char *name, size_t width, size_t height, size_t tile_size) {
+    bool result = true;
+    Dzi dzi = {0};
+    dzi.tile_size = tile_size;
+
+    size_t max_level = 0;
+    while (((size_t)1 << max_level) < width || ((size_t)1 << max_level) < height) max_level += 1;
+    dzi.levels_count = max_level + 1;
+    assert(dzi.levels_count <= DZI_MAX_LEVELS);
+
+    Program program;
+    if (!program_compile(&node_arena, f, &program)) return_defer(false);
+
+    dzi.files_dir = temp_sprintf("%s_files", name);
+    if (!mkdir_if_not_exists(dzi.files_dir)) return_defer(false);
+
+    for (size_t level = 0; level < dzi.levels_count; ++level) {
+        Dzi_Level *l = &dzi.levels[level];
+        size_t scale = (size_t)1 << (max_level - level);
+        l->width  = (width  + scale - 1)/scale;
+        l->height = (height + scale - 1)/scale;
+        l->strip = malloc(l->width*tile_size*sizeof(RGBA32));
+        assert(l->strip != NULL && "Buy more RAM lol");
+        if (!mkdir_if_not_exists(temp_sprintf("%s/%zu", dzi.files_dir, level))) return_defer(false);
+    }
+
+    Dzi_Level *top = &dzi.levels[max_level];
+    for (size_t strip = 0; strip*tile_size < height; ++strip) {
+        size_t rows = height - strip*tile_size;
+        if (rows > tile_size) rows = tile_size;
+        render_pixels_rect(&program, top->strip, width, 0, strip*tile_size, width, rows, width, height);
+        top->strip_index = strip;
+        top->rows = rows;
+        if (!dzi_flush_strip(&dzi, max_level)) return_defer(false);
+    }
+
+    const char *dzi_path = temp_sprintf("%s.dzi", name);
+    const char *descriptor = temp_sprintf(
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" Format=\"png\" Overlap=\"0\" TileSize=\"%zu\">\n"
+        "    <Size Width=\"%zu\" Height=\"%zu\"/>\n"
+        "</Image>\n", tile_size, width, height);
+    if (!write_entire_file(dzi_path, descriptor, strlen(descriptor))) return_defer(false);
+    nob_log(INFO, "generated: %s (%zu levels)", dzi_path, dzi.levels_count);
+
+defer:
+    for (size_t level = 0; level < dzi.levels_count; ++level) free(dzi.levels[level].strip);
+    return result;
+}
+
+bool command_dzi(Grammar grammar, int argc, char **argv) {
+    const char *name = NULL;
+    size_t width = WIDTH;
+    size_t height = HEIGHT;
+    size_t tile_size = DZI_DEFAULT_TILE_SIZE;
+    uint64_t seed = time(0);
+
+    while (argc > 0) {
+        const char *flag = shift_args(&argc, &argv);
+        if (strcmp(flag, "-seed") == 0) {
+            if (argc <= 0 || !parse_seed(sv_from_cstr(argv[0]), &seed)) {
+                nob_log(ERROR, "%s expects an integer", flag);
+                return false;
+            }
+            shift_args(&argc, &argv);
+            continue;
+        }
+
+        size_t *value = NULL;
+        if      (strcmp(flag, "-width")  == 0) value = &width;
+        else if (strcmp(flag, "-height") == 0) value = &height;
+        else if (strcmp(flag, "-tile")   == 0) value = &tile_size;
+
+        if (value != NULL) {
+            if (argc <= 0) {
+                nob_log(ERROR, "no value is provided for %s", flag);
+                return false;
+            }
+            if (!parse_size(flag, shift_args(&argc, &argv), value)) return false;
+        } else if (name == NULL) {
+            name = flag;
+        } else {
+            nob_log(ERROR, "unexpected argument `%s`", flag);
+            return false;
+        }
+    }
+
+    if (name == NULL) {
+        nob_log(ERROR, "no output name is provided for dzi");
+        return false;
+    }
+    if (tile_size%2 != 0) {
+        nob_log(ERROR, "tile size must be even, got %zu", tile_size);
+        return false;
+    }
+
+    nob_log(INFO, "seed: %llu", (unsigned long long)seed);
+    Node *f = gen_function(grammar, seed, GEN_DEPTH, NULL);
+    if (!f) {
+        nob_log(ERROR, "the generation process could not terminate.");
+        return false;
+    }
+    node_print_ln(f);
+
+    return render_dzi(f, name, width, height, tile_size);
+}
+
+// SHA-256 (FIPS 180-4)
+//
+// Key material is turned into a seed by hashing it, so the same key always produces the same picture. Besides
+// the usual streaming interface there is sha256_many() that hashes up to SHA256_LANES independent messages at
+// once, one message per lane of a vector register, for the case of checking thousands of keys in one batch.
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t size;
+    uint8_t block[64];
+    size_t block_count;
+} Sha256;
+
+#define SHA256_DIGEST_SIZE 32
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const uint32_t sha256_initial_state[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+#define SHA256_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define SHA256_CH(x, y, z) (((x) & (y)) ^ (~(x) & (z)))
+#define SHA256_MAJ(x, y, z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define SHA256_BSIG0(x) (SHA256_ROTR(x, 2) ^ SHA256_ROTR(x, 13) ^ SHA256_ROTR(x, 22))
+#define SHA256_BSIG1(x) (SHA256_ROTR(x, 6) ^ SHA256_ROTR(x, 11) ^ SHA256_ROTR(x, 25))
+#define SHA256_SSIG0(x) (SHA256_ROTR(x, 7) ^ SHA256_ROTR(x, 18) ^ ((x) >> 3))
+#define SHA256_SSIG1(x) (SHA256_ROTR(x, 17) ^ SHA256_ROTR(x, 19) ^ ((x) >> 10))
+
+// The same 64 rounds serve both the scalar and the vector version, `T` is uint32_t or u32x8
+#define SHA256_ROUNDS(T, state, w)                                                  \
+    do {                                                                            \
+        for (size_t t = 16; t < 64; ++t) {                                          \
+            w[t] = SHA256_SSIG1(w[t-2]) + w[t-7] + SHA256_SSIG0(w[t-15]) + w[t-16]; \
+        }                                                                           \
+        T a = state[0], b = state[1], c = state[2], d = state[3];                   \
+        T e = state[4], f = state[5], g = state[6], h = state[7];                   \
+        for (size_t t = 0; t < 64; ++t) {                                           \
+            T t1 = h + SHA256_BSIG1(e) + SHA256_CH(e, f, g) + sha256_k[t] + w[t];   \
+            T t2 = SHA256_BSIG0(a) + SHA256_MAJ(a, b, c);                           \
+            h = g; g = f; f = e; e = d + t1;                                        \
+            d = c; c = b; b = a; a = t1 + t2;                                       \
+        }                                                                           \
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;                 \
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;                 \
+    } while (0)
+
+uint32_t sha256_load_be32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+void sha256_compress(uint32_t state[8], const uint8_t block[64]) {
+    uint32_t w[64];
+    for (size_t t = 0; t < 16; ++t) w[t] = sha256_load_be32(block + 4*t);
+    SHA256_ROUNDS(uint32_t, state, w);
+}
+
+void sha256_init(Sha256 *sha) {
+    memcpy(sha->state, sha256_initial_state, sizeof(sha->state));
+    sha->size = 0;
+    sha->block_count = 0;
+}
+
+void sha256_update(Sha256 *sha, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+    sha->size += size;
+    while (size > 0) {
+        size_t n = sizeof(sha->block) - sha->block_count;
+        if (n > size) n = size;
+        memcpy(sha->block + sha->block_count, bytes, n);
+        sha->block_count += n;
+        bytes += n;
+        size -= n;
+        if (sha->block_count == sizeof(sha->block)) {
+            sha256_compress(sha->state, sha->block);
+            sha->block_count = 0;
+        }
+    }
+}
+
+void sha256_final(Sha256 *sha, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    uint64_t bits = sha->size*8;
+    uint8_t pad = 0x80;
+    sha256_update(sha, &pad, 1);
+    pad = 0;
+    while (sha->block_count != 56) sha256_update(sha, &pad, 1);
+    uint8_t length[8];
+    for (size_t i = 0; i < 8; ++i) length[i] = bits >> (56 - 8*i);
+    sha256_update(sha, length, sizeof(length));
+    for (size_t i = 0; i < 8; ++i) {
+        digest[4*i + 0] = sha->state[i] >> 24;
+        digest[4*i + 1] = sha->state[i] >> 16;
+        digest[4*i + 2] = sha->state[i] >> 8;
+        digest[4*i + 3] = sha->state[i];
+    }
+}
+
+void sha256(const void *data, size_t size, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    Sha256 sha;
+    sha256_init(&sha);
+    sha256_update(&sha, data, size);
+    sha256_final(&sha, digest);
+}
+
+// Multi-buffer SHA-256
+//
+// Lane i of every u32x8 belongs to message i. Messages of different sizes need different numbers of blocks, so
+// a lane whose message has already run out of blocks keeps its state through the remaining rounds via a mask.
+// GCC and Clang lower the vector extension to whatever the target has (SSE2, AVX2, NEON) or to scalar code.
+
+#define SHA256_LANES 8
+
+typedef uint32_t u32x8 __attribute__((vector_size(SHA256_LANES*sizeof(uint32_t))));
+
+// Number of 64 byte blocks of a message of `size` bytes after padding
+size_t sha256_blocks_count(size_t size) {
+    return (size + 1 + 8 + 63)/64;
+}
+
+// Copies block `index` of the padded message into `block`
+void sha256_padded_block(const uint8_t *data, size_t size, size_t index, uint8_t block[64]) {
+    size_t offset = index*64;
+    size_t n = offset < size ? size - offset : 0;
+    if (n > 64) n = 64;
+    memcpy(block, data + offset, n);
+    memset(block + n, 0, 64 - n);
+    if (offset <= size && size < offset + 64) block[size - offset] = 0x80;
+    if (index + 1 == sha256_blocks_count(size)) {
+        uint64_t bits = (uint64_t)size*8;
+        for (size_t i = 0; i < 8; ++i) block[56 + i] = bits >> (56 - 8*i);
+    }
+}
+
+void sha256_lanes(const uint8_t **data, const size_t *sizes, size_t count, uint8_t (*digests)[SHA256_DIGEST_SIZE]) {
+    assert(count <= SHA256_LANES);
+
+    u32x8 state[8];
+    for (size_t i = 0; i < 8; ++i) {
+        for (size_t lane = 0; lane < SHA256_LANES; ++lane) state[i][lane] = sha256_initial_state[i];
+    }
+
+    u32x8 blocks_count = {0};
+    uint32_t max_blocks_count = 0;
+    for (size_t lane = 0; lane < count; ++lane) {
+        blocks_count[lane] = sha256_blocks_count(sizes[lane]);
+        if (blocks_count[lane] > max_blocks_count) max_blocks_count = blocks_count[lane];
+    }
+
+    for (uint32_t index = 0; index < max_blocks_count; ++index) {
+        u32x8 w[64];
+        for (size_t lane = 0; lane < count; ++lane) {
+            uint8_t block[64] = {0};
+            if (index < blocks_count[lane]) sha256_padded_block(data[lane], sizes[lane], index, block);
+            for (size_t t = 0; t < 16; ++t) w[t][lane] = sha256_load_be32(block + 4*t);
+        }
+        for (size_t lane = count; lane < SHA256_LANES; ++lane) {
+            for (size_t t = 0; t < 16; ++t) w[t][lane] = 0;
+        }
+
+        u32x8 next[8];
+        memcpy(next, state, sizeof(next));
+        SHA256_ROUNDS(u32x8, next, w);
+
+        u32x8 active = (u32x8)(index < blocks_count);
+        for (size_t i = 0; i < 8; ++i) state[i] = (next[i] & active) | (state[i] & ~active);
+    }
+
+    for (size_t lane = 0; lane < count; ++lane) {
+        for (size_t i = 0; i < 8; ++i) {
+            digests[lane][4*i + 0] = state[i][lane] >> 24;
+            digests[lane][4*i + 1] = state[i][lane] >> 16;
+            digests[lane][4*i + 2] = state[i][lane] >> 8;
+            digests[lane][4*i + 3] = state[i][lane];
+        }
+    }
+}
+
+void sha256_many(const uint8_t **data, const size_t *sizes, size_t count, uint8_t (*digests)[SHA256_DIGEST_SIZE]) {
+    for (size_t i = 0; i < count; i += SHA256_LANES) {
+        size_t n = count - i;
+        if (n > SHA256_LANES) n = SHA256_LANES;
+        sha256_lanes(data + i, sizes + i, n, digests + i);
+    }
+}
+
+// The seed of a key is the first 8 bytes of its digest
+uint64_t seed_from_digest(const uint8_t digest[SHA256_DIGEST_SIZE]) {
+    uint64_t seed = 0;
+    for (size_t i = 0; i < 8; ++i) seed = seed << 8 | digest[i];
+    return seed;
+}
+
+// Decodes a hex fingerprint, optionally with `:` between the bytes (as in `aa:bb:cc`), into `key`
+bool parse_hex_fingerprint(Arena *a, String_View sv, const uint8_t **key, size_t *key_size) {
+    uint8_t *bytes = arena_alloc(a, sv.count/2 + 1);
+    size_t count = 0;
+    int high = -1;
+    for (size_t i = 0; i < sv.count; ++i) {
+        char x = sv.data[i];
+        if (x == ':' && high < 0) continue;
+        int digit;
+        if      ('0' <= x && x <= '9') digit = x - '0';
+        else if ('a' <= x && x <= 'f') digit = x - 'a' + 10;
+        else if ('A' <= x && x <= 'F') digit = x - 'A' + 10;
+        else return false;
+        if (high < 0) {
+            high = digit;
+        } else {
+            bytes[count++] = high << 4 | digit;
+            high = -1;
+        }
+    }
+    if (high >= 0 || count == 0) return false;
+    *key = bytes;
+    *key_size = count;
+    return true;
+}
+
+void digest_to_hex(const uint8_t digest[SHA256_DIGEST_SIZE], char hex[2*SHA256_DIGEST_SIZE + 1]) {
+    for (size_t i = 0; i < SHA256_DIGEST_SIZE; ++i) snprintf(hex + 2*i, 3, "%02x", digest[i]);
+}
+
+// Tree serialization
+//
+// A generated tree is stored in pre-order: the kind of every node as a varint, followed by the raw little-endian
+// bits of its value for numbers, one byte for booleans and a varint for rule references. The stream starts with
+// a magic, a version and the node count. It can be read back into node_arena, or straight into the Program the
+// renderer runs, which only needs a stack of the nodes that still wait for children.
+//
+// The tree cache keeps the encoded tree of every function generated, keyed by the SHA-256 of everything the tree
+// depends on: the grammar, the seed, the depth and the budget. Rendering the same seed again, at whatever size,
+// loads the tree instead of generating it.
+
+#define TREE_MAGIC "RATR"
+#define TREE_VERSION 1
+
+void varint_append(String_Builder *sb, uint64_t value) {
+    while (value >= 0x80) {
+        da_append(sb, (char)(value | 0x80));
+        value >>= 7;
+    }
+    da_append(sb, (char)value);
+}
+
+bool varint_read(String_View *sv, uint64_t *value) {
+    *value = 0;
+    for (size_t shift = 0; shift < 64; shift += 7) {
+        if (sv->count == 0) return false;
+        uint8_t byte = *sv->data;
+        sv->data += 1;
+        sv->count -= 1;
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) return true;
+    }
+    return false;
+}
+
+void tree_encode(Node *f, String_Builder *out) {
+    Arena scratch = {0};
+    Node_Stack stack = {0};
+
+    sb_append_buf(out, TREE_MAGIC, strlen(TREE_MAGIC));
+    varint_append(out, TREE_VERSION);
+    varint_append(out, node_count(f));
+
+    arena_da_append(&scratch, &stack, f);
+    while (stack.count > 0) {
+        Node *node = stack.items[--stack.count];
+        varint_append(out, node->kind);
+        if (node->kind == NK_NUMBER) {
+            uint32_t bits;
+            memcpy(&bits, &node->as.number, sizeof(bits));
+            for (size_t i = 0; i < sizeof(bits); ++i) da_append(out, (char)(bits >> 8*i));
+        } else if (node->kind == NK_BOOLEAN) {
+            da_append(out, (char)node->as.boolean);
+        } else if (node->kind == NK_RULE) {
+            varint_append(out, node->as.rule);
+        }
+        for (size_t i = node_arity(node->kind); i > 0; --i) arena_da_append(&scratch, &stack, *node_child(node, i - 1));
+    }
+    arena_free(&scratch);
+}
+
+// One node of the stream: its kind and, for numbers, booleans and rules, its value
+bool tree_read_node(String_View *sv, Node_Kind *kind, Node_As *as) {
+    uint64_t value;
+    if (!varint_read(sv, &value) || value >= COUNT_NK) return false;
+    *kind = value;
+    memset(as, 0, sizeof(*as));
+    if (*kind == NK_NUMBER) {
+        if (sv->count < 4) return false;
+        uint32_t bits = 0;
+        for (size_t i = 0; i < 4; ++i) bits |= (uint32_t)(uint8_t)sv->data[i] << 8*i;
+        memcpy(&as->number, &bits, sizeof(bits));
+        sv->data += 4;
+        sv->count -= 4;
+    } else if (*kind == NK_BOOLEAN) {
+        if (sv->count < 1 || (uint8_t)sv->data[0] > 1) return false;
+        as->boolean = sv->data[0];
+        sv->data += 1;
+        sv->count -= 1;
+    } else if (*kind == NK_RULE) {
+        if (!varint_read(sv, &value) || value > INT_MAX) return false;
+        as->rule = value;
+    }
+    return true;
+}
+
+bool tree_read_header(String_View *sv, uint64_t *nodes_count) {
+    size_t n = strlen(TREE_MAGIC);
+    if (sv->count < n || memcmp(sv->data, TREE_MAGIC, n) != 0) return false;
+    sv->data += n;
+    sv->count -= n;
+    uint64_t version;
+    return varint_read(sv, &version) && version == TREE_VERSION && varint_read(sv, nodes_count) && *nodes_count > 0;
+}
+
+// Decodes an encoded tree into node_arena, the nodes point at `file_path` for error messages. Returns NULL when
+// the data is not a valid tree.
+Node *tree_decode(const char *file_path, String_View sv) {
+    Node *result = NULL;
+    Arena scratch = {0};
+    Parse_Stack stack = {0};
+
+    uint64_t nodes_count;
+    if (!tree_read_header(&sv, &nodes_count)) return_defer(NULL);
+    for (uint64_t i = 0; i < nodes_count; ++i) {
+        Node *node = node_loc(file_path, 0, NK_X);
+        if (!tree_read_node(&sv, &node->kind, &node->as)) return_defer(NULL);
+        if (i == 0) result = node;
+        else if (stack.count == 0) return_defer(NULL);
+
+        if (stack.count > 0) {
+            Parse_Frame *top = &stack.items[stack.count - 1];
+            *node_child(top->node, top->filled++) = node;
+            if (top->filled == node_arity(top->node->kind)) stack.count -= 1;
+        }
+        if (node_arity(node->kind) > 0) arena_da_append(&scratch, &stack, ((Parse_Frame) {.node = node}));
+    }
+    if (stack.count > 0 || sv.count > 0) return_defer(NULL);
+
+defer:
+    arena_free(&scratch);
+    return result;
+}
+
+typedef struct {
+    Instr instr;
+    size_t remaining; // children still to come
+} Decode_Frame;
+
+typedef struct {
+    Decode_Frame *items;
+    size_t count;
+    size_t capacity;
+} Decode_Stack;
+
+// Decodes an encoded tree straight into the postfix Program that program_compile() would have produced for it,
+// without building the tree. A node is emitted once its last child is. Returns false when the data is not a
+// valid tree or the tree does not evaluate to a color.
+bool tree_decode_program(Arena *a, String_View sv, Program *program) {
+    bool result = true;
+    Arena scratch = {0};
+    Decode_Stack stack = {0};
+    Type_Stack types = {0};
+    memset(program, 0, sizeof(*program));
+
+    uint64_t nodes_count;
+    if (!tree_read_header(&sv, &nodes_count)) return_defer(false);
+    for (uint64_t i = 0; i < nodes_count; ++i) {
+        Node_Kind kind;
+        Node_As as;
+        if (!tree_read_node(&sv, &kind, &as)) return_defer(false);
+        if (kind == NK_RANDOM || kind == NK_RULE) return_defer(false);
+        if (i > 0 && stack.count == 0) return_defer(false);
+
+        Decode_Frame frame = {.instr = {.kind = kind}, .remaining = node_arity(kind)};
+        if (kind == NK_NUMBER) frame.instr.number = as.number;
+        if (kind == NK_BOOLEAN) frame.instr.number = as.boolean;
+
+        while (frame.remaining == 0) {
+            arena_da_append(&scratch, &types, VALUE_NUMBER);
+            types.count -= 1;
+            size_t operand;
+            Value_Type expected;
+            if (!value_types_apply(frame.instr.kind, &types, &operand, &expected)) return_defer(false);
+            if (types.count > program->stack_size) program->stack_size = types.count;
+            arena_da_append(a, program, frame.instr);
+
+            if (stack.count == 0) break;
+            stack.items[stack.count - 1].remaining -= 1;
+            if (stack.items[stack.count - 1].remaining > 0) break;
+            frame = stack.items[--stack.count];
+        }
+        if (frame.remaining > 0) arena_da_append(&scratch, &stack, frame);
+    }
+    if (stack.count > 0 || sv.count > 0) return_defer(false);
+    if (types.count != 1 || types.items[0] != VALUE_TRIPLE) return_defer(false);
+
+defer:
+    arena_free(&scratch);
+    return result;
+}
+
+bool read_entire_stream(FILE *stream, String_Builder *sb) {
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), stream)) > 0) {
+        sb_append_buf(sb, buf, n);
+    }
+    return !ferror(stream);
+}
+
+// Unlike mkdir_if_not_exists() this says nothing when the directory is already there, which is every run
+bool cache_mkdir(const char *path) {
+    if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+        nob_log(ERROR, "could not create directory `%s`: %s", path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// $RANDOMART_CACHE, or randomart/ under $XDG_CACHE_HOME or ~/.cache. NULL when there is nowhere to cache, which
+// also is how an empty $RANDOMART_CACHE turns caching off.
+const char *cache_dir(void) {
+    const char *dir = getenv("RANDOMART_CACHE");
+    if (dir != NULL) {
+        if (*dir == '\0' || !cache_mkdir(dir)) return NULL;
+        return dir;
+    }
+
+    const char *base = getenv("XDG_CACHE_HOME");
+    if (base == NULL || *base == '\0') {
+        const char *home = getenv("HOME");
+        if (home == NULL || *home == '\0') return NULL;
+        base = temp_sprintf("%s/.cache", home);
+    }
+    if (!cache_mkdir(base)) return NULL;
+    dir = temp_sprintf("%s/randomart", base);
+    if (!cache_mkdir(dir)) return NULL;
+    return dir;
+}
+
+// Written next to `path` first and renamed into place, so concurrent runs never see half a file. Quiet unlike
+// nob's rename(), which matters when every job of a batch writes one. Stays away from temp, so any thread can
+// call it. Nothing is left behind when it fails.
+bool write_file_atomic(const char *path, const void *data, size_t size) {
+    char tmp_path[PATH_MAX];
+    // Per thread, as two threads that generate the same seed store the same tree at once
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.%d.%d.tmp", path, (int)getpid(), (int)gettid()) >= (int)sizeof(tmp_path)) {
+        nob_log(ERROR, "path is too long: %s", path);
+        return false;
+    }
+    if (!write_entire_file(tmp_path, data, size)) {
+        remove(tmp_path);
+        return false;
+    }
+    if (renameat(AT_FDCWD, tmp_path, AT_FDCWD, path) < 0) {
+        nob_log(ERROR, "could not rename %s to %s: %s", tmp_path, path, strerror(errno));
+        remove(tmp_path);
+        return false;
+    }
+    return true;
+}
+
+// Reads `path` into `sb` if it exists, without complaining when it does not
+bool read_file_if_exists(const char *path, String_Builder *sb) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) return false;
+    bool ok = read_entire_stream(f, sb);
+    fclose(f);
+    return ok;
+}
+
+// Cache budgets
+//
+// The caches are directories of small files that would otherwise pile up forever, so each is kept under a byte
+// budget by removing the least recently used files, by mtime, which hits bump. Every process keeps a running
+// total of what is in there: the directory is scanned once when the cache is opened and whatever gets stored is
+// added, and once the total passes the budget the directory is scanned again and cut down to
+// CACHE_LOW_WATERMARK of it. That way a run of any size never puts much more than the budget on disk. Other
+// processes storing into the same directory are caught up with on every scan, and the temporary files of writers
+// that crashed are removed by it once they are CACHE_STALE_TMP_SECONDS old.
+
+#define CACHE_LOW_WATERMARK 0.75
+#define CACHE_STALE_TMP_SECONDS (60*60)
+
+typedef struct {
+    const char *dir;    // NULL when the cache is off
+    const char *prefix; // the files of `dir` that belong to the cache start with `prefix` and end with `suffix`
+    const char *suffix;
+    uint64_t budget;
+    atomic_uint_fast64_t total; // bytes in the cache as far as this process knows
+    atomic_bool evicting;
+    atomic_size_t evicted;
+} Cache_Files;
+
+typedef struct {
+    char *name;
+    uint64_t size;
+    struct timespec mtime;
+} Cache_Entry;
+
+typedef struct {
+    Cache_Entry *items;
+    size_t count;
+    size_t capacity;
+} Cache_Entries;
+
+int cache_entry_compare(const void *a, const void *b) {
+    const struct timespec *x = &((const Cache_Entry*)a)->mtime;
+    const struct timespec *y = &((const Cache_Entry*)b)->mtime;
+    if (x->tv_sec != y->tv_sec) return x->tv_sec < y->tv_sec ? -1 : 1;
+    if (x->tv_nsec != y->tv_nsec) return x->tv_nsec < y->tv_nsec ? -1 : 1;
+    return 0;
+}
+
+// Whether the file `name` belongs to the cache. `*tmp` tells whether it is the temporary file of a writer, which
+// is named after the file it becomes.
+bool cache_files_match(Cache_Files *files, const char *name, bool *tmp) {
+    String_View sv = sv_from_cstr(name);
+    if (!sv_start_with(sv, files->prefix)) return false;
+    *tmp = sv_end_with(sv, ".tmp");
+    return *tmp || sv_end_with(sv, files->suffix);
+}
+
+// Scans the directory and, when it holds more than the budget, removes the least recently used files until no
+// more than `target` bytes are left. Another process may be evicting at the same time, so files that are already
+// gone are simply skipped.
+void cache_files_evict(Cache_Files *files, uint64_t target) {
+    DIR *dir = opendir(files->dir);
+    if (dir == NULL) {
+        nob_log(ERROR, "could not open directory %s: %s", files->dir, strerror(errno));
+        return;
+    }
+
+    Arena scratch = {0};
+    Cache_Entries entries = {0};
+    uint64_t total = 0;
+    struct dirent *ent;
+    time_t now = time(NULL);
+    while ((ent = readdir(dir)) != NULL) {
+        bool tmp = false;
+        if (!cache_files_match(files, ent->d_name, &tmp)) continue;
+        struct stat st;
+        if (fstatat(dirfd(dir), ent->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode)) continue;
+        if (tmp) {
+            // Nothing takes that long to write one file, its writer is gone
+            if (now - st.st_mtim.tv_sec > CACHE_STALE_TMP_SECONDS && unlinkat(dirfd(dir), ent->d_name, 0) == 0) {
+                atomic_fetch_add(&files->evicted, 1);
+            }
+            continue;
+        }
+        Cache_Entry entry = {
+            .name = arena_strdup(&scratch, ent->d_name),
+            .size = st.st_size,
+            .mtime = st.st_mtim,
+        };
+        arena_da_append(&scratch, &entries, entry);
+        total += entry.size;
+    }
+
+    if (total > files->budget) {
+        qsort(entries.items, entries.count, sizeof(*entries.items), cache_entry_compare);
+        for (size_t i = 0; i < entries.count && total > target; ++i) {
+            if (unlinkat(dirfd(dir), entries.items[i].name, 0) == 0) atomic_fetch_add(&files->evicted, 1);
+            total -= entries.items[i].size;
+        }
+    }
+    atomic_store(&files->total, total);
+
+    closedir(dir);
+    arena_free(&scratch);
+}
+
+// Opens the cache in `dir` with the budget in the environment variable `budget_env`, or `default_budget` when it
+// is not set. False when the cache is off, which a budget of 0 means as well.
+bool cache_files_open(Cache_Files *files, const char *dir, const char *prefix, const char *suffix, const char *budget_env, uint64_t default_budget) {
+    memset(files, 0, sizeof(*files));
+    uint64_t budget = default_budget;
+    const char *value = getenv(budget_env);
+    if (value != NULL && *value != '\0') {
+        char *end = NULL;
+        budget = strtoull(value, &end, 10);
+        if (*end != '\0') {
+            nob_log(ERROR, "%s expects a number of bytes, got `%s`", budget_env, value);
+            return false;
+        }
+    }
+    // A zero budget keeps nothing, which is the same as not caching at all
+    if (dir == NULL || budget == 0) return false;
+
+    files->dir = dir;
+    files->prefix = prefix;
+    files->suffix = suffix;
+    files->budget = budget;
+    cache_files_evict(files, budget*CACHE_LOW_WATERMARK);
+    return true;
+}
+
+// Accounts for `size` bytes just stored in the cache, evicting when that takes it past the budget. Safe to call
+// from many threads, one of them evicts while the others go on.
+void cache_files_added(Cache_Files *files, uint64_t size) {
+    uint64_t total = atomic_fetch_add(&files->total, size) + size;
+    if (total <= files->budget || atomic_exchange(&files->evicting, true)) return;
+    cache_files_evict(files, files->budget*CACHE_LOW_WATERMARK);
+    atomic_store(&files->evicting, false);
+}
+
+// Marks a file of the cache as the most recently used. A failure only makes it look older than it is.
+void cache_files_touch(const char *path) {
+    utimensat(AT_FDCWD, path, NULL, 0);
+}
+
+#define TREE_CACHE_VERSION 1
+#define TREE_CACHE_DEFAULT_BUDGET (8*1024*1024)
+
+typedef struct {
+    const char *dir; // NULL when caching is off
+    Cache_Files files;
+    uint8_t grammar_digest[SHA256_DIGEST_SIZE];
+    // Generation may run on many threads at once
+    atomic_size_t hits;
+    atomic_size_t misses;
+} Tree_Cache;
+
+// Digest of everything about `grammar` that affects generation: the templates and the probabilities
+void grammar_digest(Grammar grammar, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    String_Builder sb = {0};
+    varint_append(&sb, grammar.count);
+    for (size_t rule = 0; rule < grammar.count; ++rule) {
+        Grammar_Branches *branches = &grammar.items[rule];
+        varint_append(&sb, branches->count);
+        for (size_t i = 0; i < branches->count; ++i) {
+            sb_append_buf(&sb, &branches->items[i].probability, sizeof(branches->items[i].probability));
+            tree_encode(branches->items[i].node, &sb);
+        }
+    }
+    sha256(sb.items, sb.count, digest);
+    sb_free(sb);
+}
+
+void tree_cache_init(Tree_Cache *cache, Grammar grammar) {
+    memset(cache, 0, sizeof(*cache));
+    if (!cache_files_open(&cache->files, cache_dir(), "tree-", "", "RANDOMART_TREE_CACHE_BUDGET", TREE_CACHE_DEFAULT_BUDGET)) return;
+    cache->dir = cache->files.dir;
+    grammar_digest(grammar, cache->grammar_digest);
+}
+
+// Path of the tree of `seed` in the cache. Not in temp, which belongs to the main thread.
+void tree_cache_path(Tree_Cache *cache, uint64_t seed, int depth, Gen_Budget *budget, char path[PATH_MAX]) {
+    Sha256 sha;
+    sha256_init(&sha);
+    uint32_t version = TREE_CACHE_VERSION;
+    sha256_update(&sha, &version, sizeof(version));
+    sha256_update(&sha, cache->grammar_digest, sizeof(cache->grammar_digest));
+    sha256_update(&sha, &seed, sizeof(seed));
+    sha256_update(&sha, &depth, sizeof(depth));
+    if (budget != NULL) {
+        sha256_update(&sha, &budget->limit, sizeof(budget->limit));
+        sha256_update(&sha, budget->cost, sizeof(budget->cost));
+    }
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    sha256_final(&sha, digest);
+    char hex[2*SHA256_DIGEST_SIZE + 1];
+    digest_to_hex(digest, hex);
+    snprintf(path, PATH_MAX, "%s/tree-%s", cache->dir, hex);
+}
+
+void tree_cache_store(Tree_Cache *cache, const char *path, Node *f) {
+    String_Builder sb = {0};
+    tree_encode(f, &sb);
+    if (write_file_atomic(path, sb.items, sb.count)) cache_files_added(&cache->files, sb.count);
+    sb_free(sb);
+}
+
+// The function of `seed` as a tree in node_arena, loaded from the cache when it is there
+Node *gen_function_cached(Tree_Cache *cache, Grammar grammar, uint64_t seed, int depth, Gen_Budget *budget) {
+    if (cache->dir == NULL) return gen_function(grammar, seed, depth, budget);
+
+    char path[PATH_MAX];
+    tree_cache_path(cache, seed, depth, budget, path);
+    String_Builder sb = {0};
+    Node *f = NULL;
+    if (read_file_if_exists(path, &sb)) f = tree_decode(arena_strdup(&node_arena, path), sb_to_sv(sb));
+    if (f != NULL) {
+        atomic_fetch_add(&cache->hits, 1);
+        cache_files_touch(path);
+    } else {
+        atomic_fetch_add(&cache->misses, 1);
+        f = gen_function(grammar, seed, depth, budget);
+        if (f != NULL) tree_cache_store(cache, path, f);
+    }
+    sb_free(sb);
+    return f;
+}
+
+// The Program of the function of `seed`, decoded straight from the cache when the tree is there. A cached tree
+// that does not decode is generated and stored again. If `tree` is not NULL it receives the encoded tree.
+bool gen_program_cached(Tree_Cache *cache, Arena *a, Grammar grammar, uint64_t seed, int depth, Gen_Budget *budget, Program *program, String_Builder *tree) {
+    bool result = true;
+    char path_buffer[PATH_MAX];
+    const char *path = NULL;
+    if (cache->dir != NULL) {
+        tree_cache_path(cache, seed, depth, budget, path_buffer);
+        path = path_buffer;
+    }
+    String_Builder local = {0};
+    String_Builder *sb = tree != NULL ? tree : &local;
+    sb->count = 0;
+
+    if (path != NULL && read_file_if_exists(path, sb) && tree_decode_program(a, sb_to_sv(*sb), program)) {
+        atomic_fetch_add(&cache->hits, 1);
+        cache_files_touch(path);
+        return_defer(true);
+    }
+    if (path != NULL) atomic_fetch_add(&cache->misses, 1);
+    sb->count = 0;
+
+    Node *f = gen_function(grammar, seed, depth, budget);
+    if (f == NULL || !program_compile(a, f, program)) return_defer(false);
+    if (path != NULL || tree != NULL) tree_encode(f, sb);
+    if (path != NULL && write_file_atomic(path, sb->items, sb->count)) cache_files_added(&cache->files, sb->count);
+
+defer:
+    sb_free(local);
+    return result;
+}
+
+// Render cache
+//
+// Finished PNGs are kept under renders/ in the cache directory, named by the SHA-256 of the encoded tree, the
+// size and the format, so the same function rendered at the same size is only encoded once no matter which seed,
+// key or grammar produced it. The directory is kept under a byte budget ($RANDOMART_RENDER_CACHE_BUDGET,
+// RENDER_CACHE_DEFAULT_BUDGET by default) as described under Cache budgets, evicting as renders are stored
+// rather than at the end of a run. Files are written with write_file_atomic(), so processes sharing the
+// directory only ever see whole images.
+
+#define RENDER_CACHE_VERSION 1
+#define RENDER_CACHE_DEFAULT_BUDGET (256*1024*1024)
+
+typedef struct {
+    const char *dir; // NULL when caching is off
+    Cache_Files files;
+    size_t hits;
+    size_t misses;
+} Render_Cache;
+
+void render_cache_init(Render_Cache *cache) {
+    memset(cache, 0, sizeof(*cache));
+    const char *dir = cache_dir();
+    if (dir == NULL) return;
+    dir = temp_sprintf("%s/renders", dir);
+    if (!cache_mkdir(dir)) return;
+    char *owned = strdup(dir);
+    assert(owned != NULL && "Buy more RAM lol");
+    if (!cache_files_open(&cache->files, owned, "", ".png", "RANDOMART_RENDER_CACHE_BUDGET", RENDER_CACHE_DEFAULT_BUDGET)) {
+        free(owned);
+        return;
+    }
+    cache->dir = owned;
+}
+
+void render_cache_free(Render_Cache *cache) {
+    free((char*)cache->dir);
+    cache->dir = NULL;
+}
+
+// Accounts for a render of `size` bytes about to be stored at a path from render_cache_path()
+void render_cache_added(Render_Cache *cache, size_t size) {
+    cache_files_added(&cache->files, size);
+}
+
+// Path of the render of the encoded tree `tree` at `width`x`height` in the cache, into `path` rather than temp
+// so it works on any thread. False when caching is off.
+bool render_cache_path(Render_Cache *cache, String_View tree, size_t width, size_t height, char path[PATH_MAX]) {
+    if (cache->dir == NULL) return false;
+    Sha256 sha;
+    sha256_init(&sha);
+    uint32_t version = RENDER_CACHE_VERSION;
+    sha256_update(&sha, &version, sizeof(version));
+    uint64_t size[2] = {width, height};
+    sha256_update(&sha, size, sizeof(size));
+    const char *format = "png";
+    sha256_update(&sha, format, strlen(format) + 1);
+    sha256_update(&sha, tree.data, tree.count);
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    sha256_final(&sha, digest);
+    char hex[2*SHA256_DIGEST_SIZE + 1];
+    digest_to_hex(digest, hex);
+    snprintf(path, PATH_MAX, "%s/%s.png", cache->dir, hex);
+    return true;
+}
+
+// Reads the cached render at `path` into `png` and marks it as the most recently used
+bool render_cache_read(const char *path, String_Builder *png) {
+    if (!read_file_if_exists(path, png) || png->count == 0) return false;
+    cache_files_touch(path);
+    return true;
+}
+
+// Copies the cached render at `path` to `output_path`. False when it is not in the cache.
+bool render_cache_fetch(Render_Cache *cache, const char *path, const char *output_path) {
+    if (path == NULL) return false;
+    String_Builder sb = {0};
+    bool ok = render_cache_read(path, &sb) && write_entire_file(output_path, sb.items, sb.count);
+    sb_free(sb);
+    if (ok) cache->hits += 1;
+    else    cache->misses += 1;
+    return ok;
+}
+
+// Encodes `pixels` as PNG into `output_path` and, unless `path` is NULL, into the cache as well
+bool render_cache_write_png(Render_Cache *cache, const char *path, const char *output_path, const RGBA32 *pixels, size_t width, size_t height) {
+    int size = 0;
+    unsigned char *png = stbi_write_png_to_mem((const unsigned char*)pixels, width*sizeof(RGBA32), width, height, 4, &size);
+    if (png == NULL) {
+        nob_log(ERROR, "could not encode image: %s", output_path);
+        return false;
+    }
+    bool ok = write_entire_file(output_path, png, size);
+    if (ok && path != NULL && write_file_atomic(path, png, size)) render_cache_added(cache, size);
+    free(png);
+    return ok;
+}
+
+// Batch mode
+//
+// Renders a whole list of jobs in one process. The grammar is built once by main(), the pixel buffer is sized
+// and faulted in once for the largest job, and everything a job allocates in node_arena is rewound before the
+// next one starts, so memory stays flat no matter how many images are rendered.
+
+typedef struct {
+    uint64_t seed;
+    // When a job is given key material instead of a seed, the seed is derived from its SHA-256
+    const uint8_t *key;
+    size_t key_size;
+    size_t width;
+    size_t height;
+    const char *output_path;
+} Job;
+
+typedef struct {
+    Job *items;
+    size_t count;
+    size_t capacity;
+} Jobs;
+
+uint64_t get_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000*1000*1000 + ts.tv_nsec;
+}
+
+#define NS_TO_MS(ns) ((double)(ns)/1000.0/1000.0)
+
+String_View sv_chop_word(String_View *sv) {
+    *sv = sv_trim_left(*sv);
+    size_t i = 0;
+    while (i < sv->count && !isspace((unsigned char)sv->data[i])) i += 1;
+    String_View word = sv_from_parts(sv->data, i);
+    sv->data += i;
+    sv->count -= i;
+    return word;
+}
+
+bool read_key_file(Arena *a, const char *file_path, const uint8_t **key, size_t *key_size) {
+    String_Builder sb = {0};
+    bool ok = strcmp(file_path, "-") == 0 ? read_entire_stream(stdin, &sb) : read_entire_file(file_path, &sb);
+    if (ok) {
+        *key = arena_memdup(a, sb.items, sb.count);
+        *key_size = sb.count;
+    } else {
+        nob_log(ERROR, "could not read key from %s", file_path);
+    }
+    sb_free(sb);
+    return ok;
+}
+
+// Derives the seeds of all the jobs that were given key material, SHA256_LANES keys at a time
+void hash_job_keys(Arena *a, Jobs *jobs) {
+    size_t count = 0;
+    for (size_t i = 0; i < jobs->count; ++i) count += jobs->items[i].key != NULL;
+    if (count == 0) return;
+
+    const uint8_t **data = arena_alloc(a, count*sizeof(*data));
+    size_t *sizes = arena_alloc(a, count*sizeof(*sizes));
+    uint8_t (*digests)[SHA256_DIGEST_SIZE] = arena_alloc(a, count*sizeof(*digests));
+    for (size_t i = 0, j = 0; i < jobs->count; ++i) {
+        if (jobs->items[i].key == NULL) continue;
+        data[j] = jobs->items[i].key;
+        sizes[j] = jobs->items[i].key_size;
+        j += 1;
+    }
+
+    uint64_t start = get_time_ns();
+    sha256_many(data, sizes, count, digests);
+    nob_log(INFO, "hashed %zu keys in %.3f ms", count, NS_TO_MS(get_time_ns() - start));
+
+    for (size_t i = 0, j = 0; i < jobs->count; ++i) {
+        Job *job = &jobs->items[i];
+        if (job->key == NULL) continue;
+        job->seed = seed_from_digest(digests[j++]);
+        if (job->output_path == NULL) job->output_path = arena_sprintf(a, "output-%llu.png", (unsigned long long)job->seed);
+    }
+}
+
+// Every non-empty line that does not start with `#` is a job:
+//
+//     <seed> [<width> <height>] [<output path>]
+//
+// Instead of a seed the job may name key material as `hex:<fingerprint>` or `file:<path>`, its seed is then
+// derived from the SHA-256 of the key by hash_job_keys(). Missing sizes default to WIDTH x HEIGHT and a missing
+// output path to output-<seed>.png.
+bool parse_jobs(Arena *a, const char *file_path, String_View content, Jobs *jobs) {
+    for (size_t line = 1; content.count > 0; ++line) {
+        String_View l = sv_trim(sv_chop_by_delim(&content, '\n'));
+        if (l.count == 0 || l.data[0] == '#') continue;
+
+        Job job = {
+            .width = WIDTH,
+            .height = HEIGHT,
+        };
+
+        // The fields go through temp to become C strings, which would run out of it on a long jobs file
+        size_t checkpoint = temp_save();
+        String_View word = sv_chop_word(&l);
+        if (sv_start_with(word, "hex:")) {
+            if (!parse_hex_fingerprint(a, sv_from_parts(word.data + 4, word.count - 4), &job.key, &job.key_size)) {
+                nob_log(ERROR, "%s:%zu: invalid fingerprint `"SV_Fmt"`", file_path, line, SV_Arg(word));
+                return false;
+            }
+        } else if (sv_start_with(word, "file:")) {
+            const char *key_path = temp_sv_to_cstr(sv_from_parts(word.data + 5, word.count - 5));
+            if (!read_key_file(a, key_path, &job.key, &job.key_size)) return false;
+        } else if (!parse_seed(word, &job.seed)) {
+            nob_log(ERROR, "%s:%zu: invalid seed `"SV_Fmt"`", file_path, line, SV_Arg(word));
+            return false;
+        }
+
+        String_View words[3];
+        size_t words_count = 0;
+        while (words_count < ARRAY_LEN(words) && (word = sv_chop_word(&l)).count > 0) words[words_count++] = word;
+        if (sv_trim(l).count > 0) {
+            nob_log(ERROR, "%s:%zu: too many fields in a job", file_path, line);
+            return false;
+        }
+
+        size_t i = 0;
+        if (words_count >= 2) {
+            if (!parse_size("width", temp_sv_to_cstr(words[0]), &job.width)) return false;
+            if (!parse_size("height", temp_sv_to_cstr(words[1]), &job.height)) return false;
+            i = 2;
+        }
+        if (i < words_count) {
+            job.output_path = arena_sprintf(a, SV_Fmt, SV_Arg(words[i]));
+            i += 1;
+        } else if (job.key == NULL) {
+            job.output_path = arena_sprintf(a, "output-%llu.png", (unsigned long long)job.seed);
+        }
+        if (i < words_count) {
+            nob_log(ERROR, "%s:%zu: expected <seed> [<width> <height>] [<output path>]", file_path, line);
+            return false;
+        }
+        temp_rewind(checkpoint);
+
+        arena_da_append(a, jobs, job);
+    }
+    return true;
+}
+
+// Encoded images
+//
+// The formats images can be handed out in, encoded into memory with the *_to_func() writers of stb_image_write.
+
+#define IMAGE_JPG_QUALITY 90
+
+typedef enum {
+    IMAGE_PNG,
+    IMAGE_BMP,
+    IMAGE_TGA,
+    IMAGE_JPG,
+    COUNT_IMAGE_FORMATS,
+} Image_Format;
+
+static const char *image_format_names[COUNT_IMAGE_FORMATS] = {
+    [IMAGE_PNG] = "png",
+    [IMAGE_BMP] = "bmp",
+    [IMAGE_TGA] = "tga",
+    [IMAGE_JPG] = "jpg",
+};
+
+void sb_write_func(void *context, void *data, int size) {
+    sb_append_buf((String_Builder*)context, data, size);
+}
+
+bool image_encode(Image_Format format, const RGBA32 *pixels, size_t width, size_t height, String_Builder *out) {
+    switch (format) {
+        case IMAGE_PNG: return stbi_write_png_to_func(sb_write_func, out, width, height, 4, pixels, width*sizeof(RGBA32));
+        case IMAGE_BMP: return stbi_write_bmp_to_func(sb_write_func, out, width, height, 4, pixels);
+        case IMAGE_TGA: return stbi_write_tga_to_func(sb_write_func, out, width, height, 4, pixels);
+        case IMAGE_JPG: return stbi_write_jpg_to_func(sb_write_func, out, width, height, 4, pixels, IMAGE_JPG_QUALITY);
+        case COUNT_IMAGE_FORMATS:
+        default: UNREACHABLE("image_encode");
+    }
+}
+
+// Bounded MPMC queue (https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue)
+//
+// Dmitry Vyukov's ring: the sequence number of every cell says whether it is free for the producer of position
+// `pos` (sequence == pos) or holds the item for its consumer (sequence == pos + 1). Producers and consumers claim
+// positions with a CAS on their own counter and never take a lock. Push and pop fail rather than block, so the
+// caller decides how to wait.
+
+typedef struct {
+    atomic_size_t sequence;
+    void *data;
+} Mpmc_Cell;
+
+typedef struct {
+    Mpmc_Cell *cells;
+    size_t mask;
+    // On separate cache lines, producers and consumers would keep stealing them from each other otherwise
+    _Alignas(64) atomic_size_t enqueue_pos;
+    _Alignas(64) atomic_size_t dequeue_pos;
+} Mpmc_Queue;
+
+void mpmc_init(Mpmc_Queue *q, size_t capacity) {
+    assert(capacity >= 2 && (capacity & (capacity - 1)) == 0 && "capacity must be a power of two");
+    q->cells = malloc(capacity*sizeof(Mpmc_Cell));
+    assert(q->cells != NULL && "Buy more RAM lol");
+    for (size_t i = 0; i < capacity; ++i) atomic_init(&q->cells[i].sequence, i);
+    q->mask = capacity - 1;
+    atomic_init(&q->enqueue_pos, 0);
+    atomic_init(&q->dequeue_pos, 0);
+}
+
+void mpmc_free(Mpmc_Queue *q) {
+    free(q->cells);
+    q->cells = NULL;
+}
+
+// False when the queue is full
+bool mpmc_push(Mpmc_Queue *q, void *data) {
+    size_t pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+    for (;;) {
+        Mpmc_Cell *cell = &q->cells[pos & q->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                cell->data = data;
+                atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+// False when the queue is empty
+bool mpmc_pop(Mpmc_Queue *q, void **data) {
+    size_t pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+    for (;;) {
+        Mpmc_Cell *cell = &q->cells[pos & q->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->dequeue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                *data = cell->data;
+                atomic_store_explicit(&cell->sequence, pos + q->mask + 1, memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+// Only a snapshot, the counters move while they are read
+size_t mpmc_depth(Mpmc_Queue *q) {
+    size_t dequeue = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+    size_t enqueue = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+    return enqueue > dequeue ? enqueue - dequeue : 0;
+}
+
+// Waiting on a full or empty queue: yield first, then sleep, so threads that outnumber the cores do not burn
+// them on spinning
+void backoff(unsigned *spins) {
+    if (*spins < 16) {
+        *spins += 1;
+        sched_yield();
+    } else {
+        struct timespec ts = {.tv_nsec = 50*1000};
+        nanosleep(&ts, NULL);
+    }
+}
+
+// Asynchronous output
+//
+// An Output_Writer takes finished files (a path and the bytes that go into it) and writes them behind the back of
+// whoever renders, so creating tens of thousands of small files does not stall the renderer on the filesystem.
+// There are three backends:
+//
+// - sync writes every file before output_writer_submit() returns, like write_entire_file()
+// - threads hands the files to a pool of OUTPUT_THREADS threads doing plain open/pwrite/close
+// - uring submits the open, the writes, the fsync, the close and the rename of every file to io_uring (through
+//   the raw syscalls, no liburing), OUTPUT_URING_DEPTH operations at a time, and handles their completions
+//   whenever the caller submits the next file. It falls back to threads when the kernel does not have io_uring
+//   or one of the operations it needs.
+//
+// With a non-zero fsync batch, written files are kept open until that many are waiting and then fsynced all at
+// once, instead of paying a full flush per file. An atomic file is written next to its path and renamed into place
+// once it is complete (and synced), as write_file_atomic() does.
+
+#define OUTPUT_THREADS 4
+#define OUTPUT_QUEUE_CAPACITY 64
+#define OUTPUT_URING_DEPTH 64
+
+typedef enum {
+    OUTPUT_SYNC,
+    OUTPUT_THREADS_POOL,
+    OUTPUT_URING,
+    COUNT_OUTPUT_BACKENDS,
+} Output_Backend;
+
+static const char *output_backend_names[COUNT_OUTPUT_BACKENDS] = {
+    [OUTPUT_SYNC] = "sync",
+    [OUTPUT_THREADS_POOL] = "threads",
+    [OUTPUT_URING] = "uring",
+};
+
+// What a file waits for next
+typedef enum {
+    OUTPUT_OPEN,
+    OUTPUT_WRITE,
+    OUTPUT_FSYNC,
+    OUTPUT_CLOSE,
+    OUTPUT_RENAME,
+    OUTPUT_DONE,
+} Output_Step;
+
+typedef struct Output_File {
+    char *path;
+    char *tmp_path; // where an atomic file is written before the rename, NULL otherwise
+    String_Builder data;
+    size_t written;
+    int fd;
+    bool ok;
+    Output_Step step;
+    struct Output_File *next;
+} Output_File;
+
+// A FIFO of files linked through `next`
+typedef struct {
+    Output_File *head;
+    Output_File *tail;
+    size_t count;
+} Output_List;
+
+void output_list_push(Output_List *list, Output_File *file) {
+    file->next = NULL;
+    if (list->tail != NULL) list->tail->next = file;
+    else                    list->head = file;
+    list->tail = file;
+    list->count += 1;
+}
+
+Output_File *output_list_pop(Output_List *list) {
+    Output_File *file = list->head;
+    if (file == NULL) return NULL;
+    list->head = file->next;
+    if (list->head == NULL) list->tail = NULL;
+    list->count -= 1;
+    return file;
+}
+
+// The rings of an io_uring instance, mapped into our memory
+typedef struct {
+    int fd;
+    unsigned entries;
+    _Atomic unsigned *sq_head;
+    _Atomic unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    _Atomic unsigned *cq_head;
+    _Atomic unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned to_submit;
+} Uring;
+
+typedef struct {
+    Output_Backend backend;
+    size_t fsync_batch;
+
+    atomic_size_t files;  // written outputs, the atomic files (render cache copies) only count in `cached`
+    atomic_size_t bytes;
+    atomic_size_t cached;
+    atomic_size_t failed;
+
+    // sync
+    Output_List unsynced;
+
+    // threads
+    pthread_t threads[OUTPUT_THREADS];
+    Mpmc_Queue queue;
+    atomic_bool closing;
+
+    // uring
+    Uring ring;
+    size_t inflight;
+    Output_List ready; // files whose next operation is not submitted yet
+} Output_Writer;
+
+void uring_free(Uring *u) {
+    if (u->sqes != NULL) munmap(u->sqes, u->sqes_size);
+    if (u->cq_ring != NULL && u->cq_ring != u->sq_ring) munmap(u->cq_ring, u->cq_ring_size);
+    if (u->sq_ring != NULL) munmap(u->sq_ring, u->sq_ring_size);
+    if (u->fd >= 0) close(u->fd);
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+}
+
+// Whether the kernel knows every operation the writer uses, IORING_REGISTER_PROBE itself is 5.6+
+bool uring_supports(int fd) {
+    static const unsigned char ops[] = {IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_FSYNC, IORING_OP_CLOSE, IORING_OP_RENAMEAT};
+    size_t size = sizeof(struct io_uring_probe) + 256*sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    assert(probe != NULL && "Buy more RAM lol");
+    bool ok = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (size_t i = 0; ok && i < ARRAY_LEN(ops); ++i) {
+        ok = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return ok;
+}
+
+// False, quietly, when io_uring is not there to use
+bool uring_init(Uring *u, unsigned entries) {
+    memset(u, 0, sizeof(*u));
+    struct io_uring_params params = {0};
+    u->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (u->fd < 0) return false;
+    if (!uring_supports(u->fd)) {
+        uring_free(u);
+        return false;
+    }
+
+    u->entries = params.sq_entries;
+    u->sq_ring_size = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+    u->cq_ring_size = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_ring_size > u->sq_ring_size) u->sq_ring_size = u->cq_ring_size;
+        u->cq_ring_size = u->sq_ring_size;
+    }
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED) {
+        u->sq_ring = NULL;
+        uring_free(u);
+        return false;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_ring = u->sq_ring;
+    } else {
+        u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_ring == MAP_FAILED) {
+            u->cq_ring = NULL;
+            uring_free(u);
+            return false;
+        }
+    }
+    u->sqes_size = params.sq_entries*sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        uring_free(u);
+        return false;
+    }
+
+    char *sq = u->sq_ring;
+    char *cq = u->cq_ring;
+    u->sq_head  = (_Atomic unsigned*)(sq + params.sq_off.head);
+    u->sq_tail  = (_Atomic unsigned*)(sq + params.sq_off.tail);
+    u->sq_mask  = (unsigned*)(sq + params.sq_off.ring_mask);
+    u->sq_array = (unsigned*)(sq + params.sq_off.array);
+    u->cq_head  = (_Atomic unsigned*)(cq + params.cq_off.head);
+    u->cq_tail  = (_Atomic unsigned*)(cq + params.cq_off.tail);
+    u->cq_mask  = (unsigned*)(cq + params.cq_off.ring_mask);
+    u->cqes     = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return true;
+}
+
+// The next free submission entry, cleared. The caller keeps no more than `entries` operations in flight, so
+// there always is one.
+struct io_uring_sqe *uring_sqe(Uring *u) {
+    unsigned tail = atomic_load_explicit(u->sq_tail, memory_order_relaxed);
+    assert(tail - atomic_load_explicit(u->sq_head, memory_order_acquire) < u->entries);
+    unsigned index = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[index] = index;
+    return sqe;
+}
+
+// Publishes the entry filled in after the last uring_sqe()
+void uring_push(Uring *u) {
+    unsigned tail = atomic_load_explicit(u->sq_tail, memory_order_relaxed);
+    atomic_store_explicit(u->sq_tail, tail + 1, memory_order_release);
+    u->to_submit += 1;
+}
+
+// Submits what was pushed and waits until at least `wait` completions are there
+bool uring_enter(Uring *u, unsigned wait) {
+    for (;;) {
+        long n = syscall(__NR_io_uring_enter, u->fd, u->to_submit, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (n >= 0) {
+            u->to_submit -= n;
+            if (u->to_submit == 0 || wait > 0) return true;
+            continue;
+        }
+        if (errno == EINTR) continue;
+        // Too many completions are waiting to be taken, they make room for new submissions
+        if (errno == EBUSY || errno == EAGAIN) return true;
+        nob_log(ERROR, "io_uring_enter failed: %s", strerror(errno));
+        return false;
+    }
+}
+
+void output_file_free(Output_File *file) {
+    sb_free(file->data);
+    free(file->path);
+    free(file->tmp_path);
+    free(file);
+}
+
+// Counts `file` as written (or failed) and frees it
+void output_file_done(Output_Writer *w, Output_File *file) {
+    if (file->ok && file->tmp_path != NULL) {
+        atomic_fetch_add(&w->cached, 1);
+    } else if (file->ok) {
+        atomic_fetch_add(&w->files, 1);
+        atomic_fetch_add(&w->bytes, file->data.count);
+    } else {
+        atomic_fetch_add(&w->failed, 1);
+        if (file->tmp_path != NULL) unlink(file->tmp_path);
+    }
+    output_file_free(file);
+}
+
+void output_file_error(Output_File *file, const char *what, int error) {
+    nob_log(ERROR, "could not %s %s: %s", what, file->path, strerror(error));
+    file->ok = false;
+}
+
+// The blocking backends
+
+// Opens and writes `file`, leaving it open
+void output_write_blocking(Output_File *file) {
+    const char *path = file->tmp_path != NULL ? file->tmp_path : file->path;
+    file->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (file->fd < 0) {
+        output_file_error(file, "open", errno);
+        return;
+    }
+    while (file->written < file->data.count) {
+        ssize_t n = pwrite(file->fd, file->data.items + file->written, file->data.count - file->written, file->written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            output_file_error(file, "write", n < 0 ? errno : EIO);
+            return;
+        }
+        file->written += n;
+    }
+}
+
+void output_close_blocking(Output_Writer *w, Output_File *file, bool sync) {
+    if (file->fd >= 0) {
+        if (file->ok && sync && fsync(file->fd) < 0) output_file_error(file, "sync", errno);
+        if (close(file->fd) < 0 && file->ok) output_file_error(file, "close", errno);
+        file->fd = -1;
+    }
+    if (file->ok && file->tmp_path != NULL && renameat(AT_FDCWD, file->tmp_path, AT_FDCWD, file->path) < 0) {
+        output_file_error(file, "rename", errno);
+    }
+    output_file_done(w, file);
+}
+
+// Syncs and closes the files of `unsynced`, one fsync after the other
+void output_flush_blocking(Output_Writer *w, Output_List *unsynced) {
+    Output_File *file;
+    while ((file = output_list_pop(unsynced)) != NULL) output_close_blocking(w, file, true);
+}
+
+void output_run_blocking(Output_Writer *w, Output_List *unsynced, Output_File *file) {
+    output_write_blocking(file);
+    if (!file->ok || w->fsync_batch == 0) {
+        output_close_blocking(w, file, false);
+        return;
+    }
+    output_list_push(unsynced, file);
+    if (unsynced->count >= w->fsync_batch) output_flush_blocking(w, unsynced);
+}
+
+void *output_thread(void *arg) {
+    Output_Writer *w = arg;
+    Output_List unsynced = {0};
+    unsigned spins = 0;
+    for (;;) {
+        // Read before popping: once closing, an empty queue stays empty
+        bool closing = atomic_load(&w->closing);
+        void *data;
+        if (!mpmc_pop(&w->queue, &data)) {
+            if (closing) break;
+            backoff(&spins);
+            continue;
+        }
+        spins = 0;
+        output_run_blocking(w, &unsynced, data);
+    }
+    output_flush_blocking(w, &unsynced);
+    return NULL;
+}
+
+// The io_uring backend
+
+void output_uring_issue(Output_Writer *w) {
+    Output_File *file;
+    while (w->inflight < w->ring.entries && (file = output_list_pop(&w->ready)) != NULL) {
+        struct io_uring_sqe *sqe = uring_sqe(&w->ring);
+        sqe->user_data = (uintptr_t)file;
+        switch (file->step) {
+            case OUTPUT_OPEN:
+                sqe->opcode = IORING_OP_OPENAT;
+                sqe->fd = AT_FDCWD;
+                sqe->addr = (uintptr_t)(file->tmp_path != NULL ? file->tmp_path : file->path);
+                sqe->len = 0666;
+                sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+                break;
+            case OUTPUT_WRITE: {
+                size_t size = file->data.count - file->written;
+                sqe->opcode = IORING_OP_WRITE;
+                sqe->fd = file->fd;
+                sqe->addr = (uintptr_t)(file->data.items + file->written);
+                sqe->len = size > UINT32_MAX ? UINT32_MAX : size;
+                sqe->off = file->written;
+            } break;
+            case OUTPUT_FSYNC:
+                sqe->opcode = IORING_OP_FSYNC;
+                sqe->fd = file->fd;
+                break;
+            case OUTPUT_CLOSE:
+                sqe->opcode = IORING_OP_CLOSE;
+                sqe->fd = file->fd;
+                break;
+            case OUTPUT_RENAME:
+                sqe->opcode = IORING_OP_RENAMEAT;
+                sqe->fd = AT_FDCWD;
+                sqe->addr = (uintptr_t)file->tmp_path;
+                sqe->len = AT_FDCWD;
+                sqe->addr2 = (uintptr_t)file->path;
+                break;
+            case OUTPUT_DONE:
+            default: UNREACHABLE("output_uring_issue");
+        }
+        uring_push(&w->ring);
+        w->inflight += 1;
+    }
+}
+
+// Moves every file waiting for its fsync to the ready list
+void output_uring_sync_all(Output_Writer *w) {
+    Output_File *file;
+    while ((file = output_list_pop(&w->unsynced)) != NULL) {
+        file->step = OUTPUT_FSYNC;
+        output_list_push(&w->ready, file);
+    }
+}
+
+void output_uring_complete(Output_Writer *w, Output_File *file, int res) {
+    w->inflight -= 1;
+    switch (file->step) {
+        case OUTPUT_OPEN:
+            if (res < 0) {
+                output_file_error(file, "open", -res);
+                output_file_done(w, file);
+                return;
+            }
+            file->fd = res;
+            file->step = file->data.count > 0 ? OUTPUT_WRITE : OUTPUT_CLOSE;
+            break;
+        case OUTPUT_WRITE:
+            if (res <= 0) {
+                output_file_error(file, "write", res < 0 ? -res : EIO);
+                file->step = OUTPUT_CLOSE;
+                break;
+            }
+            file->written += res;
+            if (file->written < file->data.count) break;
+            if (w->fsync_batch == 0) {
+                file->step = OUTPUT_CLOSE;
+                break;
+            }
+            file->step = OUTPUT_FSYNC;
+            output_list_push(&w->unsynced, file);
+            if (w->unsynced.count >= w->fsync_batch) output_uring_sync_all(w);
+            return;
+        case OUTPUT_FSYNC:
+            if (res < 0) output_file_error(file, "sync", -res);
+            file->step = OUTPUT_CLOSE;
+            break;
+        case OUTPUT_CLOSE:
+            if (res < 0 && file->ok) output_file_error(file, "close", -res);
+            file->fd = -1;
+            if (!file->ok || file->tmp_path == NULL) {
+                output_file_done(w, file);
+                return;
+            }
+            file->step = OUTPUT_RENAME;
+            break;
+        case OUTPUT_RENAME:
+            if (res < 0) output_file_error(file, "rename", -res);
+            output_file_done(w, file);
+            return;
+        case OUTPUT_DONE:
+        default: UNREACHABLE("output_uring_complete");
+    }
+    output_list_push(&w->ready, file);
+}
+
+// Takes the completions that are there, after waiting for at least `wait` of them
+bool output_uring_reap(Output_Writer *w, unsigned wait) {
+    if (!uring_enter(&w->ring, wait)) return false;
+    Uring *u = &w->ring;
+    unsigned head = atomic_load_explicit(u->cq_head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(u->cq_tail, memory_order_acquire);
+    for (; head != tail; ++head) {
+        struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+        output_uring_complete(w, (Output_File*)(uintptr_t)cqe->user_data, cqe->res);
+    }
+    atomic_store_explicit(u->cq_head, head, memory_order_release);
+    output_uring_issue(w);
+    return true;
+}
+
+// Runs the ring until every file in it is done. Only fails when io_uring_enter() itself does, which leaves the
+// files in flight to the kernel.
+bool output_uring_drain(Output_Writer *w) {
+    for (;;) {
+        // Files finishing their writes here join the unsynced ones without reaching the batch size
+        output_uring_sync_all(w);
+        output_uring_issue(w);
+        if (w->inflight == 0) return true;
+        if (!output_uring_reap(w, 1)) return false;
+    }
+}
+
+void output_writer_init(Output_Writer *w, Output_Backend backend, size_t fsync_batch) {
+    memset(w, 0, sizeof(*w));
+    w->fsync_batch = fsync_batch;
+    atomic_init(&w->files, 0);
+    atomic_init(&w->bytes, 0);
+    atomic_init(&w->cached, 0);
+    atomic_init(&w->failed, 0);
+    w->ring.fd = -1;
+    if (backend == OUTPUT_URING && !uring_init(&w->ring, OUTPUT_URING_DEPTH)) {
+        nob_log(WARNING, "io_uring is not available, writing with %d threads instead", OUTPUT_THREADS);
+        backend = OUTPUT_THREADS_POOL;
+    }
+    w->backend = backend;
+    if (backend == OUTPUT_THREADS_POOL) {
+        mpmc_init(&w->queue, OUTPUT_QUEUE_CAPACITY);
+        atomic_init(&w->closing, false);
+        for (size_t i = 0; i < OUTPUT_THREADS; ++i) {
+            if (pthread_create(&w->threads[i], NULL, output_thread, w) != 0) {
+                UNREACHABLE("could not start an output thread");
+            }
+        }
+    }
+}
+
+// Queues `data` to be written into `path`, taking it over: `*data` is left empty. Errors are logged when the
+// file is done and counted by output_writer_finish().
+void output_writer_submit(Output_Writer *w, const char *path, String_Builder *data, bool atomic) {
+    Output_File *file = calloc(1, sizeof(Output_File));
+    assert(file != NULL && "Buy more RAM lol");
+    file->path = strdup(path);
+    assert(file->path != NULL && "Buy more RAM lol");
+    if (atomic) {
+        size_t size = strlen(path) + 32;
+        file->tmp_path = malloc(size);
+        assert(file->tmp_path != NULL && "Buy more RAM lol");
+        snprintf(file->tmp_path, size, "%s.%d.%p.tmp", path, (int)getpid(), (void*)file);
+    }
+    file->data = *data;
+    memset(data, 0, sizeof(*data));
+    file->fd = -1;
+    file->ok = true;
+
+    switch (w->backend) {
+        case OUTPUT_SYNC:
+            output_run_blocking(w, &w->unsynced, file);
+            break;
+        case OUTPUT_THREADS_POOL: {
+            unsigned spins = 0;
+            while (!mpmc_push(&w->queue, file)) backoff(&spins);
+        } break;
+        case OUTPUT_URING:
+            file->step = OUTPUT_OPEN;
+            output_list_push(&w->ready, file);
+            // Moves the files already in flight along without waiting, and only blocks when the ring is full
+            if (!output_uring_reap(w, 0)) break;
+            while (w->ready.count > 0 && w->inflight >= w->ring.entries) {
+                if (!output_uring_reap(w, 1)) break;
+            }
+            break;
+        case COUNT_OUTPUT_BACKENDS:
+        default: UNREACHABLE("output_writer_submit");
+    }
+}
+
+// Waits for every submitted file and releases the writer. Returns the number of files that could not be written.
+size_t output_writer_finish(Output_Writer *w) {
+    switch (w->backend) {
+        case OUTPUT_SYNC:
+            output_flush_blocking(w, &w->unsynced);
+            break;
+        case OUTPUT_THREADS_POOL:
+            atomic_store(&w->closing, true);
+            for (size_t i = 0; i < OUTPUT_THREADS; ++i) pthread_join(w->threads[i], NULL);
+            mpmc_free(&w->queue);
+            break;
+        case OUTPUT_URING:
+            if (!output_uring_drain(w)) {
+                atomic_fetch_add(&w->failed, w->inflight + w->ready.count + w->unsynced.count);
+            }
+            uring_free(&w->ring);
+            break;
+        case COUNT_OUTPUT_BACKENDS:
+        default: UNREACHABLE("output_writer_finish");
+    }
+    return atomic_load(&w->failed);
+}
+
+bool parse_output_backend(const char *flag, const char *cstr, Output_Backend *backend) {
+    for (size_t i = 0; i < COUNT_OUTPUT_BACKENDS; ++i) {
+        if (strcmp(cstr, output_backend_names[i]) == 0) {
+            *backend = i;
+            return true;
+        }
+    }
+    nob_log(ERROR, "%s expects sync, threads or uring, got `%s`", flag, cstr);
+    return false;
+}
+
+// Tar archives (https://pubs.opengroup.org/onlinepubs/9699919799/utilities/pax.html#tag_20_92_13_06)
+//
+// With -tar all the images of a batch go into one ustar archive instead of a file each, which is far cheaper for
+// the filesystem when there are 100k of them. The archive is only ever appended to, every member is a 512 byte
+// header computed from the name and the size followed by the data padded to 512 bytes, so it can be streamed
+// (even to stdout) through a large stdio buffer. Names that do not fit the 100+155 bytes of a ustar header get a
+// pax extended header with the whole name. Next to the archive an index records where the data of every member
+// starts and how long it is, so a single image can be read back with one pread().
+
+#define TAR_BLOCK_SIZE 512
+#define TAR_BUFFER_SIZE (1024*1024)
+
+typedef struct {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+} Tar_Header;
+
+static_assert(sizeof(Tar_Header) == TAR_BLOCK_SIZE, "a tar header is one block");
+
+typedef struct {
+    const char *path;
+    FILE *file;
+    FILE *index;
+    uint64_t offset;
+    uint64_t mtime;
+    size_t members;
+} Tar;
+
+// Zero padded octal that fills `size - 1` digits and a NUL. False when `value` does not fit.
+bool tar_octal(char *field, size_t size, uint64_t value) {
+    field[size - 1] = '\0';
+    for (size_t i = size - 1; i > 0; --i) {
+        field[i - 1] = '0' + (value & 7);
+        value >>= 3;
+    }
+    return value == 0;
+}
+
+// Splits `name` between the prefix and the name field at a `/`, as ustar wants it. False when it does not fit.
+bool tar_split_name(Tar_Header *h, const char *name) {
+    size_t length = strlen(name);
+    if (length <= sizeof(h->name)) {
+        memcpy(h->name, name, length);
+        return true;
+    }
+    for (size_t i = length - 1; i > 0; --i) {
+        if (name[i] != '/') continue;
+        if (i > sizeof(h->prefix)) return false;
+        if (length - i - 1 > sizeof(h->name)) return false;
+        memcpy(h->prefix, name, i);
+        memcpy(h->name, name + i + 1, length - i - 1);
+        return true;
+    }
+    return false;
+}
+
+bool tar_write(Tar *tar, const void *data, size_t size) {
+    if (fwrite(data, 1, size, tar->file) != size) {
+        nob_log(ERROR, "could not write %s: %s", tar->path, strerror(errno));
+        return false;
+    }
+    tar->offset += size;
+    return true;
+}
+
+// Writes `size` bytes of `data` as a member of type `typeflag`, padded to whole blocks
+bool tar_write_member(Tar *tar, char typeflag, const char *name, const void *data, size_t size) {
+    Tar_Header h = {0};
+    if (!tar_split_name(&h, name)) UNREACHABLE("tar_write_member: the name must fit");
+    if (!tar_octal(h.size, sizeof(h.size), size)) {
+        nob_log(ERROR, "%s is too large for a tar archive", name);
+        return false;
+    }
+    tar_octal(h.mode, sizeof(h.mode), 0644);
+    tar_octal(h.uid, sizeof(h.uid), 0);
+    tar_octal(h.gid, sizeof(h.gid), 0);
+    tar_octal(h.mtime, sizeof(h.mtime), tar->mtime);
+    h.typeflag = typeflag;
+    memcpy(h.magic, "ustar", 6);
+    memcpy(h.version, "00", 2);
+
+    // Summed with the checksum field itself as spaces, and written as 6 digits, a NUL and a space
+    memset(h.checksum, ' ', sizeof(h.checksum));
+    unsigned checksum = 0;
+    for (size_t i = 0; i < sizeof(h); ++i) checksum += ((unsigned char*)&h)[i];
+    tar_octal(h.checksum, 7, checksum);
+    h.checksum[7] = ' ';
+
+    static const char zeros[TAR_BLOCK_SIZE] = {0};
+    return tar_write(tar, &h, sizeof(h)) &&
+           tar_write(tar, data, size) &&
+           tar_write(tar, zeros, (TAR_BLOCK_SIZE - size%TAR_BLOCK_SIZE)%TAR_BLOCK_SIZE);
+}
+
+// `index_path` may be NULL for no index. `path` of `-` streams the archive to stdout.
+bool tar_open(Tar *tar, const char *path, const char *index_path) {
+    memset(tar, 0, sizeof(*tar));
+    tar->path = path;
+    tar->mtime = time(NULL);
+    tar->file = strcmp(path, "-") == 0 ? stdout : fopen(path, "wb");
+    if (tar->file == NULL) {
+        nob_log(ERROR, "could not open %s: %s", path, strerror(errno));
+        return false;
+    }
+    setvbuf(tar->file, NULL, _IOFBF, TAR_BUFFER_SIZE);
+    if (index_path != NULL) {
+        tar->index = fopen(index_path, "wb");
+        if (tar->index == NULL) {
+            nob_log(ERROR, "could not open %s: %s", index_path, strerror(errno));
+            if (tar->file != stdout) fclose(tar->file);
+            tar->file = NULL;
+            return false;
+        }
+        fprintf(tar->index, "name\toffset\tsize\n");
+    }
+    return true;
+}
+
+// Appends `data` as the file `name`, leading slashes are dropped like tar itself does. Stays away from temp, like
+// write_file_atomic(), for the writer of the batch pipeline.
+bool tar_append(Tar *tar, const char *name, const void *data, size_t size) {
+    while (*name == '/') name += 1;
+
+    const char *member_name = name;
+    char short_name[100];
+    Tar_Header probe = {0};
+    if (!tar_split_name(&probe, name)) {
+        // A pax record is `<length> path=<name>\n`, where the length counts its own digits as well
+        size_t rest = strlen(" path=\n") + strlen(name);
+        size_t length = rest + 1;
+        while ((size_t)snprintf(NULL, 0, "%zu", length) + rest != length) length += 1;
+        char *record = malloc(length + 1);
+        assert(record != NULL && "Buy more RAM lol");
+        snprintf(record, length + 1, "%zu path=%s\n", length, name);
+        bool ok = tar_write_member(tar, 'x', "././@PaxHeader", record, length);
+        free(record);
+        if (!ok) return false;
+        // What readers without pax support see instead
+        snprintf(short_name, sizeof(short_name), "%s", name + strlen(name) - (sizeof(short_name) - 1));
+        member_name = short_name;
+    }
+
+    uint64_t offset = tar->offset + TAR_BLOCK_SIZE;
+    if (!tar_write_member(tar, '0', member_name, data, size)) return false;
+    if (tar->index != NULL) fprintf(tar->index, "%s\t%llu\t%zu\n", name, (unsigned long long)offset, size);
+    tar->members += 1;
+    return true;
+}
+
+// Ends the archive with its two zero blocks. False when anything written to it got lost.
+bool tar_close(Tar *tar) {
+    bool ok = true;
+    if (tar->file == NULL) return ok;
+    static const char zeros[2*TAR_BLOCK_SIZE] = {0};
+    ok = tar_write(tar, zeros, sizeof(zeros));
+    if (fflush(tar->file) != 0 || ferror(tar->file)) {
+        nob_log(ERROR, "could not write %s: %s", tar->path, strerror(errno));
+        ok = false;
+    }
+    if (tar->file != stdout) fclose(tar->file);
+    if (tar->index != NULL) {
+        if (fflush(tar->index) != 0 || ferror(tar->index)) ok = false;
+        fclose(tar->index);
+    }
+    tar->file = NULL;
+    return ok;
+}
+
+// Framebuffer ring
+//
+// With -shm <name>, batch renders into a ring of framebuffers in POSIX shared memory instead of writing files,
+// so another process can take the pixels as soon as every image is done, without encoding or copying them. The
+// region is a small header followed by FB_RING_DEFAULT_SLOTS (or -shm-slots) slots, each a frame header and
+// room for the largest image of the batch. There is one producer and one consumer. Both counters live in the
+// header: `written` counts the frames the producer published and `read` the ones the consumer released, and each
+// of them is also the futex the other side sleeps on, so nobody spins while the ring is full or empty.
+//
+// The producer creates the region and unlinks it when it is done, after the consumer has released every frame;
+// until then a full ring blocks the batch. A region that already exists under the name is an error rather than
+// something to remove, it may well be the ring of another batch. Both sides put their pid in the header and
+// wait on the futexes for at most FB_RING_POLL_MS at a time, so the producer notices a consumer that exited (or
+// never attached within FB_RING_ATTACH_TIMEOUT_MS) and fails the jobs left, and the consumer notices a producer
+// that exited without closing the ring. A producer stopped by SIGINT or SIGTERM still removes the region.
+// `shm-consume` is a reference consumer.
+
+#define FB_RING_MAGIC 0x474E5246 // "FRNG"
+#define FB_RING_VERSION 2
+#define FB_RING_DEFAULT_SLOTS 4
+#define FB_RING_NAME_SIZE 256
+#define FB_RING_POLL_MS 100
+#define FB_RING_ATTACH_TIMEOUT_MS (60*1000)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t header_size;
+    uint64_t slot_size;  // bytes of a slot, frame header included
+    uint64_t size;
+    _Atomic uint32_t written;
+    _Atomic uint32_t read;
+    _Atomic uint32_t closed;
+    _Atomic uint32_t producer; // pids, the consumer one is 0 until it attached
+    _Atomic uint32_t consumer;
+} Fb_Ring_Header;
+
+typedef struct {
+    uint64_t sequence;
+    uint64_t seed;
+    uint32_t width;
+    uint32_t height;
+    uint64_t published_ns; // CLOCK_MONOTONIC, which both processes share
+    char name[FB_RING_NAME_SIZE];
+    _Alignas(64) RGBA32 pixels[];
+} Fb_Frame;
+
+typedef struct {
+    const char *name;
+    void *base;
+    size_t size;
+    Fb_Ring_Header *header;
+    bool waited; // the producer said it is waiting for the consumer, which it only says once
+    bool gone;   // the other side exited, nothing is waited for anymore
+} Fb_Ring;
+
+// Sleeps while `*word` still is `expected`, but no longer than FB_RING_POLL_MS. Not FUTEX_PRIVATE_FLAG, the word
+// is shared between processes.
+void futex_wait(_Atomic uint32_t *word, uint32_t expected) {
+    struct timespec timeout = {.tv_nsec = FB_RING_POLL_MS*1000*1000};
+    syscall(SYS_futex, word, FUTEX_WAIT, expected, &timeout, NULL, 0);
+}
+
+void futex_wake(_Atomic uint32_t *word) {
+    syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+bool process_exited(uint32_t pid) {
+    return kill((pid_t)pid, 0) < 0 && errno == ESRCH;
+}
+
+// Whether the producer should stop waiting on the consumer, which it has been doing since `waiting_since`
+bool fb_ring_consumer_gone(Fb_Ring *ring, uint64_t waiting_since) {
+    if (ring->gone) return true;
+    uint32_t pid = atomic_load(&ring->header->consumer);
+    if (pid == 0 && get_time_ns() - waiting_since > (uint64_t)FB_RING_ATTACH_TIMEOUT_MS*1000*1000) {
+        nob_log(ERROR, "nobody attached to framebuffer ring %s in %d s", ring->name, FB_RING_ATTACH_TIMEOUT_MS/1000);
+        ring->gone = true;
+    } else if (pid != 0 && process_exited(pid)) {
+        nob_log(ERROR, "the consumer of framebuffer ring %s (pid %u) exited", ring->name, pid);
+        ring->gone = true;
+    }
+    return ring->gone;
+}
+
+// SIGINT or SIGTERM that arrived while the producer had a ring. shm_unlink() is not async-signal-safe, so the
+// handler only records it and the producer removes the region the next time it touches the ring.
+static volatile sig_atomic_t fb_ring_signal = 0;
+
+void fb_ring_record_signal(int signum) {
+    fb_ring_signal = signum;
+}
+
+// Removes the region and dies of the signal that was recorded, if any
+void fb_ring_check_signal(Fb_Ring *ring) {
+    int signum = fb_ring_signal;
+    if (signum == 0) return;
+    shm_unlink(ring->name);
+    signal(signum, SIG_DFL);
+    raise(signum);
+}
+
+Fb_Frame *fb_ring_frame(Fb_Ring *ring, uint32_t sequence) {
+    Fb_Ring_Header *h = ring->header;
+    return (Fb_Frame*)((uint8_t*)ring->base + h->header_size + (size_t)(sequence%h->slots)*h->slot_size);
+}
+
+bool fb_ring_create(Fb_Ring *ring, const char *name, size_t slots, size_t max_pixels) {
+    memset(ring, 0, sizeof(*ring));
+    ring->name = name;
+    size_t header_size = (sizeof(Fb_Ring_Header) + 63) & ~(size_t)63;
+    size_t slot_size = (sizeof(Fb_Frame) + max_pixels*sizeof(RGBA32) + 63) & ~(size_t)63;
+    ring->size = header_size + slots*slot_size;
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST) {
+        nob_log(ERROR, "shared memory %s already exists, another batch may be using it (remove /dev/shm%s if not)", name, name);
+        return false;
+    }
+    if (fd < 0) {
+        nob_log(ERROR, "could not create shared memory %s: %s", name, strerror(errno));
+        return false;
+    }
+    void *base = MAP_FAILED;
+    if (ftruncate(fd, ring->size) == 0) base = mmap(NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        nob_log(ERROR, "could not map %zu bytes of shared memory: %s", ring->size, strerror(errno));
+        shm_unlink(name);
+        return false;
+    }
+    ring->base = base;
+    Fb_Ring_Header *h = ring->header = base;
+    h->version = FB_RING_VERSION;
+    h->slots = slots;
+    h->header_size = header_size;
+    h->slot_size = slot_size;
+    h->size = ring->size;
+    atomic_init(&h->written, 0);
+    atomic_init(&h->read, 0);
+    atomic_init(&h->closed, 0);
+    atomic_init(&h->producer, getpid());
+    atomic_init(&h->consumer, 0);
+    // Last, a consumer that finds the region checks it before anything else
+    atomic_store_explicit((_Atomic uint32_t*)&h->magic, FB_RING_MAGIC, memory_order_release);
+
+    // No SA_RESTART, so the signal cuts a futex wait short
+    struct sigaction sa = {.sa_handler = fb_ring_record_signal};
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    return true;
+}
+
+// The slot for the next frame, waiting while the consumer has not released any of them. NULL once the consumer is
+// gone.
+Fb_Frame *fb_ring_acquire(Fb_Ring *ring) {
+    Fb_Ring_Header *h = ring->header;
+    uint32_t written = atomic_load_explicit(&h->written, memory_order_relaxed);
+    uint64_t waiting_since = get_time_ns();
+    for (;;) {
+        fb_ring_check_signal(ring);
+        uint32_t read = atomic_load_explicit(&h->read, memory_order_acquire);
+        if (written - read < h->slots) break;
+        if (fb_ring_consumer_gone(ring, waiting_since)) return NULL;
+        if (!ring->waited) {
+            nob_log(INFO, "framebuffer ring %s is full, waiting for the consumer", ring->name);
+            ring->waited = true;
+        }
+        futex_wait(&h->read, read);
+    }
+    return fb_ring_frame(ring, written);
+}
+
+void fb_ring_publish(Fb_Ring *ring, Fb_Frame *frame) {
+    Fb_Ring_Header *h = ring->header;
+    uint32_t written = atomic_load_explicit(&h->written, memory_order_relaxed);
+    frame->sequence = written;
+    frame->published_ns = get_time_ns();
+    atomic_store_explicit(&h->written, written + 1, memory_order_release);
+    futex_wake(&h->written);
+}
+
+// Waits for the consumer to release every frame, then tells it there will be no more and removes the region
+void fb_ring_close(Fb_Ring *ring) {
+    Fb_Ring_Header *h = ring->header;
+    if (h == NULL) return;
+    uint32_t written = atomic_load_explicit(&h->written, memory_order_relaxed);
+    uint64_t waiting_since = get_time_ns();
+    for (;;) {
+        fb_ring_check_signal(ring);
+        uint32_t read = atomic_load_explicit(&h->read, memory_order_acquire);
+        if (read == written || fb_ring_consumer_gone(ring, waiting_since)) break;
+        futex_wait(&h->read, read);
+    }
+    atomic_store_explicit(&h->closed, 1, memory_order_release);
+    futex_wake(&h->written);
+    munmap(ring->base, ring->size);
+    shm_unlink(ring->name);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    ring->header = NULL;
+}
+
+// Waits for the producer to create the region
+bool fb_ring_open(Fb_Ring *ring, const char *name) {
+    memset(ring, 0, sizeof(*ring));
+    ring->name = name;
+    bool told = false;
+    int fd;
+    while ((fd = shm_open(name, O_RDWR, 0)) < 0) {
+        if (errno != ENOENT) {
+            nob_log(ERROR, "could not open shared memory %s: %s", name, strerror(errno));
+            return false;
+        }
+        if (!told) {
+            nob_log(INFO, "waiting for %s to be created", name);
+            told = true;
+        }
+        struct timespec ts = {.tv_nsec = 10*1000*1000};
+        nanosleep(&ts, NULL);
+    }
+
+    // The producer may still be between creating the region and sizing it
+    struct stat st;
+    Fb_Ring_Header *h = MAP_FAILED;
+    for (size_t attempt = 0; attempt < 100; ++attempt) {
+        if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(Fb_Ring_Header)) {
+            h = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (h != MAP_FAILED && atomic_load_explicit((_Atomic uint32_t*)&h->magic, memory_order_acquire) == FB_RING_MAGIC) break;
+            if (h != MAP_FAILED) munmap(h, st.st_size);
+            h = MAP_FAILED;
+        }
+        struct timespec ts = {.tv_nsec = 10*1000*1000};
+        nanosleep(&ts, NULL);
+    }
+    close(fd);
+    if (h == MAP_FAILED || h->version != FB_RING_VERSION || h->size != (uint64_t)st.st_size) {
+        nob_log(ERROR, "%s is not a framebuffer ring", name);
+        if (h != MAP_FAILED) munmap(h, st.st_size);
+        return false;
+    }
+    ring->base = h;
+    ring->size = st.st_size;
+    ring->header = h;
+
+    // One consumer at a time, though one that exited can be taken over from
+    uint32_t pid = 0;
+    while (!atomic_compare_exchange_strong(&h->consumer, &pid, getpid())) {
+        if (!process_exited(pid)) {
+            nob_log(ERROR, "framebuffer ring %s already has a consumer (pid %u)", name, pid);
+            munmap(ring->base, ring->size);
+            ring->base = NULL;
+            ring->header = NULL;
+            return false;
+        }
+    }
+    return true;
+}
+
+// The next frame, waiting until the producer publishes it. NULL once the producer closed the ring or exited
+// without closing it, which leaves `gone` set.
+Fb_Frame *fb_ring_next(Fb_Ring *ring) {
+    Fb_Ring_Header *h = ring->header;
+    uint32_t read = atomic_load_explicit(&h->read, memory_order_relaxed);
+    for (;;) {
+        uint32_t written = atomic_load_explicit(&h->written, memory_order_acquire);
+        if (written != read) return fb_ring_frame(ring, read);
+        if (atomic_load_explicit(&h->closed, memory_order_acquire)) return NULL;
+        uint32_t producer = atomic_load(&h->producer);
+        if (process_exited(producer)) {
+            nob_log(ERROR, "the producer of framebuffer ring %s (pid %u) exited", ring->name, producer);
+            ring->gone = true;
+            return NULL;
+        }
+        futex_wait(&h->written, written);
+    }
+}
+
+// Hands the slot of the frame fb_ring_next() returned back to the producer
+void fb_ring_release(Fb_Ring *ring) {
+    Fb_Ring_Header *h = ring->header;
+    atomic_fetch_add_explicit(&h->read, 1, memory_order_release);
+    futex_wake(&h->read);
+}
+
+// FNV-1a over the pixels, for checking frames without saving them
+uint64_t pixels_digest(const RGBA32 *pixels, size_t count) {
+    const uint8_t *bytes = (const uint8_t*)pixels;
+    uint64_t hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < count*sizeof(RGBA32); ++i) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+// Reference consumer: prints every frame as it arrives and, with -dir, saves it as a PNG named after the output
+// path of its job
+bool command_shm_consume(int argc, char **argv) {
+    bool result = true;
+    const char *name = NULL;
+    const char *dir = NULL;
+    Fb_Ring ring = {0};
+    String_Builder png = {0};
+
+    while (argc > 0) {
+        const char *flag = shift_args(&argc, &argv);
+        if (strcmp(flag, "-dir") == 0) {
+            if (argc <= 0) {
+                nob_log(ERROR, "no value is provided for %s", flag);
+                return_defer(false);
+            }
+            dir = shift_args(&argc, &argv);
+        } else if (name == NULL) {
+            name = flag;
+        } else {
+            nob_log(ERROR, "unexpected argument `%s`", flag);
+            return_defer(false);
+        }
+    }
+    if (name == NULL) {
+        nob_log(ERROR, "no shared memory name is provided for shm-consume");
+        return_defer(false);
+    }
+    if (dir != NULL && !cache_mkdir(dir)) return_defer(false);
+    if (!fb_ring_open(&ring, name)) return_defer(false);
+
+    printf("sequence\tseed\twidth\theight\tname\tdigest\tlatency_ms\n");
+    Fb_Frame *frame;
+    size_t frames = 0;
+    while ((frame = fb_ring_next(&ring)) != NULL) {
+        uint64_t latency_ns = get_time_ns() - frame->published_ns;
+        printf("%llu\t%llu\t%u\t%u\t%s\t%016llx\t%.3f\n", (unsigned long long)frame->sequence,
+               (unsigned long long)frame->seed, frame->width, frame->height, frame->name,
+               (unsigned long long)pixels_digest(frame->pixels, (size_t)frame->width*frame->height), NS_TO_MS(latency_ns));
+        if (dir != NULL) {
+            const char *base = strrchr(frame->name, '/');
+            base = base != NULL ? base + 1 : frame->name;
+            png.count = 0;
+            size_t checkpoint = temp_save();
+            bool ok = image_encode(IMAGE_PNG, frame->pixels, frame->width, frame->height, &png) &&
+                      write_entire_file(temp_sprintf("%s/%s", dir, base), png.items, png.count);
+            temp_rewind(checkpoint);
+            if (!ok) result = false;
+        }
+        fb_ring_release(&ring);
+        frames += 1;
+    }
+    fflush(stdout);
+    nob_log(INFO, "%zu frames consumed from %s", frames, name);
+    if (ring.gone) {
+        // Nobody else is left to remove it
+        shm_unlink(name);
+        result = false;
+    }
+
+defer:
+    if (ring.base != NULL) munmap(ring.base, ring.size);
+    sb_free(png);
+    return result;
+}
+
+// Batch pipeline
+//
+// With -pipeline the jobs of a batch go through three stages running at once: render workers generate (each into
+// its own thread-local node_arena) and render one job at a time, encode workers turn the pixels into PNGs, and the
+// main thread writes the files and the manifest. Items move between stages through bounded MPMC queues, so a stage
+// that falls behind stalls the ones before it rather than letting pixels pile up: no more than the workers plus
+// 2*PIPELINE_QUEUE_CAPACITY images are in memory. Render cache hits skip the encoders. Manifest rows come in the
+// order the jobs finish.
+
+#define PIPELINE_QUEUE_CAPACITY 8
+
+typedef struct {
+    Job *job;
+    bool ok;
+    bool cached;      // `png` came from the render cache
+    char *cache_path; // where the image goes in the render cache, NULL when caching is off
+    size_t nodes;
+    double cost;
+    RGBA32 *pixels;
+    String_Builder png;
+    uint64_t gen_start;
+    uint64_t render_start;
+    uint64_t render_end;
+    uint64_t encode_ns;
+} Pipeline_Item;
+
+typedef struct {
+    Mpmc_Queue queue;
+    // Depth right after every push
+    atomic_size_t depth_sum;
+    atomic_size_t depth_samples;
+    atomic_size_t depth_max;
+} Pipeline_Queue;
+
+typedef struct {
+    Grammar grammar;
+    Jobs *jobs;
+    size_t depth;
+    Gen_Budget *budget;
+    Tree_Cache *tree_cache;
+    Render_Cache *render_cache;
+    Output_Writer *writer;
+    Tar *tar; // NULL unless the images go into an archive
+
+    atomic_size_t next_job;
+    atomic_size_t renderers_left;
+    Pipeline_Queue encode_queue;
+    Pipeline_Queue write_queue;
+
+    atomic_uint_fast64_t render_busy_ns;
+    atomic_uint_fast64_t encode_busy_ns;
+} Pipeline;
+
+void pipeline_push(Pipeline_Queue *q, Pipeline_Item *item) {
+    unsigned spins = 0;
+    while (!mpmc_push(&q->queue, item)) backoff(&spins);
+    size_t depth = mpmc_depth(&q->queue);
+    atomic_fetch_add(&q->depth_sum, depth);
+    atomic_fetch_add(&q->depth_samples, 1);
+    size_t max = atomic_load(&q->depth_max);
+    while (depth > max && !atomic_compare_exchange_weak(&q->depth_max, &max, depth)) {}
+}
+
+void *pipeline_render(void *arg) {
+    Pipeline *p = arg;
+    Arena arena = {0};
+    String_Builder tree = {0};
+    for (;;) {
+        size_t index = atomic_fetch_add(&p->next_job, 1);
+        if (index >= p->jobs->count) break;
+        Job *job = &p->jobs->items[index];
+
+        Pipeline_Item *item = calloc(1, sizeof(Pipeline_Item));
+        assert(item != NULL && "Buy more RAM lol");
+        item->job = job;
+        item->gen_start = get_time_ns();
+
+        Program program;
+        Arena_Mark mark = arena_snapshot(&node_arena);
+        item->ok = gen_program_cached(p->tree_cache, &arena, p->grammar, job->seed, p->depth, p->budget, &program, &tree);
+        arena_rewind(&node_arena, mark);
+        char path[PATH_MAX];
+        if (item->ok && render_cache_path(p->render_cache, sb_to_sv(tree), job->width, job->height, path)) {
+            item->cache_path = strdup(path);
+        }
+
+        item->render_start = get_time_ns();
+        if (item->ok) {
+            item->nodes = program.count;
+            for (size_t k = 0; k < program.count; ++k) item->cost += node_eval_cost[program.items[k].kind];
+            item->cached = item->cache_path != NULL && render_cache_read(item->cache_path, &item->png);
+            if (!item->cached) {
+                item->pixels = malloc(job->width*job->height*sizeof(RGBA32));
+                assert(item->pixels != NULL && "Buy more RAM lol");
+                render_pixels_rect(&program, item->pixels, job->width, 0, 0, job->width, job->height, job->width, job->height);
+            }
+        }
+        item->render_end = get_time_ns();
+        atomic_fetch_add(&p->render_busy_ns, item->render_end - item->gen_start);
+        arena_reset(&arena);
+
+        pipeline_push(item->ok && !item->cached ? &p->encode_queue : &p->write_queue, item);
+    }
+    atomic_fetch_sub(&p->renderers_left, 1);
+    sb_free(tree);
+    arena_free(&arena);
+    arena_free(&node_arena);
+    return NULL;
+}
+
+void *pipeline_encode(void *arg) {
+    Pipeline *p = arg;
+    unsigned spins = 0;
+    for (;;) {
+        // Read before popping: once no renderer is left, an empty queue stays empty
+        bool finished = atomic_load(&p->renderers_left) == 0;
+        void *data;
+        if (!mpmc_pop(&p->encode_queue.queue, &data)) {
+            if (finished) break;
+            backoff(&spins);
+            continue;
+        }
+        spins = 0;
+
+        Pipeline_Item *item = data;
+        uint64_t start = get_time_ns();
+        item->ok = image_encode(IMAGE_PNG, item->pixels, item->job->width, item->job->height, &item->png);
+        free(item->pixels);
+        item->pixels = NULL;
+        item->encode_ns = get_time_ns() - start;
+        atomic_fetch_add(&p->encode_busy_ns, item->encode_ns);
+
+        pipeline_push(&p->write_queue, item);
+    }
+    return NULL;
+}
+
+// Hands the images to the writer on the calling thread as they come out of the pipeline. Returns the number of
+// failed jobs, not counting the files that the writer fails to write later.
+size_t batch_pipeline(Pipeline *p, size_t render_workers, size_t encode_workers, FILE *manifest) {
+    size_t failed = 0;
+    atomic_init(&p->next_job, 0);
+    atomic_init(&p->renderers_left, render_workers);
+    mpmc_init(&p->encode_queue.queue, PIPELINE_QUEUE_CAPACITY);
+    mpmc_init(&p->write_queue.queue, PIPELINE_QUEUE_CAPACITY);
+
+    uint64_t start = get_time_ns();
+    pthread_t *threads = malloc((render_workers + encode_workers)*sizeof(pthread_t));
+    assert(threads != NULL && "Buy more RAM lol");
+    for (size_t i = 0; i < render_workers + encode_workers; ++i) {
+        if (pthread_create(&threads[i], NULL, i < render_workers ? pipeline_render : pipeline_encode, p) != 0) {
+            UNREACHABLE("could not start a pipeline thread");
+        }
+    }
+
+    uint64_t write_busy_ns = 0;
+    unsigned spins = 0;
+    for (size_t written = 0; written < p->jobs->count;) {
+        void *data;
+        if (!mpmc_pop(&p->write_queue.queue, &data)) {
+            backoff(&spins);
+            continue;
+        }
+        spins = 0;
+        written += 1;
+
+        Pipeline_Item *item = data;
+        Job *job = item->job;
+        uint64_t write_start = get_time_ns();
+        bool ok = item->ok;
+        if (ok && item->cache_path != NULL) {
+            if (item->cached) {
+                p->render_cache->hits += 1;
+            } else {
+                p->render_cache->misses += 1;
+                String_Builder copy = {0};
+                sb_append_buf(&copy, item->png.items, item->png.count);
+                render_cache_added(p->render_cache, copy.count);
+                output_writer_submit(p->writer, item->cache_path, &copy, true);
+            }
+        }
+        if (ok && p->tar != NULL) ok = tar_append(p->tar, job->output_path, item->png.items, item->png.count);
+        else if (ok)              output_writer_submit(p->writer, job->output_path, &item->png, false);
+        uint64_t job_end = get_time_ns();
+        write_busy_ns += job_end - write_start;
+
+        if (ok) {
+            fprintf(manifest, "%llu\t%zu\t%zu\t%s\t%zu\t%g\t%.3f\t%.3f\t%.3f\t%.3f\n",
+                    (unsigned long long)job->seed, job->width, job->height, job->output_path, item->nodes, item->cost,
+                    NS_TO_MS(item->render_start - item->gen_start), NS_TO_MS(item->render_end - item->render_start),
+                    NS_TO_MS(item->encode_ns + job_end - write_start), NS_TO_MS(job_end - item->gen_start));
+        } else {
+            nob_log(ERROR, "job %zu (seed %llu) failed", (size_t)(job - p->jobs->items), (unsigned long long)job->seed);
+            failed += 1;
+        }
+        sb_free(item->png);
+        free(item->cache_path);
+        free(item);
+    }
+
+    for (size_t i = 0; i < render_workers + encode_workers; ++i) pthread_join(threads[i], NULL);
+    double wall_ns = get_time_ns() - start;
+    if (wall_ns <= 0) wall_ns = 1;
+
+    Pipeline_Queue *queues[] = {&p->encode_queue, &p->write_queue};
+    double depth_mean[ARRAY_LEN(queues)];
+    for (size_t i = 0; i < ARRAY_LEN(queues); ++i) {
+        size_t samples = atomic_load(&queues[i]->depth_samples);
+        depth_mean[i] = samples > 0 ? (double)atomic_load(&queues[i]->depth_sum)/samples : 0.0;
+    }
+    nob_log(INFO, "pipeline: render %.1f%% busy (%zu threads), encode %.1f%% busy (%zu threads), write %.1f%% busy",
+            100.0*atomic_load(&p->render_busy_ns)/(wall_ns*render_workers), render_workers,
+            100.0*atomic_load(&p->encode_busy_ns)/(wall_ns*encode_workers), encode_workers,
+            100.0*write_busy_ns/wall_ns);
+    nob_log(INFO, "pipeline: encode queue depth %.2f mean, %zu max; write queue depth %.2f mean, %zu max (capacity %d)",
+            depth_mean[0], atomic_load(&p->encode_queue.depth_max),
+            depth_mean[1], atomic_load(&p->write_queue.depth_max), PIPELINE_QUEUE_CAPACITY);
+
+    free(threads);
+    mpmc_free(&p->encode_queue.queue);
+    mpmc_free(&p->write_queue.queue);
+    return failed;
+}
+
+// Sharded batch
+//
+// With -processes K, batch runs the jobs in K worker processes (`shard-worker`, started with nob's
+// cmd_run_async()) instead of threads, so a crash in one of them does not take the batch down and nothing of the
+// generator has to be thread-safe. Worker i takes every K-th job starting at i. Everything is shared through a
+// POSIX shared memory region: the header, a record for every job and SHARD_SLOTS_PER_WORKER pixel slots for every
+// worker. A worker claims a job, generates its function, renders straight into a free slot of its own and marks
+// the slot full. Encode threads of the parent take the full slots, encode the images, free the slots again and
+// hand the images to the batch's Output_Writer, so -writer and -fsync apply as usual.
+//
+// The parent sleeps on a pipe that SIGCHLD and the encode threads finishing jobs write to, and reaps the workers
+// with nob's proc_wait() as soon as waitid() sees one exit. When a worker did not exit cleanly its half-written
+// slots are freed, the job it was on goes back to pending and a new worker is started on the same shard, which
+// carries on with the jobs that are not done. A job that was being rendered during SHARD_MAX_ATTEMPTS crashes
+// fails instead, so a job that kills every worker can not stall the batch.
+
+#define SHARD_MAGIC 0x44524853 // "SHRD"
+#define SHARD_SLOTS_PER_WORKER 2
+#define SHARD_MAX_ATTEMPTS 2
+// Crashes in a row without a job to blame, such as a worker that can not start at all
+#define SHARD_MAX_START_FAILURES 3
+
+typedef enum {
+    SHARD_JOB_PENDING,
+    SHARD_JOB_CLAIMED,
+    SHARD_JOB_RENDERED,
+    SHARD_JOB_DONE,
+    SHARD_JOB_FAILED,
+} Shard_Job_State;
+
+typedef enum {
+    SHARD_SLOT_FREE,
+    SHARD_SLOT_WRITING,
+    SHARD_SLOT_FULL,
+    SHARD_SLOT_ENCODING,
+} Shard_Slot_State;
+
+typedef struct {
+    uint64_t seed;
+    uint32_t width;
+    uint32_t height;
+    _Atomic uint32_t state;
+    uint32_t attempts;
+    uint32_t nodes;
+    double cost;
+    uint64_t gen_ns;
+    uint64_t render_ns;
+} Shard_Job;
+
+typedef struct {
+    _Atomic uint32_t state;
+    uint32_t job;
+} Shard_Slot;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t workers;
+    uint64_t jobs_count;
+    uint64_t slot_size;
+    uint64_t size;
+    uint32_t depth;
+    uint64_t max_nodes;
+    double max_cost;
+    // Jobs the workers gave up on without crashing
+    _Atomic uint64_t failed;
+} Shard_Header;
+
+typedef struct {
+    Shard_Header *header;
+    Shard_Job *jobs;
+    Shard_Slot *slots;
+    uint8_t *pixels;
+} Shard_Region;
+
+size_t shard_align(size_t size) {
+    return (size + 63) & ~(size_t)63;
+}
+
+// Points `r` into the region mapped at `base`
+void shard_region_layout(Shard_Region *r, void *base) {
+    uint8_t *p = base;
+    r->header = base;
+    r->jobs = (Shard_Job*)(p + shard_align(sizeof(Shard_Header)));
+    r->slots = (Shard_Slot*)((uint8_t*)r->jobs + shard_align(r->header->jobs_count*sizeof(Shard_Job)));
+    r->pixels = (uint8_t*)r->slots + shard_align(r->header->workers*SHARD_SLOTS_PER_WORKER*sizeof(Shard_Slot));
+}
+
+size_t shard_region_size(size_t workers, size_t jobs_count, size_t slot_size) {
+    return shard_align(sizeof(Shard_Header)) + shard_align(jobs_count*sizeof(Shard_Job)) +
+           shard_align(workers*SHARD_SLOTS_PER_WORKER*sizeof(Shard_Slot)) + workers*SHARD_SLOTS_PER_WORKER*slot_size;
+}
+
+RGBA32 *shard_slot_pixels(Shard_Region *r, size_t slot) {
+    return (RGBA32*)(r->pixels + slot*r->header->slot_size);
+}
+
+// The budget that batch's -max-nodes or -max-cost ask for, NULL when neither does
+Gen_Budget *gen_budget_from_limits(Gen_Budget *budget, Grammar grammar, size_t depth, size_t max_nodes, double max_cost) {
+    if (max_nodes > 0) {
+        double unit_cost[COUNT_NK];
+        for (size_t k = 0; k < COUNT_NK; ++k) unit_cost[k] = 1.0;
+        gen_budget_init(budget, grammar, depth, unit_cost, max_nodes);
+        return budget;
+    }
+    if (max_cost > 0.0) {
+        gen_budget_init(budget, grammar, depth, node_eval_cost, max_cost);
+        return budget;
+    }
+    return NULL;
+}
+
+bool self_exe_path(char path[PATH_MAX]) {
+    ssize_t size = readlink("/proc/self/exe", path, PATH_MAX - 1);
+    if (size < 0) {
+        nob_log(ERROR, "could not find the executable: %s", strerror(errno));
+        return false;
+    }
+    path[size] = '\0';
+    return true;
+}
+
+// Renders the jobs of shard `shard` of the region `shm_name` into its slots
+bool command_shard_worker(Grammar grammar, int argc, char **argv) {
+    bool result = true;
+    void *base = MAP_FAILED;
+    size_t size = 0;
+    Arena arena = {0};
+    Gen_Budget budget = {0};
+    Gen_Budget *budget_ptr = NULL;
+
+    // Nobody would free the slots any more
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+    char *end = NULL;
+    size_t shard = argc == 2 ? strtoull(argv[1], &end, 10) : 0;
+    if (argc != 2 || *argv[1] == '\0' || *end != '\0') {
+        nob_log(ERROR, "usage: shard-worker <shared memory name> <shard>");
+        return_defer(false);
+    }
+    int fd = shm_open(argv[0], O_RDWR, 0);
+    if (fd < 0) {
+        nob_log(ERROR, "could not open shared memory %s: %s", argv[0], strerror(errno));
+        return_defer(false);
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        size = st.st_size;
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (base == MAP_FAILED || size < sizeof(Shard_Header) || ((Shard_Header*)base)->magic != SHARD_MAGIC ||
+        ((Shard_Header*)base)->size != size || shard >= ((Shard_Header*)base)->workers) {
+        nob_log(ERROR, "%s is not a batch region with shard %zu", argv[0], shard);
+        return_defer(false);
+    }
+
+    Shard_Region r;
+    shard_region_layout(&r, base);
+    Shard_Header *h = r.header;
+    budget_ptr = gen_budget_from_limits(&budget, grammar, h->depth, h->max_nodes, h->max_cost);
+    Tree_Cache tree_cache;
+    tree_cache_init(&tree_cache, grammar);
+
+    size_t next_slot = 0;
+    for (size_t j = shard; j < h->jobs_count; j += h->workers) {
+        Shard_Job *job = &r.jobs[j];
+        if (atomic_load(&job->state) != SHARD_JOB_PENDING) continue;
+        job->attempts += 1;
+        atomic_store(&job->state, SHARD_JOB_CLAIMED);
+
+        uint64_t gen_start = get_time_ns();
+        Program program;
+        Arena_Mark mark = arena_snapshot(&node_arena);
+        bool ok = gen_program_cached(&tree_cache, &arena, grammar, job->seed, h->depth, budget_ptr, &program, NULL);
+        arena_rewind(&node_arena, mark);
+        if (!ok) {
+            atomic_store(&job->state, SHARD_JOB_FAILED);
+            atomic_fetch_add(&h->failed, 1);
+            arena_reset(&arena);
+            continue;
+        }
+        job->nodes = program.count;
+        job->cost = 0.0;
+        for (size_t k = 0; k < program.count; ++k) job->cost += node_eval_cost[program.items[k].kind];
+
+        // Slots are used round robin, so the oldest one is the first to be free again
+        size_t slot = shard*SHARD_SLOTS_PER_WORKER + next_slot;
+        next_slot = (next_slot + 1)%SHARD_SLOTS_PER_WORKER;
+        unsigned spins = 0;
+        uint32_t expected = SHARD_SLOT_FREE;
+        while (!atomic_compare_exchange_weak(&r.slots[slot].state, &expected, SHARD_SLOT_WRITING)) {
+            expected = SHARD_SLOT_FREE;
+            backoff(&spins);
+        }
+
+        r.slots[slot].job = j;
+
+        uint64_t render_start = get_time_ns();
+        render_pixels_rect(&program, shard_slot_pixels(&r, slot), job->width, 0, 0, job->width, job->height, job->width, job->height);
+        job->gen_ns = render_start - gen_start;
+        job->render_ns = get_time_ns() - render_start;
+        // A crash between these two leaves a slot that shard_recover() publishes itself
+        atomic_store(&job->state, SHARD_JOB_RENDERED);
+        atomic_store(&r.slots[slot].state, SHARD_SLOT_FULL);
+        arena_reset(&arena);
+    }
+
+defer:
+    if (base != MAP_FAILED) munmap(base, size);
+    if (budget_ptr != NULL) gen_budget_free(budget_ptr);
+    arena_free(&arena);
+    return result;
+}
+
+typedef struct {
+    Shard_Region region;
+    Jobs *jobs;
+    FILE *manifest;
+    Output_Writer *writer;
+    pthread_mutex_t writer_lock; // output_writer_submit() takes one thread at a time
+    int wakeup_fd;               // the writing end of the pipe the parent sleeps on
+    atomic_size_t done;     // jobs encoded and written, or failed while doing that
+    atomic_size_t failed;   // of `done`
+    size_t crash_failed;    // jobs that crashed their workers too often
+    atomic_bool stop;
+} Shard_Run;
+
+// Every failed job has been counted once either here, by a worker or by the crash handling
+size_t shard_finished(Shard_Run *run) {
+    return atomic_load(&run->done) + atomic_load(&run->region.header->failed) + run->crash_failed;
+}
+
+// Wakes the parent up, a full pipe already does that
+void shard_wakeup(int fd) {
+    int saved_errno = errno;
+    char byte = 0;
+    if (write(fd, &byte, 1) < 0) {}
+    errno = saved_errno;
+}
+
+static int shard_sigchld_fd = -1;
+
+void shard_sigchld(int signum) {
+    (void)signum;
+    shard_wakeup(shard_sigchld_fd);
+}
+
+void *shard_encode(void *arg) {
+    Shard_Run *run = arg;
+    Shard_Region *r = &run->region;
+    size_t slots_count = r->header->workers*SHARD_SLOTS_PER_WORKER;
+    String_Builder png = {0};
+    unsigned spins = 0;
+    while (!atomic_load(&run->stop)) {
+        bool found = false;
+        for (size_t slot = 0; slot < slots_count; ++slot) {
+            uint32_t expected = SHARD_SLOT_FULL;
+            if (!atomic_compare_exchange_strong(&r->slots[slot].state, &expected, SHARD_SLOT_ENCODING)) continue;
+            found = true;
+
+            Shard_Job *job = &r->jobs[r->slots[slot].job];
+            Job *batch_job = &run->jobs->items[r->slots[slot].job];
+            uint64_t write_start = get_time_ns();
+            png.count = 0;
+            bool ok = image_encode(IMAGE_PNG, shard_slot_pixels(r, slot), job->width, job->height, &png);
+            atomic_store(&r->slots[slot].state, SHARD_SLOT_FREE);
+            if (!ok) nob_log(ERROR, "could not encode image: %s", batch_job->output_path);
+            if (ok) {
+                pthread_mutex_lock(&run->writer_lock);
+                output_writer_submit(run->writer, batch_job->output_path, &png, false);
+                pthread_mutex_unlock(&run->writer_lock);
+            }
+            uint64_t write_ns = get_time_ns() - write_start;
+
+            atomic_store(&job->state, ok ? SHARD_JOB_DONE : SHARD_JOB_FAILED);
+            if (ok) {
+                fprintf(run->manifest, "%llu\t%zu\t%zu\t%s\t%u\t%g\t%.3f\t%.3f\t%.3f\t%.3f\n",
+                        (unsigned long long)job->seed, batch_job->width, batch_job->height, batch_job->output_path,
+                        job->nodes, job->cost, NS_TO_MS(job->gen_ns), NS_TO_MS(job->render_ns), NS_TO_MS(write_ns),
+                        NS_TO_MS(job->gen_ns + job->render_ns + write_ns));
+            } else {
+                atomic_fetch_add(&run->failed, 1);
+            }
+            atomic_fetch_add(&run->done, 1);
+            shard_wakeup(run->wakeup_fd);
+            spins = 0;
+        }
+        if (!found) backoff(&spins);
+    }
+    sb_free(png);
+    return NULL;
+}
+
+Nob_Proc shard_spawn(const char *exe_path, const char *grammar_path, const char *shm_name, size_t shard) {
+    Cmd cmd = {0};
+    char shard_arg[32];
+    snprintf(shard_arg, sizeof(shard_arg), "%zu", shard);
+    cmd_append(&cmd, exe_path);
+    if (grammar_path != NULL) cmd_append(&cmd, "-grammar", grammar_path);
+    cmd_append(&cmd, "shard-worker", shm_name, shard_arg);
+    Nob_Proc proc = cmd_run_async(cmd);
+    cmd_free(cmd);
+    return proc;
+}
+
+// Puts the shard of a crashed worker back into a state a new worker can carry on from. Returns how many jobs it
+// was in the middle of.
+size_t shard_recover(Shard_Run *run, size_t shard) {
+    Shard_Region *r = &run->region;
+    size_t claimed = 0;
+    for (size_t j = shard; j < r->header->jobs_count; j += r->header->workers) {
+        Shard_Job *job = &r->jobs[j];
+        if (atomic_load(&job->state) != SHARD_JOB_CLAIMED) continue;
+        claimed += 1;
+        if (job->attempts >= SHARD_MAX_ATTEMPTS) {
+            nob_log(ERROR, "job %zu (seed %llu) crashed %u workers, giving up on it", j, (unsigned long long)job->seed, job->attempts);
+            atomic_store(&job->state, SHARD_JOB_FAILED);
+            run->crash_failed += 1;
+        } else {
+            atomic_store(&job->state, SHARD_JOB_PENDING);
+        }
+    }
+    // A slot being written holds the job it is written for, complete once the job is marked rendered
+    for (size_t k = 0; k < SHARD_SLOTS_PER_WORKER; ++k) {
+        Shard_Slot *slot = &r->slots[shard*SHARD_SLOTS_PER_WORKER + k];
+        if (atomic_load(&slot->state) != SHARD_SLOT_WRITING) continue;
+        bool rendered = atomic_load(&r->jobs[slot->job].state) == SHARD_JOB_RENDERED;
+        atomic_store(&slot->state, rendered ? SHARD_SLOT_FULL : SHARD_SLOT_FREE);
+    }
+    return claimed;
+}
+
+// Fails every job of `shard` that no worker is going to render any more
+void shard_abandon(Shard_Run *run, size_t shard) {
+    Shard_Region *r = &run->region;
+    for (size_t j = shard; j < r->header->jobs_count; j += r->header->workers) {
+        uint32_t state = atomic_load(&r->jobs[j].state);
+        if (state != SHARD_JOB_PENDING && state != SHARD_JOB_CLAIMED) continue;
+        atomic_store(&r->jobs[j].state, SHARD_JOB_FAILED);
+        run->crash_failed += 1;
+    }
+}
+
+// Runs the jobs in `processes` worker processes. Returns the number of failed jobs.
+size_t batch_shard(const char *grammar_path, Jobs *jobs, size_t processes, size_t encode_workers, size_t depth,
+                   size_t max_nodes, double max_cost, FILE *manifest, Output_Writer *writer) {
+    size_t failed = jobs->count;
+    Shard_Run run = {0};
+    int wakeup_fds[2] = {-1, -1};
+    struct sigaction old_sigchld;
+    bool sigchld_set = false;
+    void *base = MAP_FAILED;
+    size_t size = 0;
+    Nob_Procs procs = {0};
+    size_t *start_failures = NULL;
+    pthread_t *threads = NULL;
+    size_t threads_count = 0;
+    char shm_name[64];
+    snprintf(shm_name, sizeof(shm_name), "/randomart-batch-%d", (int)getpid());
+
+    char exe_path[PATH_MAX];
+    if (!self_exe_path(exe_path)) goto defer;
+    if (processes > jobs->count) processes = jobs->count;
+    if (processes == 0) return 0;
+
+    size_t slot_size = 0;
+    for (size_t i = 0; i < jobs->count; ++i) {
+        size_t bytes = jobs->items[i].width*jobs->items[i].height*sizeof(RGBA32);
+        if (bytes > slot_size) slot_size = bytes;
+    }
+    slot_size = shard_align(slot_size);
+    size = shard_region_size(processes, jobs->count, slot_size);
+
+    int fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        nob_log(ERROR, "could not create shared memory %s: %s", shm_name, strerror(errno));
+        goto defer;
+    }
+    if (ftruncate(fd, size) == 0) base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        nob_log(ERROR, "could not map %zu bytes of shared memory: %s", size, strerror(errno));
+        goto defer;
+    }
+
+    Shard_Header *h = base;
+    h->magic = SHARD_MAGIC;
+    h->workers = processes;
+    h->jobs_count = jobs->count;
+    h->slot_size = slot_size;
+    h->size = size;
+    h->depth = depth;
+    h->max_nodes = max_nodes;
+    h->max_cost = max_cost;
+    atomic_init(&h->failed, 0);
+    shard_region_layout(&run.region, base);
+    for (size_t i = 0; i < jobs->count; ++i) {
+        Shard_Job *job = &run.region.jobs[i];
+        job->seed = jobs->items[i].seed;
+        job->width = jobs->items[i].width;
+        job->height = jobs->items[i].height;
+        atomic_init(&job->state, SHARD_JOB_PENDING);
+    }
+    for (size_t i = 0; i < processes*SHARD_SLOTS_PER_WORKER; ++i) atomic_init(&run.region.slots[i].state, SHARD_SLOT_FREE);
+    run.jobs = jobs;
+    run.manifest = manifest;
+    run.writer = writer;
+    pthread_mutex_init(&run.writer_lock, NULL);
+
+    if (pipe2(wakeup_fds, O_CLOEXEC) < 0 || fcntl(wakeup_fds[1], F_SETFL, O_NONBLOCK) < 0) {
+        nob_log(ERROR, "could not create a pipe: %s", strerror(errno));
+        goto defer;
+    }
+    run.wakeup_fd = wakeup_fds[1];
+    shard_sigchld_fd = wakeup_fds[1];
+    struct sigaction sa = {.sa_handler = shard_sigchld, .sa_flags = SA_RESTART | SA_NOCLDSTOP};
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, &old_sigchld);
+    sigchld_set = true;
+    atomic_init(&run.done, 0);
+    atomic_init(&run.failed, 0);
+    atomic_init(&run.stop, false);
+
+    start_failures = calloc(processes, sizeof(size_t));
+    assert(start_failures != NULL && "Buy more RAM lol");
+    for (size_t i = 0; i < processes; ++i) da_append(&procs, shard_spawn(exe_path, grammar_path, shm_name, i));
+
+    threads = malloc(encode_workers*sizeof(pthread_t));
+    assert(threads != NULL && "Buy more RAM lol");
+    for (; threads_count < encode_workers; ++threads_count) {
+        if (pthread_create(&threads[threads_count], NULL, shard_encode, &run) != 0) UNREACHABLE("could not start an encode thread");
+    }
+
+    size_t restarts = 0;
+    while (shard_finished(&run) < jobs->count) {
+        for (size_t i = 0; i < processes; ++i) {
+            if (procs.items[i] == NOB_INVALID_PROC) continue;
+            // Only looks, proc_wait() reaps it with the usual messages about how it ended
+            siginfo_t info = {0};
+            if (waitid(P_PID, procs.items[i], &info, WEXITED | WNOHANG | WNOWAIT) < 0 || info.si_pid == 0) continue;
+            bool clean = proc_wait(procs.items[i]);
+            procs.items[i] = NOB_INVALID_PROC;
+            if (clean) continue;
+
+            if (shard_recover(&run, i) > 0) {
+                start_failures[i] = 0;
+            } else if (++start_failures[i] >= SHARD_MAX_START_FAILURES) {
+                nob_log(ERROR, "worker %zu keeps failing, giving up on its jobs", i);
+                shard_abandon(&run, i);
+                continue;
+            }
+            nob_log(WARNING, "worker %zu crashed, restarting it on the rest of its shard", i);
+            restarts += 1;
+            procs.items[i] = shard_spawn(exe_path, grammar_path, shm_name, i);
+        }
+        // Whatever happens after the checks above writes to the pipe, so nothing is missed while asleep
+        if (shard_finished(&run) == jobs->count) break;
+        char drain[64];
+        if (read(wakeup_fds[0], drain, sizeof(drain)) < 0 && errno != EINTR) UNREACHABLE("batch_shard read");
+    }
+
+    failed = atomic_load(&run.failed) + atomic_load(&h->failed) + run.crash_failed;
+    nob_log(INFO, "shards: %zu processes, %zu restarted after a crash", processes, restarts);
+
+defer:
+    atomic_store(&run.stop, true);
+    for (size_t i = 0; i < threads_count; ++i) pthread_join(threads[i], NULL);
+    // The workers are done with their shards by now, unless something went wrong before they could start
+    for (size_t i = 0; i < procs.count; ++i) {
+        if (procs.items[i] != NOB_INVALID_PROC) proc_wait(procs.items[i]);
+    }
+    if (sigchld_set) sigaction(SIGCHLD, &old_sigchld, NULL);
+    if (wakeup_fds[0] >= 0) close(wakeup_fds[0]);
+    if (wakeup_fds[1] >= 0) close(wakeup_fds[1]);
+    if (base != MAP_FAILED) munmap(base, size);
+    shm_unlink(shm_name);
+    free(threads);
+    free(start_failures);
+    da_free(procs);
+    return failed;
+}
+
+bool command_batch(Grammar grammar, const char *grammar_path, int argc, char **argv) {
+    bool result = true;
+    const char *jobs_path = NULL;
+    const char *manifest_path = NULL;
+    FILE *manifest = NULL;
+    RGBA32 *buffer = NULL;
+    Arena batch_arena = {0};
+    String_Builder content = {0};
+    size_t max_nodes = 0;
+    double max_cost = 0.0;
+    size_t depth = GEN_DEPTH;
+    Gen_Budget budget = {0};
+    Gen_Budget *budget_ptr = NULL;
+    Render_Cache render_cache = {0};
+    String_Builder tree = {0};
+    String_Builder png = {0};
+    bool pipeline = false;
+    Output_Backend backend = OUTPUT_SYNC;
+    size_t fsync_batch = 0;
+    const char *tar_path = NULL;
+    const char *tar_index_path = NULL;
+    Tar tar = {0};
+    const char *shm_name = NULL;
+    size_t shm_slots = FB_RING_DEFAULT_SLOTS;
+    Fb_Ring ring = {0};
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t render_workers = cpus > 0 ? cpus : 1;
+    size_t encode_workers = cpus > 1 ? cpus/2 : 1;
+    size_t processes = 0;
+    bool encode_workers_given = false;
+
+    while (argc > 0) {
+        const char *flag = shift_args(&argc, &argv);
+        if (strcmp(flag, "-pipeline") == 0) {
+            pipeline = true;
+        } else if (strcmp(flag, "-render-workers") == 0 || strcmp(flag, "-encode-workers") == 0) {
+            if (argc <= 0) {
+                nob_log(ERROR, "no value is provided for %s", flag);
+                return_defer(false);
+            }
+            size_t *workers = strcmp(flag, "-render-workers") == 0 ? &render_workers : &encode_workers;
+            if (!parse_size(flag, shift_args(&argc, &argv), workers)) return_defer(false);
+            if (workers == &render_workers) pipeline = true;
+            else                            encode_workers_given = true;
+        } else if (strcmp(flag, "-processes") == 0) {
+            if (argc <= 0) {
+                nob_log(ERROR, "no value is provided for %s", flag);
+                return_defer(false);
+            }
+            if (!parse_size(flag, shift_args(&argc, &argv), &processes)) return_defer(false);
+        } else if (strcmp(flag, "-manifest") == 0 || strcmp(flag, "-max-nodes") == 0 || strcmp(flag, "-max-cost") == 0 ||
+                   strcmp(flag, "-depth") == 0 || strcmp(flag, "-writer") == 0 || strcmp(flag, "-fsync") == 0 ||
+                   strcmp(flag, "-tar") == 0 || strcmp(flag, "-tar-index") == 0 || strcmp(flag, "-shm") == 0 ||
+                   strcmp(flag, "-shm-slots") == 0) {
+            if (argc <= 0) {
+                nob_log(ERROR, "no value is provided for %s", flag);
+                return_defer(false);
+            }
+            const char *value = shift_args(&argc, &argv);
+            if (strcmp(flag, "-manifest") == 0) {
+                manifest_path = value;
+            } else if (strcmp(flag, "-max-nodes") == 0) {
+                if (!parse_size(flag, value, &max_nodes)) return_defer(false);
+            } else if (strcmp(flag, "-depth") == 0) {
+                if (!parse_size(flag, value, &depth)) return_defer(false);
+            } else if (strcmp(flag, "-writer") == 0) {
+                if (!parse_output_backend(flag, value, &backend)) return_defer(false);
+            } else if (strcmp(flag, "-fsync") == 0) {
+                if (!parse_size(flag, value, &fsync_batch)) return_defer(false);
+            } else if (strcmp(flag, "-tar") == 0) {
+                tar_path = value;
+            } else if (strcmp(flag, "-tar-index") == 0) {
+                tar_index_path = value;
+            } else if (strcmp(flag, "-shm") == 0) {
+                shm_name = value;
+            } else if (strcmp(flag, "-shm-slots") == 0) {
+                if (!parse_size(flag, value, &shm_slots)) return_defer(false);
+            } else {
+                if (!parse_positive_float(flag, value, &max_cost)) return_defer(false);
+            }
+        } else if (jobs_path == NULL) {
+            jobs_path = flag;
+        } else {
+            nob_log(ERROR, "unexpected argument `%s`", flag);
+            return_defer(false);
+        }
+    }
+
+    if (jobs_path == NULL) {
+        nob_log(ERROR, "no jobs file is provided for batch");
+        return_defer(false);
+    }
+
+    if (max_nodes > 0 && max_cost > 0.0) {
+        nob_log(ERROR, "-max-nodes and -max-cost can not be used together");
+        return_defer(false);
+    }
+    if (depth > INT_MAX) {
+        nob_log(ERROR, "-depth is too large, got %zu", depth);
+        return_defer(false);
+    }
+    if ((max_nodes > 0 || max_cost > 0.0) && depth > ESTIMATE_MAX_DEPTH) {
+        nob_log(ERROR, "-depth is at most %d with -max-nodes or -max-cost, got %zu", ESTIMATE_MAX_DEPTH, depth);
+        return_defer(false);
+    }
+    if (tar_path != NULL && strcmp(tar_path, "-") == 0 && manifest_path == NULL) {
+        nob_log(ERROR, "-tar - needs -manifest, both would go to stdout otherwise");
+        return_defer(false);
+    }
+    if (tar_path == NULL && tar_index_path != NULL) {
+        nob_log(ERROR, "-tar-index needs -tar");
+        return_defer(false);
+    }
+    // With -processes the encode threads are those of the parent
+    if (encode_workers_given && processes == 0) pipeline = true;
+    if (processes > 0 && (pipeline || tar_path != NULL)) {
+        nob_log(ERROR, "-processes can not be used together with -pipeline or -tar");
+        return_defer(false);
+    }
+    if (shm_name != NULL && (pipeline || tar_path != NULL || processes > 0)) {
+        nob_log(ERROR, "-shm can not be used together with -pipeline, -tar or -processes");
+        return_defer(false);
+    }
+    if (shm_name != NULL && shm_name[0] != '/') {
+        nob_log(ERROR, "-shm expects a name starting with /, got `%s`", shm_name);
+        return_defer(false);
+    }
+    budget_ptr = gen_budget_from_limits(&budget, grammar, depth, max_nodes, max_cost);
+
+    if (strcmp(jobs_path, "-") == 0) {
+        if (!read_entire_stream(stdin, &content)) {
+            nob_log(ERROR, "could not read jobs from stdin");
+            return_defer(false);
+        }
+    } else if (!read_entire_file(jobs_path, &content)) {
+        return_defer(false);
+    }
+
+    Jobs jobs = {0};
+    if (!parse_jobs(&batch_arena, jobs_path, sb_to_sv(content), &jobs)) return_defer(false);
+    hash_job_keys(&batch_arena, &jobs);
+
+    manifest = stdout;
+    if (manifest_path != NULL) {
+        manifest = fopen(manifest_path, "wb");
+        if (manifest == NULL) {
+            nob_log(ERROR, "could not open %s: %s", manifest_path, strerror(errno));
+            return_defer(false);
+        }
+    }
+
+    size_t buffer_size = 0;
+    for (size_t i = 0; i < jobs.count; ++i) {
+        size_t size = jobs.items[i].width*jobs.items[i].height;
+        if (size > buffer_size) buffer_size = size;
+    }
+    if (shm_name != NULL && !fb_ring_create(&ring, shm_name, shm_slots, buffer_size)) return_defer(false);
+
+    // The pipeline allocates the pixels of every job as it goes, the workers of -processes and -shm render into
+    // shared memory
+    if (!pipeline && processes == 0 && shm_name == NULL) {
+        buffer = malloc(buffer_size*sizeof(RGBA32));
+        assert(buffer != NULL && "Buy more RAM lol");
+        memset(buffer, 0, buffer_size*sizeof(RGBA32));
+    }
+
+    fprintf(manifest, "seed\twidth\theight\toutput\tnodes\tcost\tgen_ms\trender_ms\twrite_ms\ttotal_ms\n");
+
+    // -tar is there to avoid a file per image, and both caches are made of exactly that, so it keeps them off
+    Tree_Cache tree_cache = {0};
+    if (tar_path == NULL) {
+        tree_cache_init(&tree_cache, grammar);
+        render_cache_init(&render_cache);
+    }
+
+    if (tar_path != NULL) {
+        if (tar_index_path == NULL && strcmp(tar_path, "-") != 0) tar_index_path = temp_sprintf("%s.index", tar_path);
+        if (!tar_open(&tar, tar_path, tar_index_path)) return_defer(false);
+    }
+
+    uint64_t batch_start = get_time_ns();
+    Output_Writer writer;
+    output_writer_init(&writer, backend, fsync_batch);
+    size_t failed = 0;
+    if (processes > 0) {
+        failed = batch_shard(grammar_path, &jobs, processes, encode_workers, depth, max_nodes, max_cost, manifest, &writer);
+    } else if (pipeline) {
+        Pipeline p = {
+            .grammar = grammar,
+            .jobs = &jobs,
+            .depth = depth,
+            .budget = budget_ptr,
+            .tree_cache = &tree_cache,
+            .render_cache = &render_cache,
+            .writer = &writer,
+            .tar = tar_path != NULL ? &tar : NULL,
+        };
+        failed = batch_pipeline(&p, render_workers, encode_workers, manifest);
+    } else {
+        for (size_t i = 0; i < jobs.count; ++i) {
+            Job *job = &jobs.items[i];
+            Arena_Mark mark = arena_snapshot(&node_arena);
+
+            uint64_t gen_start = get_time_ns();
+            Program program;
+            bool ok = gen_program_cached(&tree_cache, &node_arena, grammar, job->seed, depth, budget_ptr, &program, &tree);
+            uint64_t render_start = get_time_ns();
+            // The ring takes pixels, which the render cache does not have
+            char cache_path_buffer[PATH_MAX];
+            const char *cache_path = NULL;
+            if (ok && shm_name == NULL && render_cache_path(&render_cache, sb_to_sv(tree), job->width, job->height, cache_path_buffer)) {
+                cache_path = cache_path_buffer;
+            }
+            png.count = 0;
+            bool cached = cache_path != NULL && render_cache_read(cache_path, &png);
+            if (cache_path != NULL) {
+                if (cached) render_cache.hits += 1;
+                else        render_cache.misses += 1;
+            }
+            if (ok && shm_name != NULL) {
+                // Rendered in place, the consumer reads the pixels straight out of the slot
+                Fb_Frame *frame = fb_ring_acquire(&ring);
+                if (frame == NULL) {
+                    // Nobody is left to take the frames of the jobs after this one either
+                    failed += jobs.count - i;
+                    arena_rewind(&node_arena, mark);
+                    break;
+                }
+                render_pixels_rect(&program, frame->pixels, job->width, 0, 0, job->width, job->height, job->width, job->height);
+                frame->seed = job->seed;
+                frame->width = job->width;
+                frame->height = job->height;
+                snprintf(frame->name, sizeof(frame->name), "%s", job->output_path);
+                fb_ring_publish(&ring, frame);
+            } else if (ok && !cached) {
+                render_pixels_rect(&program, buffer, job->width, 0, 0, job->width, job->height, job->width, job->height);
+            }
+            uint64_t write_start = get_time_ns();
+            if (ok && !cached && shm_name == NULL) {
+                png.count = 0;
+                ok = image_encode(IMAGE_PNG, buffer, job->width, job->height, &png);
+                if (!ok) nob_log(ERROR, "could not encode image: %s", job->output_path);
+                if (ok && cache_path != NULL) {
+                    String_Builder copy = {0};
+                    sb_append_buf(&copy, png.items, png.count);
+                    render_cache_added(&render_cache, copy.count);
+                    output_writer_submit(&writer, cache_path, &copy, true);
+                }
+            }
+            if (ok && shm_name == NULL) {
+                if (tar_path != NULL) ok = tar_append(&tar, job->output_path, png.items, png.count);
+                else                  output_writer_submit(&writer, job->output_path, &png, false);
+            }
+            uint64_t job_end = get_time_ns();
+
+            if (ok) {
+                double cost = 0.0;
+                for (size_t k = 0; k < program.count; ++k) cost += node_eval_cost[program.items[k].kind];
+                fprintf(manifest, "%llu\t%zu\t%zu\t%s\t%zu\t%g\t%.3f\t%.3f\t%.3f\t%.3f\n",
+                        (unsigned long long)job->seed, job->width, job->height, job->output_path, program.count, cost,
+                        NS_TO_MS(render_start - gen_start), NS_TO_MS(write_start - render_start),
+                        NS_TO_MS(job_end - write_start), NS_TO_MS(job_end - gen_start));
+            } else {
+                nob_log(ERROR, "job %zu (seed %llu) failed", i, (unsigned long long)job->seed);
+                failed += 1;
+            }
+
+            arena_rewind(&node_arena, mark);
+        }
+    }
+    if (shm_name != NULL) {
+        fb_ring_close(&ring);
+        nob_log(INFO, "framebuffer ring %s: %zu frames handed over", shm_name, jobs.count - failed);
+    }
+    size_t write_failed = output_writer_finish(&writer);
+    if (tar_path != NULL) {
+        size_t members = tar.members;
+        uint64_t size = tar.offset;
+        if (!tar_close(&tar)) write_failed += members;
+        nob_log(INFO, "tar: %zu images, %.1f MiB in %s", members, size/1024.0/1024.0, tar_path);
+    }
+    uint64_t batch_ns = get_time_ns() - batch_start;
+    if (write_failed > 0) nob_log(ERROR, "%zu files could not be written", write_failed);
+    // -tar and -shm do not use the writer
+    if (tar_path == NULL && shm_name == NULL) {
+        nob_log(INFO, "output: %zu files, %.1f MiB written, %zu renders cached (%s, fsync %s)",
+                atomic_load(&writer.files), atomic_load(&writer.bytes)/1024.0/1024.0, atomic_load(&writer.cached),
+                output_backend_names[writer.backend], fsync_batch > 0 ? temp_sprintf("every %zu files", fsync_batch) : "off");
+    }
+
+    nob_log(INFO, "rendered %zu/%zu images in %.3f ms (%.2f images/s)",
+            jobs.count - failed, jobs.count, NS_TO_MS(batch_ns),
+            batch_ns > 0 ? (jobs.count - failed)/(batch_ns/1e9) : 0.0);
+    if (tree_cache.dir != NULL) {
+        nob_log(INFO, "tree cache: %zu hits, %zu misses, %zu evicted", atomic_load(&tree_cache.hits),
+                atomic_load(&tree_cache.misses), atomic_load(&tree_cache.files.evicted));
+    }
+    if (render_cache.dir != NULL) {
+        nob_log(INFO, "render cache: %zu hits, %zu misses, %zu evicted",
+                render_cache.hits, render_cache.misses, atomic_load(&render_cache.files.evicted));
+    }
+    if (failed > 0 || write_failed > 0) return_defer(false);
+
+defer:
+    if (manifest != NULL && manifest != stdout) fclose(manifest);
+    tar_close(&tar);
+    if (budget_ptr != NULL) gen_budget_free(budget_ptr);
+    render_cache_free(&render_cache);
+    free(buffer);
+    sb_free(png);
+    sb_free(tree);
+    sb_free(content);
+    arena_free(&batch_arena);
+    return result;
+}
+
+// Contact sheet
+//
+// Lays the images of many seeds or keys out in a grid inside one framebuffer, for comparing them side by side.
+// The workers first generate the functions in parallel, each into an arena of its own that is merged into the
+// sheet's arena once they are done. Then they take cells off an atomic counter and render each one straight into
+// its sub-rectangle of the sheet through the stride of render_pixels_rect(), with no image per cell in between.
+// Cells are handed out from the most to the least expensive function, so a slow one does not start last and hold
+// everyone up. The sheet is encoded once at the end.
+
+#define SHEET_DEFAULT_CELL 128
+#define SHEET_DEFAULT_GAP 4
+#define SHEET_BACKGROUND ((RGBA32) {.r = 0x20, .g = 0x20, .b = 0x20, .a = 0xFF})
+
+typedef struct {
+    uint64_t seed;
+    Program program;
+    double cost;
+    size_t x;
+    size_t y;
+} Sheet_Cell;
+
+typedef struct {
+    Grammar grammar;
+    Tree_Cache *tree_cache;
+    size_t depth;
+    Arena *arena; // where the Programs end up
+    pthread_mutex_t arena_lock;
+    atomic_bool failed;
+
+    Sheet_Cell *cells;
+    size_t count;
+    size_t cell_size;
+    RGBA32 *pixels;
+    size_t width;
+    atomic_size_t next;
+} Sheet;
+
+int sheet_cell_compare(const void *a, const void *b) {
+    double x = ((const Sheet_Cell*)a)->cost;
+    double y = ((const Sheet_Cell*)b)->cost;
+    return (x < y) - (x > y);
+}
+
+// The Programs outlive the worker, so its arena is handed over to the sheet at the end
+void *sheet_generate(void *arg) {
+    Sheet *sheet = arg;
+    Arena arena = {0};
+    for (;;) {
+        size_t index = atomic_fetch_add(&sheet->next, 1);
+        if (index >= sheet->count) break;
+        Sheet_Cell *cell = &sheet->cells[index];
+        Arena_Mark mark = arena_snapshot(&node_arena);
+        bool ok = gen_program_cached(sheet->tree_cache, &arena, sheet->grammar, cell->seed, sheet->depth, NULL, &cell->program, NULL);
+        arena_rewind(&node_arena, mark);
+        if (!ok) {
+            nob_log(ERROR, "could not generate the function of seed %llu", (unsigned long long)cell->seed);
+            atomic_store(&sheet->failed, true);
+            continue;
+        }
+        for (size_t k = 0; k < cell->program.count; ++k) cell->cost += node_eval_cost[cell->program.items[k].kind];
+    }
+    pthread_mutex_lock(&sheet->arena_lock);
+    arena_merge(sheet->arena, &arena);
+    pthread_mutex_unlock(&sheet->arena_lock);
+    arena_free(&node_arena);
+    return NULL;
+}
+
+void *sheet_render(void *arg) {
+    Sheet *sheet = arg;
+    for (;;) {
+        size_t index = atomic_fetch_add(&sheet->next, 1);
+        if (index >= sheet->count) break;
+        Sheet_Cell *cell = &sheet->cells[index];
+        RGBA32 *origin = sheet->pixels + cell->y*sheet->width + cell->x;
+        render_pixels_rect(&cell->program, origin, sheet->width, 0, 0, sheet->cell_size, sheet->cell_size,
+                           sheet->cell_size, sheet->cell_size);
+    }
+    return NULL;
+}
+
+bool command_sheet(Grammar grammar, int argc, char **argv) {
+    bool result = true;
+    const char *jobs_path = NULL;
+    const char *output_path = "sheet.png";
+    size_t cell_size = SHEET_DEFAULT_CELL;
+    size_t gap = SHEET_DEFAULT_GAP;
+    size_t cols = 0;
+    size_t depth = GEN_DEPTH;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t workers = cpus > 0 ? cpus : 1;
+    Arena sheet_arena = {0};
+    String_Builder content = {0};
+    String_Builder png = {0};
+    Sheet sheet = {0};
+    pthread_t *threads = NULL;
+
+    while (argc > 0) {
+        const char *flag = shift_args(&argc, &argv);
+        size_t *value = NULL;
+        if      (strcmp(flag, "-cell")    == 0) value = &cell_size;
+        else if (strcmp(flag, "-cols")    == 0) value = &cols;
+        else if (strcmp(flag, "-depth")   == 0) value = &depth;
+        else if (strcmp(flag, "-workers") == 0) value = &workers;
+
+        if (value != NULL || strcmp(flag, "-gap") == 0 || strcmp(flag, "-o") == 0) {
+            if (argc <= 0) {
+                nob_log(ERROR, "no value is provided for %s", flag);
+                return_defer(false);
+            }
+            const char *arg = shift_args(&argc, &argv);
+            if (strcmp(flag, "-o") == 0) {
+                output_path = arg;
+            } else if (strcmp(flag, "-gap") == 0) {
+                // Unlike the other sizes this one may be 0
+                char *end = NULL;
+                gap = strtoull(arg, &end, 10);
+                if (*arg == '\0' || *end != '\0') {
+                    nob_log(ERROR, "%s expects a non-negative integer, got `%s`", flag, arg);
+                    return_defer(false);
+                }
+            } else if (!parse_size(flag, arg, value)) {
+                return_defer(false);
+            }
+        } else if (jobs_path == NULL) {
+            jobs_path = flag;
+        } else {
+            nob_log(ERROR, "unexpected argument `%s`", flag);
+            return_defer(false);
+        }
+    }
+
+    if (jobs_path == NULL) {
+        nob_log(ERROR, "no jobs file is provided for sheet");
+        return_defer(false);
+    }
+    if (depth > INT_MAX) {
+        nob_log(ERROR, "-depth is too large, got %zu", depth);
+        return_defer(false);
+    }
+    if (strcmp(jobs_path, "-") == 0) {
+        if (!read_entire_stream(stdin, &content)) {
+            nob_log(ERROR, "could not read jobs from stdin");
+            return_defer(false);
+        }
+    } else if (!read_entire_file(jobs_path, &content)) {
+        return_defer(false);
+    }
+
+    Jobs jobs = {0};
+    if (!parse_jobs(&sheet_arena, jobs_path, sb_to_sv(content), &jobs)) return_defer(false);
+    if (jobs.count == 0) {
+        nob_log(ERROR, "%s has no jobs", jobs_path);
+        return_defer(false);
+    }
+    hash_job_keys(&sheet_arena, &jobs);
+
+    if (cols == 0) {
+        while (cols*cols < jobs.count) cols += 1;
+    }
+    size_t rows = (jobs.count + cols - 1)/cols;
+    sheet.cell_size = cell_size;
+    sheet.width = cols*cell_size + (cols + 1)*gap;
+    size_t height = rows*cell_size + (rows + 1)*gap;
+    if (sheet.width > INT_MAX/sizeof(RGBA32) || height > INT_MAX/sheet.width/sizeof(RGBA32)) {
+        nob_log(ERROR, "a %zux%zu sheet is too large to encode", sheet.width, height);
+        return_defer(false);
+    }
+
+    uint64_t gen_start = get_time_ns();
+    Tree_Cache tree_cache;
+    tree_cache_init(&tree_cache, grammar);
+    sheet.grammar = grammar;
+    sheet.tree_cache = &tree_cache;
+    sheet.depth = depth;
+    sheet.arena = &sheet_arena;
+    sheet.cells = arena_alloc(&sheet_arena, jobs.count*sizeof(Sheet_Cell));
+    sheet.count = jobs.count;
+    for (size_t i = 0; i < jobs.count; ++i) {
+        Sheet_Cell *cell = &sheet.cells[i];
+        cell->seed = jobs.items[i].seed;
+        cell->x = gap + (i%cols)*(cell_size + gap);
+        cell->y = gap + (i/cols)*(cell_size + gap);
+        cell->cost = 0.0;
+    }
+    atomic_init(&sheet.failed, false);
+    atomic_init(&sheet.next, 0);
+    if (workers > sheet.count) workers = sheet.count;
+    threads = malloc(workers*sizeof(pthread_t));
+    assert(threads != NULL && "Buy more RAM lol");
+    pthread_mutex_init(&sheet.arena_lock, NULL);
+    for (size_t i = 0; i < workers; ++i) {
+        if (pthread_create(&threads[i], NULL, sheet_generate, &sheet) != 0) UNREACHABLE("could not start a sheet worker");
+    }
+    for (size_t i = 0; i < workers; ++i) pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&sheet.arena_lock);
+    if (atomic_load(&sheet.failed)) return_defer(false);
+    qsort(sheet.cells, sheet.count, sizeof(Sheet_Cell), sheet_cell_compare);
+
+    uint64_t render_start = get_time_ns();
+    sheet.pixels = malloc(sheet.width*height*sizeof(RGBA32));
+    assert(sheet.pixels != NULL && "Buy more RAM lol");
+    for (size_t i = 0; i < sheet.width*height; ++i) sheet.pixels[i] = SHEET_BACKGROUND;
+    atomic_store(&sheet.next, 0);
+    for (size_t i = 0; i < workers; ++i) {
+        if (pthread_create(&threads[i], NULL, sheet_render, &sheet) != 0) UNREACHABLE("could not start a sheet worker");
+    }
+    for (size_t i = 0; i < workers; ++i) pthread_join(threads[i], NULL);
+
+    uint64_t encode_start = get_time_ns();
+    if (!image_encode(IMAGE_PNG, sheet.pixels, sheet.width, height, &png)) {
+        nob_log(ERROR, "could not encode image: %s", output_path);
+        return_defer(false);
+    }
+    if (!write_entire_file(output_path, png.items, png.count)) return_defer(false);
+    uint64_t end = get_time_ns();
+
+    nob_log(INFO, "generated: %s (%zu cells in %zux%zu, %zux%zu pixels)", output_path, sheet.count, cols, rows, sheet.width, height);
+    nob_log(INFO, "gen %.3f ms, render %.3f ms (%zu threads), encode and write %.3f ms",
+            NS_TO_MS(render_start - gen_start), NS_TO_MS(encode_start - render_start), workers, NS_TO_MS(end - encode_start));
+
+defer:
+    free(threads);
+    free(sheet.pixels);
+    sb_free(png);
+    sb_free(content);
+    arena_free(&sheet_arena);
+    return result;
+}
+
+bool command_key(Grammar grammar, int argc, char **argv) {
+    bool result = true;
+    Arena key_arena = {0};
+    const char *output_path = "output.png";
+    const char *key_path = NULL;
+    const char *fingerprint = NULL;
+    Render_Cache render_cache = {0};
+    String_Builder tree = {0};
+
+    while (argc > 0) {
+        const char *flag = shift_args(&argc, &argv);
+        if (strcmp(flag, "-hex") == 0 || strcmp(flag, "-o") == 0) {
+            if (argc <= 0) {
+                nob_log(ERROR, "no value is provided for %s", flag);
+                return_defer(false);
+            }
+            if (strcmp(flag, "-hex") == 0) fingerprint = shift_args(&argc, &argv);
+            else                           output_path = shift_args(&argc, &argv);
+        } else if (key_path == NULL) {
+            key_path = flag;
+        } else {
+            nob_log(ERROR, "unexpected argument `%s`", flag);
+            return_defer(false);
+        }
+    }
+
+    if ((key_path == NULL) == (fingerprint == NULL)) {
+        nob_log(ERROR, "key expects either a key file (`-` for stdin) or -hex <fingerprint>");
+        return_defer(false);
+    }
+
+    const uint8_t *key = NULL;
+    size_t key_size = 0;
+    if (fingerprint != NULL) {
+        if (!parse_hex_fingerprint(&key_arena, sv_from_cstr(fingerprint), &key, &key_size)) {
+            nob_log(ERROR, "invalid fingerprint `%s`", fingerprint);
+            return_defer(false);
+        }
+    } else if (!read_key_file(&key_arena, key_path, &key, &key_size)) {
+        return_defer(false);
+    }
+
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    sha256(key, key_size, digest);
+    uint64_t seed = seed_from_digest(digest);
+    char hex[2*SHA256_DIGEST_SIZE + 1];
+    digest_to_hex(digest, hex);
+    nob_log(INFO, "sha256: %s", hex);
+    nob_log(INFO, "seed: %llu", (unsigned long long)seed);
+
+    // The same key is rendered again and again, so after the first time its tree and its image come from the cache
+    Tree_Cache tree_cache;
+    tree_cache_init(&tree_cache, grammar);
+    render_cache_init(&render_cache);
+    Program program;
+    if (!gen_program_cached(&tree_cache, &key_arena, grammar, seed, GEN_DEPTH, NULL, &program, &tree)) return_defer(false);
+    char cache_path_buffer[PATH_MAX];
+    const char *cache_path = render_cache_path(&render_cache, sb_to_sv(tree), WIDTH, HEIGHT, cache_path_buffer) ? cache_path_buffer : NULL;
+    if (!render_cache_fetch(&render_cache, cache_path, output_path)) {
+        render_pixels_rect(&program, pixels, WIDTH, 0, 0, WIDTH, HEIGHT, WIDTH, HEIGHT);
+        if (!render_cache_write_png(&render_cache, cache_path, output_path, pixels, WIDTH, HEIGHT)) {
+            nob_log(ERROR, "could not save image: %s", output_path);
+            return_defer(false);
+        }
+    }
+    nob_log(INFO, "generated: %s%s", output_path, render_cache.hits > 0 ? " (cached)" : "");
+
+defer:
+    render_cache_free(&render_cache);
+    sb_free(tree);
+    arena_free(&key_arena);
+    return result;
+}
+
+// Prints the tree of a seed, or of an encoded tree file, and optionally saves it encoded
+bool command_tree(Grammar grammar, int argc, char **argv) {
+    bool result = true;
+    uint64_t seed = 0;
+    bool has_seed = false;
+    size_t depth = GEN_DEPTH;
+    const char *input_path = NULL;
+    const char *output_path = NULL;
+    String_Builder sb = {0};
+
+    while (argc > 0) {
+        const char *flag = shift_args(&argc, &argv);
+        if (argc <= 0) {
+            nob_log(ERROR, "no value is provided for %s", flag);
+            return_defer(false);
+        }
+        const char *value = shift_args(&argc, &argv);
+        if (strcmp(flag, "-seed") == 0) {
+            if (!parse_seed(sv_from_cstr(value), &seed)) {
+                nob_log(ERROR, "%s expects an integer", flag);
+                return_defer(false);
+            }
+            has_seed = true;
+        } else if (strcmp(flag, "-depth") == 0) {
+            if (!parse_size(flag, value, &depth)) return_defer(false);
+        } else if (strcmp(flag, "-i") == 0) {
+            input_path = value;
+        } else if (strcmp(flag, "-o") == 0) {
+            output_path = value;
+        } else {
+            nob_log(ERROR, "unexpected argument `%s`", flag);
+            return_defer(false);
+        }
+    }
+
+    if (has_seed == (input_path != NULL)) {
+        nob_log(ERROR, "tree expects either -seed <n> or -i <file>");
+        return_defer(false);
+    }
+    if (depth > INT_MAX) {
+        nob_log(ERROR, "-depth is too large, got %zu", depth);
+        return_defer(false);
+    }
+
+    Node *f = NULL;
+    if (input_path != NULL) {
+        if (!read_entire_file(input_path, &sb)) return_defer(false);
+        f = tree_decode(input_path, sb_to_sv(sb));
+        if (f == NULL) {
+            nob_log(ERROR, "%s is not an encoded tree", input_path);
+            return_defer(false);
+        }
+    } else {
+        Tree_Cache tree_cache;
+        tree_cache_init(&tree_cache, grammar);
+        f = gen_function_cached(&tree_cache, grammar, seed, depth, NULL);
+        if (f == NULL) return_defer(false);
+    }
+    node_print_ln(f);
+
+    if (output_path != NULL) {
+        sb.count = 0;
+        tree_encode(f, &sb);
+        if (!write_entire_file(output_path, sb.items, sb.count)) return_defer(false);
+        nob_log(INFO, "%zu nodes in %zu bytes: %s", node_count(f), sb.count, output_path);
+    }
+
+defer:
+    sb_free(sb);
+    return result;
+}
+
+// Encodes the trees of many seeds and checks that both ways of decoding them render bit-identical images to the
+// generated tree, and that a decoded tree encodes to the same bytes again. Run by nob on every build.
+bool command_tree_check(Grammar grammar, int argc, char **argv) {
+    bool result = true;
+    size_t seeds_count = 200;
+    size_t depth = GEN_DEPTH;
+    size_t size = 32;
+    String_Builder encoded = {0};
+    String_Builder again = {0};
+    RGBA32 *expected = NULL;
+    RGBA32 *actual = NULL;
+
+    while (argc > 0) {
+        const char *flag = shift_args(&argc, &argv);
+        size_t *value = NULL;
+        if      (strcmp(flag, "-seeds") == 0) value = &seeds_count;
+        else if (strcmp(flag, "-depth") == 0) value = &depth;
+        else if (strcmp(flag, "-size")  == 0) value = &size;
+        else {
+            nob_log(ERROR, "unexpected argument `%s`", flag);
+            return_defer(false);
+        }
+        if (argc <= 0) {
+            nob_log(ERROR, "no value is provided for %s", flag);
+            return_defer(false);
+        }
+        if (!parse_size(flag, shift_args(&argc, &argv), value)) return_defer(false);
+    }
+    if (depth > INT_MAX) {
+        nob_log(ERROR, "-depth is too large, got %zu", depth);
+        return_defer(false);
+    }
+
+    expected = malloc(size*size*sizeof(RGBA32));
+    actual = malloc(size*size*sizeof(RGBA32));
+    assert(expected != NULL && actual != NULL && "Buy more RAM lol");
+
+    size_t failed = 0;
+    for (uint64_t seed = 0; seed < seeds_count; ++seed) {
+        Arena_Mark mark = arena_snapshot(&node_arena);
+        Node *f = gen_function(grammar, seed, depth, NULL);
+        Program program;
+        if (f == NULL || !program_compile(&node_arena, f, &program)) return_defer(false);
+        render_pixels_rect(&program, expected, size, 0, 0, size, size, size, size);
+        encoded.count = 0;
+        tree_encode(f, &encoded);
+
+        const char *problem = NULL;
+        Node *decoded = tree_decode("tree-check", sb_to_sv(encoded));
+        if (decoded == NULL || !program_compile(&node_arena, decoded, &program)) {
+            problem = "does not decode into a tree";
+        } else {
+            render_pixels_rect(&program, actual, size, 0, 0, size, size, size, size);
+            again.count = 0;
+            tree_encode(decoded, &again);
+            if (memcmp(expected, actual, size*size*sizeof(RGBA32)) != 0) {
+                problem = "renders differently once decoded into a tree";
+            } else if (again.count != encoded.count || memcmp(again.items, encoded.items, encoded.count) != 0) {
+                problem = "encodes differently once decoded";
+            }
+        }
+        if (problem == NULL) {
+            if (!tree_decode_program(&node_arena, sb_to_sv(encoded), &program)) {
+                problem = "does not decode into a program";
+            } else {
+                render_pixels_rect(&program, actual, size, 0, 0, size, size, size, size);
+                if (memcmp(expected, actual, size*size*sizeof(RGBA32)) != 0) problem = "renders differently once decoded into a program";
+            }
+        }
+        if (problem != NULL) {
+            nob_log(ERROR, "the tree of seed %llu %s", (unsigned long long)seed, problem);
+            failed += 1;
+        }
+        arena_rewind(&node_arena, mark);
+    }
+
+    nob_log(INFO, "tree-check: %zu/%zu trees round-trip", seeds_count - failed, seeds_count);
+    if (failed > 0) return_defer(false);
+
+defer:
+    free(expected);
+    free(actual);
+    sb_free(encoded);
+    sb_free(again);
+    return result;
+}
+
+// Runs the retrying generator and the termination-aware one over the same seeds and reports how much work
+// and memory each of them wasted
+bool command_gen_stats(Grammar grammar, int argc, char **argv) {
+    size_t seeds_count = 1000;
+    size_t depth = GEN_DEPTH;
+
+    while (argc > 0) {
+        const char *flag = shift_args(&argc, &argv);
+        size_t *value = NULL;
+        if      (strcmp(flag, "-seeds") == 0) value = &seeds_count;
+        else if (strcmp(flag, "-depth") == 0) value = &depth;
+        else {
+            nob_log(ERROR, "unexpected argument `%s`", flag);
+            return false;
+        }
+        if (argc <= 0) {
+            nob_log(ERROR, "no value is provided for %s", flag);
+            return false;
+        }
+        if (!parse_size(flag, shift_args(&argc, &argv), value)) return false;
+    }
+    if (depth > INT_MAX) {
+        nob_log(ERROR, "-depth is too large, got %zu", depth);
+        return false;
+    }
+
+    printf("%-10s %8s %8s %12s %12s %12s %14s %14s %12s\n", "generator", "trees", "failed", "attempts", "failures",
+           "nodes/tree", "allocated/tree", "retained/tree", "total_ms");
+    bool retry_modes[] = {true, false};
+    for (size_t m = 0; m < ARRAY_LEN(retry_modes); ++m) {
+        Gen gen = {
+            .grammar = grammar,
+            .retry = retry_modes[m],
+        };
+        size_t failed = 0;
+        size_t nodes = 0;
+        size_t bytes_retained = 0;
+        uint64_t total_ns = 0;
+        for (uint64_t seed = 0; seed < seeds_count; ++seed) {
+            Arena_Mark mark = arena_snapshot(&node_arena);
+            uint64_t start = get_time_ns();
+            Node *f = gen_rule(&gen, GRAMMAR_ENTRY, depth, rng_new(seed));
+            total_ns += get_time_ns() - start;
+            bytes_retained += arena_bytes_since(&node_arena, mark);
+            if (f) nodes += node_count(f);
+            else   failed += 1;
+            arena_rewind(&node_arena, mark);
+        }
+        size_t trees = seeds_count - failed;
+        size_t bytes_allocated = bytes_retained + gen.bytes_discarded;
+        printf("%-10s %8zu %8zu %12zu %12zu %12.1f %14.1f %14.1f %12.3f\n",
+               gen.retry ? "retry" : "min-depth", trees, failed, gen.attempts, gen.failures,
+               trees > 0 ? (double)nodes/trees : 0.0,
+               trees > 0 ? (double)bytes_allocated/trees : 0.0,
+               trees > 0 ? (double)bytes_retained/trees : 0.0,
+               NS_TO_MS(total_ns));
+    }
+    return true;
+}
+
+#define ESTIMATE_CALIBRATION_SIZE 32
+
+bool command_estimate(Grammar grammar, int argc, char **argv) {
+    bool result = true;
+    size_t depth = GEN_DEPTH;
+    size_t samples = 1000;
+    size_t calibration = 20;
+    size_t width = WIDTH;
+    size_t height = HEIGHT;
+
+    while (argc > 0) {
+        const char *flag = shift_args(&argc, &argv);
+        size_t *value = NULL;
+        if      (strcmp(flag, "-depth")       == 0) value = &depth;
+        else if (strcmp(flag, "-samples")     == 0) value = &samples;
+        else if (strcmp(flag, "-calibration") == 0) value = &calibration;
+        else if (strcmp(flag, "-width")       == 0) value = &width;
+        else if (strcmp(flag, "-height")      == 0) value = &height;
+        else {
+            nob_log(ERROR, "unexpected argument `%s`", flag);
+            return false;
+        }
+        if (argc <= 0) {
+            nob_log(ERROR, "no value is provided for %s", flag);
+            return false;
+        }
+        if (!parse_size(flag, shift_args(&argc, &argv), value)) return false;
+    }
+
+    if (depth > ESTIMATE_MAX_DEPTH) {
+        nob_log(ERROR, "-depth is at most %d, got %zu", ESTIMATE_MAX_DEPTH, depth);
+        return false;
+    }
+    if ((int)depth < grammar.items[GRAMMAR_ENTRY].min_depth) {
+        nob_log(ERROR, "the grammar needs a depth of at least %d to terminate, got %zu", grammar.items[GRAMMAR_ENTRY].min_depth, depth);
+        return false;
+    }
+
+    Grammar_Estimates estimates = grammar_estimate(grammar, depth);
+    Tree_Estimate *analytic = grammar_estimate_at(&estimates, GRAMMAR_ENTRY, depth);
+
+    // Monte Carlo cross-check. The first `calibration` samples are also rendered at a small size to find out
+    // how long a unit of cost takes on this machine.
+    RGBA32 calibration_pixels[ESTIMATE_CALIBRATION_SIZE*ESTIMATE_CALIBRATION_SIZE];
+    double sampled_kinds[COUNT_NK] = {0};
+    double sampled_size = 0.0, sampled_size_sq = 0.0, sampled_cost = 0.0;
+    double calibration_cost = 0.0;
+    uint64_t calibration_ns = 0;
+    for (uint64_t seed = 0; seed < samples; ++seed) {
+        Arena_Mark mark = arena_snapshot(&node_arena);
+        Node *f = gen_function(grammar, seed, depth, NULL);
+        if (!f) return_defer(false);
+
+        size_t counts[COUNT_NK] = {0};
+        node_kind_counts(f, counts);
+        double size = 0.0, cost = 0.0;
+        for (size_t k = 0; k < COUNT_NK; ++k) {
+            sampled_kinds[k] += counts[k];
+            size += counts[k];
+            cost += counts[k]*node_eval_cost[k];
+        }
+        sampled_size += size;
+        sampled_size_sq += size*size;
+        sampled_cost += cost;
+
+        if (seed < calibration) {
+            Program program;
+            if (!program_compile(&node_arena, f, &program)) return_defer(false);
+            uint64_t start = get_time_ns();
+            render_pixels_rect(&program, calibration_pixels, ESTIMATE_CALIBRATION_SIZE, 0, 0,
+                               ESTIMATE_CALIBRATION_SIZE, ESTIMATE_CALIBRATION_SIZE,
+                               ESTIMATE_CALIBRATION_SIZE, ESTIMATE_CALIBRATION_SIZE);
+            calibration_ns += get_time_ns() - start;
+            calibration_cost += cost*ESTIMATE_CALIBRATION_SIZE*ESTIMATE_CALIBRATION_SIZE;
+        }
+        arena_rewind(&node_arena, mark);
+    }
+
+    printf("depth %zu, %zu samples\n\n", depth, samples);
+    printf("%-12s %14s %14s\n", "kind", "analytic", "sampled");
+    for (size_t k = 0; k < COUNT_NK; ++k) {
+        if (analytic->kinds[k] == 0.0 && sampled_kinds[k] == 0.0) continue;
+        printf("%-12s %14.3f %14.3f\n", nk_names[k], analytic->kinds[k], sampled_kinds[k]/samples);
+    }
+
+    double analytic_cost = tree_estimate_cost(analytic);
+    double analytic_stddev = sqrt(analytic->size_sq - analytic->size*analytic->size);
+    double sampled_mean = sampled_size/samples;
+    double sampled_stddev = sqrt(sampled_size_sq/samples - sampled_mean*sampled_mean);
+    printf("%-12s %14.3f %14.3f\n", "nodes", analytic->size, sampled_mean);
+    printf("%-12s %14.3f %14.3f\n", "nodes stddev", analytic_stddev, sampled_stddev);
+    printf("%-12s %14.3f %14.3f\n", "cost/pixel", analytic_cost, sampled_cost/samples);
+
+    if (calibration_cost > 0.0) {
+        double ns_per_unit = calibration_ns/calibration_cost;
+        printf("\n%.3f ns per unit of cost, expected render time of %zux%zu: %.3f ms\n",
+               ns_per_unit, width, height, NS_TO_MS(analytic_cost*width*height*ns_per_unit));
+    }
+
+defer:
+    free(estimates.items);
+    return result;
+}
+
+// Static grammar tables
+//
+// `grammar-c` prints a compiled grammar as C: the template nodes become one static array with the children
+// pointing into it by index, and the branches, min depths, levels and alias tables that grammar_compile()
+// computes become static arrays too. Including the result gives a ready-to-use Grammar without building or
+// compiling anything at start up, which is how the default grammar gets into the binary (src/default_grammar.h).
+
+typedef struct {
+    Node **items;
+    size_t count;
+    size_t capacity;
+} Grammar_Nodes;
+
+size_t grammar_nodes_index(Grammar_Nodes *nodes, Node *node) {
+    for (size_t i = 0; i < nodes->count; ++i) {
+        if (nodes->items[i] == node) return i;
+    }
+    UNREACHABLE("grammar_nodes_index");
+}
+
+// Grammar templates are only a few levels deep, so plain recursion is fine here
+void grammar_nodes_collect(Arena *a, Grammar_Nodes *nodes, Node *node) {
+    for (size_t i = 0; i < nodes->count; ++i) {
+        if (nodes->items[i] == node) return;
+    }
+    arena_da_append(a, nodes, node);
+    for (size_t i = 0; i < node_arity(node->kind); ++i) grammar_nodes_collect(a, nodes, *node_child(node, i));
+}
+
+void grammar_c_print_u32s(FILE *out, const char *name, size_t rule, size_t level, const uint32_t *items, size_t count) {
+    fprintf(out, "static uint32_t %s_%zu_%zu[] = {", name, rule, level);
+    for (size_t i = 0; i < count; ++i) fprintf(out, "%s%u", i > 0 ? ", " : "", items[i]);
+    fprintf(out, "};\n");
+}
+
+void grammar_c_print_alias(FILE *out, const char *name, size_t rule, size_t level) {
+    fprintf(out, "{%s_threshold_%zu_%zu, %s_alias_%zu_%zu}", name, rule, level, name, rule, level);
+}
+
+// Level `levels_count` of a rule stands for the alias table over all of its branches
+void grammar_c_print(FILE *out, Arena *a, Grammar grammar, const char *name) {
+    Grammar_Nodes nodes = {0};
+    for (size_t rule = 0; rule < grammar.count; ++rule) {
+        Grammar_Branches *branches = &grammar.items[rule];
+        for (size_t i = 0; i < branches->count; ++i) grammar_nodes_collect(a, &nodes, branches->items[i].node);
+    }
+
+    fprintf(out, "// Generated by `randomart grammar-c`, do not edit\n\n");
+
+    fprintf(out, "static Node %s_nodes[%zu] = {\n", name, nodes.count);
+    for (size_t i = 0; i < nodes.count; ++i) {
+        Node *node = nodes.items[i];
+        fprintf(out, "    {.kind = NK_");
+        for (const char *c = nk_names[node->kind]; *c != '\0'; ++c) fputc(toupper((unsigned char)*c), out);
+        // The baked node is where it is defined now, which also keeps the tables stable under edits of the source
+        fprintf(out, ", .file_path = __FILE__, .line = __LINE__");
+        switch (node->kind) {
+            case NK_X:
+            case NK_Y:
+            case NK_RANDOM:
+                break;
+            case NK_RULE:
+                fprintf(out, ", .as.rule = %d", node->as.rule);
+                break;
+            case NK_NUMBER:
+                fprintf(out, ", .as.number = %af", node->as.number);
+                break;
+            case NK_BOOLEAN:
+                fprintf(out, ", .as.boolean = %s", node->as.boolean ? "true" : "false");
+                break;
+
+            case NK_ADD:
+            case NK_MULT:
+            case NK_MOD:
+            case NK_GT:
+            case NK_LT:
+            case NK_GTEQ:
+            case NK_LTEQ:
+                fprintf(out, ", .as.binop = {&%s_nodes[%zu], &%s_nodes[%zu]}",
+                        name, grammar_nodes_index(&nodes, node->as.binop.lhs),
+                        name, grammar_nodes_index(&nodes, node->as.binop.rhs));
+                break;
+
+            case NK_TRIPLE:
+                fprintf(out, ", .as.triple = {&%s_nodes[%zu], &%s_nodes[%zu], &%s_nodes[%zu]}",
+                        name, grammar_nodes_index(&nodes, node->as.triple.first),
+                        name, grammar_nodes_index(&nodes, node->as.triple.second),
+                        name, grammar_nodes_index(&nodes, node->as.triple.third));
+                break;
+            case NK_IF:
+                fprintf(out, ", .as.iff = {&%s_nodes[%zu], &%s_nodes[%zu], &%s_nodes[%zu]}",
+                        name, grammar_nodes_index(&nodes, node->as.iff.cond),
+                        name, grammar_nodes_index(&nodes, node->as.iff.then),
+                        name, grammar_nodes_index(&nodes, node->as.iff.elze));
+                break;
+
+            case COUNT_NK:
+            default: UNREACHABLE("grammar_c_print");
+        }
+        fprintf(out, "},\n");
+    }
+    fprintf(out, "};\n\n");
+
+    for (size_t rule = 0; rule < grammar.count; ++rule) {
+        Grammar_Branches *branches = &grammar.items[rule];
+
+        fprintf(out, "static Grammar_Branch %s_branches_%zu[] = {\n", name, rule);
+        for (size_t i = 0; i < branches->count; ++i) {
+            Grammar_Branch *branch = &branches->items[i];
+            fprintf(out, "    {.node = &%s_nodes[%zu], .probability = %af, .min_depth = %d},\n",
+                    name, grammar_nodes_index(&nodes, branch->node), branch->probability, branch->min_depth);
+        }
+        fprintf(out, "};\n");
+
+        const char *threshold = temp_sprintf("%s_threshold", name);
+        const char *alias = temp_sprintf("%s_alias", name);
+        for (size_t l = 0; l < branches->levels_count; ++l) {
+            Grammar_Level *level = &branches->levels[l];
+            fprintf(out, "static size_t %s_level_branches_%zu_%zu[] = {", name, rule, l);
+            for (size_t i = 0; i < level->count; ++i) fprintf(out, "%s%zu", i > 0 ? ", " : "", level->branches[i]);
+            fprintf(out, "};\n");
+            grammar_c_print_u32s(out, threshold, rule, l, level->alias.threshold, level->count);
+            grammar_c_print_u32s(out, alias, rule, l, level->alias.alias, level->count);
+        }
+        grammar_c_print_u32s(out, threshold, rule, branches->levels_count, branches->alias.threshold, branches->count);
+        grammar_c_print_u32s(out, alias, rule, branches->levels_count, branches->alias.alias, branches->count);
+
+        // A rule that never terminates has no levels, and C has no empty arrays
+        if (branches->levels_count > 0) {
+            fprintf(out, "static Grammar_Level %s_levels_%zu[] = {\n", name, rule);
+            for (size_t l = 0; l < branches->levels_count; ++l) {
+                Grammar_Level *level = &branches->levels[l];
+                fprintf(out, "    {.min_depth = %d, .branches = %s_level_branches_%zu_%zu, .count = %zu, .alias = ",
+                        level->min_depth, name, rule, l, level->count);
+                grammar_c_print_alias(out, name, rule, l);
+                fprintf(out, "},\n");
+            }
+            fprintf(out, "};\n");
+        }
+        fprintf(out, "\n");
+    }
+
+    fprintf(out, "static Grammar_Branches %s_rules[%zu] = {\n", name, grammar.count);
+    for (size_t rule = 0; rule < grammar.count; ++rule) {
+        Grammar_Branches *branches = &grammar.items[rule];
+        fprintf(out, "    {\n");
+        fprintf(out, "        .items = %s_branches_%zu, .capacity = %zu, .count = %zu,\n", name, rule, branches->count, branches->count);
+        fprintf(out, "        .alias = ");
+        grammar_c_print_alias(out, name, rule, branches->levels_count);
+        fprintf(out, ",\n");
+        if (branches->levels_count > 0) {
+            fprintf(out, "        .min_depth = %d, .levels = %s_levels_%zu, .levels_count = %zu,\n",
+                    branches->min_depth, name, rule, branches->levels_count);
+        } else {
+            fprintf(out, "        .min_depth = %d, .levels = NULL, .levels_count = 0,\n", branches->min_depth);
+        }
+        fprintf(out, "    },\n");
+    }
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "static const Grammar %s = {.items = %s_rules, .capacity = %zu, .count = %zu};\n",
+            name, name, grammar.count, grammar.count);
+}
+
+bool command_grammar_c(Grammar grammar, int argc, char **argv) {
+    bool result = true;
+    const char *name = "default_grammar";
+    const char *output_path = NULL;
+    FILE *out = stdout;
+    Arena a = {0};
+
+    while (argc > 0) {
+        const char *flag = shift_args(&argc, &argv);
+        if (strcmp(flag, "-name") == 0 || strcmp(flag, "-o") == 0) {
+            if (argc <= 0) {
+                nob_log(ERROR, "no value is provided for %s", flag);
+                return_defer(false);
+            }
+            const char *value = shift_args(&argc, &argv);
+            if (strcmp(flag, "-name") == 0) name = value;
+            else output_path = value;
+        } else {
+            nob_log(ERROR, "unexpected argument `%s`", flag);
+            return_defer(false);
+        }
+    }
+
+    for (const char *c = name; *c != '\0'; ++c) {
+        if (!(isalnum((unsigned char)*c) || *c == '_') || (c == name && isdigit((unsigned char)*c))) {
+            nob_log(ERROR, "-name expects a C identifier, got `%s`", name);
+            return_defer(false);
+        }
+    }
+
+    if (output_path != NULL) {
+        out = fopen(output_path, "wb");
+        if (out == NULL) {
+            nob_log(ERROR, "could not open %s: %s", output_path, strerror(errno));
+            return_defer(false);
+        }
+    }
+
+    grammar_c_print(out, &a, grammar, name);
+    if (ferror(out)) {
+        nob_log(ERROR, "could not write the grammar tables");
+        return_defer(false);
+    }
+    if (output_path != NULL) nob_log(INFO, "generated: %s", output_path);
+
+defer:
+    if (out != NULL && out != stdout) fclose(out);
+    arena_free(&a);
+    return result;
+}
+
+// Grammar files
+//
+// The text form of a grammar is what grammar_print() prints: one rule per `<index> ::=`, its branches separated
+// by `|`, each one optionally followed by its probability in brackets (1 when left out). Rules are numbered in
+// order starting from 0, rule 0 is the entry. Whitespace and newlines are insignificant and `#` starts a comment
+// that runs to the end of the line.
+//
+//     0 ::= (rule(2),rule(2),rule(2))
+//     1 ::= random [1] | x [1] | y [1]
+//     2 ::= rule(1) [0.25] | add(rule(2),rule(2)) [0.375] | mult(rule(2),rule(2)) [0.375]
+//
+// Nodes are written the way node_print() prints them, so the same parser reads back printed trees.
+
+typedef struct {
+    const char *file_path;
+    const char *cur;
+    const char *end;
+    int line;
+} Lexer;
+
+Lexer lexer_new(const char *file_path, String_View content) {
+    return (Lexer) {
+        .file_path = file_path,
+        .cur = content.data,
+        .end = content.data + content.count,
+        .line = 1,
+    };
+}
+
+void lexer_skip(Lexer *l) {
+    while (l->cur < l->end) {
+        if (*l->cur == '#') {
+            while (l->cur < l->end && *l->cur != '\n') l->cur += 1;
+        } else if (isspace((unsigned char)*l->cur)) {
+            if (*l->cur == '\n') l->line += 1;
+            l->cur += 1;
+        } else {
+            break;
+        }
+    }
+}
+
+bool lexer_done(Lexer *l) {
+    lexer_skip(l);
+    return l->cur >= l->end;
+}
+
+// Consumes `text` if it comes next
+bool lexer_consume(Lexer *l, const char *text) {
+    lexer_skip(l);
+    size_t n = strlen(text);
+    if ((size_t)(l->end - l->cur) < n || memcmp(l->cur, text, n) != 0) return false;
+    l->cur += n;
+    return true;
+}
+
+bool lexer_expect(Lexer *l, const char *text) {
+    if (lexer_consume(l, text)) return true;
+    nob_log(ERROR, "%s:%d: expected `%s`", l->file_path, l->line, text);
+    return false;
+}
+
+bool lexer_is_word_char(char c) {
+    return isalnum((unsigned char)c) || c == '_';
+}
+
+String_View lexer_word(Lexer *l) {
+    lexer_skip(l);
+    const char *start = l->cur;
+    while (l->cur < l->end && lexer_is_word_char(*l->cur)) l->cur += 1;
+    return sv_from_parts(start, l->cur - start);
+}
+
+bool lexer_expect_word(Lexer *l, const char *word) {
+    Lexer saved = *l;
+    if (sv_eq(lexer_word(l), sv_from_cstr(word))) return true;
+    *l = saved;
+    nob_log(ERROR, "%s:%d: expected `%s`", l->file_path, l->line, word);
+    return false;
+}
+
+bool lexer_starts_number(Lexer *l) {
+    lexer_skip(l);
+    if (l->cur >= l->end) return false;
+    char c = *l->cur;
+    return isdigit((unsigned char)c) || c == '-' || c == '+' || c == '.';
+}
+
+bool lexer_number(Lexer *l, float *number) {
+    lexer_skip(l);
+    char buf[64];
+    size_t n = 0;
+    while (l->cur + n < l->end && n + 1 < sizeof(buf) && (isalnum((unsigned char)l->cur[n]) || strchr("+-.", l->cur[n]))) {
+        buf[n] = l->cur[n];
+        n += 1;
+    }
+    buf[n] = '\0';
+    char *end = NULL;
+    *number = strtof(buf, &end);
+    if (n == 0 || end == buf) {
+        nob_log(ERROR, "%s:%d: expected a number", l->file_path, l->line);
+        return false;
+    }
+    l->cur += end - buf;
+    return true;
+}
+
+bool lexer_index(Lexer *l, int *index) {
+    lexer_skip(l);
+    long value = 0;
+    const char *start = l->cur;
+    while (l->cur < l->end && isdigit((unsigned char)*l->cur) && value <= INT_MAX) {
+        value = value*10 + (*l->cur - '0');
+        l->cur += 1;
+    }
+    if (l->cur == start || value > INT_MAX) {
+        nob_log(ERROR, "%s:%d: expected a rule index", l->file_path, l->line);
+        return false;
+    }
+    *index = value;
+    return true;
+}
+
+// Parses one node with an explicit stack, so printed trees of any depth can be read back. The nodes are
+// allocated in node_arena and carry the position they were parsed at.
+Node *parse_node(Lexer *l) {
+    Node *result = NULL;
+    Arena scratch = {0};
+    Parse_Stack stack = {0};
+
+    for (;;) {
+        // The head of the next node: a leaf is done right away, anything else waits for its children
+        lexer_skip(l);
+        const char *file_path = l->file_path;
+        int line = l->line;
+        Node *node = NULL;
+        if (lexer_starts_number(l)) {
+            float number;
+            if (!lexer_number(l, &number)) return_defer(NULL);
+            node = node_number_loc(file_path, line, number);
+        } else if (lexer_consume(l, "(")) {
+            node = node_triple_loc(file_path, line, NULL, NULL, NULL);
+        } else {
+            String_View word = lexer_word(l);
+            if      (sv_eq(word, sv_from_cstr("x")))      node = node_loc(file_path, line, NK_X);
+            else if (sv_eq(word, sv_from_cstr("y")))      node = node_loc(file_path, line, NK_Y);
+            else if (sv_eq(word, sv_from_cstr("random"))) node = node_loc(file_path, line, NK_RANDOM);
+            else if (sv_eq(word, sv_from_cstr("true")))   node = node_boolean_loc(file_path, line, true);
+            else if (sv_eq(word, sv_from_cstr("false")))  node = node_boolean_loc(file_path, line, false);
+            else if (sv_eq(word, sv_from_cstr("if")))     node = node_if_loc(file_path, line, NULL, NULL, NULL);
+            else if (sv_eq(word, sv_from_cstr("inf")))    node = node_number_loc(file_path, line, INFINITY);
+            else if (sv_eq(word, sv_from_cstr("nan")))    node = node_number_loc(file_path, line, NAN);
+            else if (sv_eq(word, sv_from_cstr("rule"))) {
+                int rule;
+                if (!lexer_expect(l, "(") || !lexer_index(l, &rule) || !lexer_expect(l, ")")) return_defer(NULL);
+                node = node_rule_loc(file_path, line, rule);
+            } else {
+                for (Node_Kind kind = NK_ADD; kind <= NK_LTEQ; ++kind) {
+                    if (sv_eq(word, sv_from_cstr(nk_names[kind]))) {
+                        if (!lexer_expect(l, "(")) return_defer(NULL);
+                        node = node_binop_loc(file_path, line, kind, NULL, NULL);
+                        break;
+                    }
+                }
+            }
+            if (node == NULL) {
+                nob_log(ERROR, "%s:%d: expected a node, got `"SV_Fmt"`", file_path, line, SV_Arg(word));
+                return_defer(NULL);
+            }
+        }
+
+        if (node_arity(node->kind) > 0) {
+            arena_da_append(&scratch, &stack, ((Parse_Frame) {.node = node}));
+            continue;
+        }
+
+        // Attach the finished node to its parent, which may finish the parent in turn
+        for (;;) {
+            if (stack.count == 0) return_defer(node);
+            Parse_Frame *top = &stack.items[stack.count - 1];
+            *node_child(top->node, top->filled++) = node;
+
+            size_t arity = node_arity(top->node->kind);
+            bool done = top->filled == arity;
+            bool ok;
+            if (top->node->kind == NK_IF) {
+                ok = done || lexer_expect_word(l, top->filled == 1 ? "then" : "else");
+            } else {
+                ok = lexer_expect(l, done ? ")" : ",");
+            }
+            if (!ok) return_defer(NULL);
+            if (!done) break;
+
+            node = top->node;
+            stack.count -= 1;
+        }
+    }
+
+defer:
+    arena_free(&scratch);
+    return result;
+}
+
+// Rule references are checked once the whole grammar is read, nothing else in a template needs to be
+void grammar_check_rules(Grammar *grammar, Node *node, bool *ok) {
+    if (node->kind == NK_RULE) {
+        if (node->as.rule < 0 || (size_t)node->as.rule >= grammar->count) {
+            nob_log(ERROR, "%s:%d: there is no rule %d", node->file_path, node->line, node->as.rule);
+            *ok = false;
+        }
+        return;
+    }
+    for (size_t i = 0; i < node_arity(node->kind); ++i) grammar_check_rules(grammar, *node_child(node, i), ok);
+}
+
+bool grammar_parse(const char *file_path, String_View content, Grammar *grammar) {
+    memset(grammar, 0, sizeof(*grammar));
+    Lexer l = lexer_new(file_path, content);
+
+    while (!lexer_done(&l)) {
+        int index;
+        if (!lexer_index(&l, &index)) return false;
+        if ((size_t)index != grammar->count) {
+            nob_log(ERROR, "%s:%d: expected rule %zu, rules are numbered in order", l.file_path, l.line, grammar->count);
+            return false;
+        }
+        if (!lexer_expect(&l, "::=")) return false;
+
+        Grammar_Branches branches = {0};
+        do {
+            Grammar_Branch branch = {.probability = 1.0f};
+            branch.node = parse_node(&l);
+            if (branch.node == NULL) return false;
+            if (lexer_consume(&l, "[")) {
+                if (!lexer_number(&l, &branch.probability) || !lexer_expect(&l, "]")) return false;
+            }
+            arena_da_append(&node_arena, &branches, branch);
+        } while (lexer_consume(&l, "|"));
+        arena_da_append(&node_arena, grammar, branches);
+    }
+
+    if (grammar->count == 0) {
+        nob_log(ERROR, "%s: the grammar has no rules", file_path);
+        return false;
+    }
+
+    bool ok = true;
+    for (size_t i = 0; i < grammar->count; ++i) {
+        Grammar_Branches *branches = &grammar->items[i];
+        for (size_t j = 0; j < branches->count; ++j) grammar_check_rules(grammar, branches->items[j].node, &ok);
+    }
+    return ok;
+}
+
+// Reads back a whole function printed by node_print()
+Node *node_parse(const char *file_path, String_View text) {
+    Lexer l = lexer_new(file_path, text);
+    Node *f = parse_node(&l);
+    if (f == NULL) return NULL;
+    if (!lexer_done(&l)) {
+        nob_log(ERROR, "%s:%d: unexpected text after the function", l.file_path, l.line);
+        return NULL;
+    }
+    return f;
+}
+
+// Renders a function printed by node_print(), as logged by the other commands, without the seed it came from
+bool command_render(int argc, char **argv) {
+    bool result = true;
+    const char *input_path = NULL;
+    const char *output_path = "output.png";
+    size_t width = WIDTH;
+    size_t height = HEIGHT;
+    String_Builder text = {0};
+    RGBA32 *buffer = NULL;
+
+    while (argc > 0) {
+        const char *flag = shift_args(&argc, &argv);
+        if (strcmp(flag, "-o") == 0 || strcmp(flag, "-width") == 0 || strcmp(flag, "-height") == 0) {
+            if (argc <= 0) {
+                nob_log(ERROR, "no value is provided for %s", flag);
+                return_defer(false);
+            }
+            const char *value = shift_args(&argc, &argv);
+            if      (strcmp(flag, "-o") == 0) output_path = value;
+            else if (strcmp(flag, "-width") == 0) { if (!parse_size(flag, value, &width)) return_defer(false); }
+            else                                  { if (!parse_size(flag, value, &height)) return_defer(false); }
+        } else if (input_path == NULL) {
+            input_path = flag;
+        } else {
+            nob_log(ERROR, "unexpected argument `%s`", flag);
+            return_defer(false);
+        }
+    }
+
+    if (input_path == NULL) {
+        nob_log(ERROR, "no function file is provided for render");
+        return_defer(false);
+    }
+    if (strcmp(input_path, "-") == 0) {
+        if (!read_entire_stream(stdin, &text)) {
+            nob_log(ERROR, "could not read the function from stdin");
+            return_defer(false);
+        }
+        input_path = "stdin";
+    } else if (!read_entire_file(input_path, &text)) {
+        return_defer(false);
+    }
+
+    Node *f = node_parse(input_path, sb_to_sv(text));
+    if (f == NULL) return_defer(false);
+    Program program;
+    if (!program_compile(&node_arena, f, &program)) return_defer(false);
+
+    buffer = malloc(width*height*sizeof(RGBA32));
+    assert(buffer != NULL && "Buy more RAM lol");
+    render_pixels_rect(&program, buffer, width, 0, 0, width, height, width, height);
+    if (!stbi_write_png(output_path, width, height, 4, buffer, width*sizeof(RGBA32))) {
+        nob_log(ERROR, "could not save image: %s", output_path);
+        return_defer(false);
+    }
+    nob_log(INFO, "generated: %s", output_path);
+
+defer:
+    free(buffer);
+    sb_free(text);
+    return result;
+}
+
+// Grammar cache
+//
+// Parsing and compiling a grammar file is paid once. The compiled grammar is written as an image of the very
+// structs the generator uses, laid out back to back, with every pointer stored as an offset into the image and
+// listed in a relocation table. Later runs with the same file contents mmap the image, add the address it got
+// mapped at to every listed pointer, and use it as is. The mapping is private, so relocating only copies the
+// pages that hold pointers and the file itself is never modified. Images are keyed by the SHA-256 of the grammar
+// file, and one written by a build with a different struct layout is simply rebuilt. So is one whose body does
+// not match the SHA-256 in its header, as a flipped byte in a node kind or an index would crash the generator.
+// Every edit of a grammar file makes a new image, so they are kept under a budget of their own
+// ($RANDOMART_GRAMMAR_CACHE_BUDGET, GRAMMAR_CACHE_DEFAULT_BUDGET by default) as described under Cache budgets.
+
+#define GRAMMAR_CACHE_MAGIC 0x43524741 // "AGRC"
+#define GRAMMAR_CACHE_VERSION 2
+#define GRAMMAR_CACHE_ALIGN 16
+#define GRAMMAR_CACHE_DEFAULT_BUDGET (16*1024*1024)
+#define GRAMMAR_CACHE_LAYOUT ((uint32_t)(sizeof(Node) | sizeof(Grammar_Branches) << 8 | sizeof(Grammar_Level) << 16 | sizeof(void*) << 24))
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t layout;
+    uint32_t reserved;
+    uint8_t digest[SHA256_DIGEST_SIZE];      // of the grammar file
+    uint8_t body_digest[SHA256_DIGEST_SIZE]; // of everything after the header, before relocation
+    uint64_t size;                           // of the whole image, header included
+    uint64_t grammar_offset;
+    uint64_t relocs_offset;
+    uint64_t relocs_count;
+} Grammar_Cache_Header;
+
+typedef struct {
+    size_t *items;
+    size_t count;
+    size_t capacity;
+} Offsets;
+
+typedef struct {
+    String_Builder data;
+    Offsets relocs;
+} Grammar_Image;
+
+// Appends `size` bytes of `src` (zeros when NULL) and returns their offset
+size_t grammar_image_append(Grammar_Image *image, const void *src, size_t size) {
+    while (image->data.count%GRAMMAR_CACHE_ALIGN != 0) da_append(&image->data, 0);
+    size_t offset = image->data.count;
+    if (src != NULL) {
+        sb_append_buf(&image->data, src, size);
+    } else {
+        for (size_t i = 0; i < size; ++i) da_append(&image->data, 0);
+    }
+    return offset;
+}
+
+// Makes the pointer at `field` point to `target`, both offsets into the image
+void grammar_image_point(Grammar_Image *image, size_t field, size_t target) {
+    uintptr_t value = target;
+    memcpy(image->data.items + field, &value, sizeof(value));
+    da_append(&image->relocs, field);
+}
+
+void grammar_image_null(Grammar_Image *image, size_t field) {
+    memset(image->data.items + field, 0, sizeof(void*));
+}
+
+size_t grammar_image_alias(Grammar_Image *image, size_t field, Alias_Table *alias, size_t count) {
+    size_t threshold = grammar_image_append(image, alias->threshold, count*sizeof(*alias->threshold));
+    size_t aliases = grammar_image_append(image, alias->alias, count*sizeof(*alias->alias));
+    grammar_image_point(image, field + offsetof(Alias_Table, threshold), threshold);
+    grammar_image_point(image, field + offsetof(Alias_Table, alias), aliases);
+    return field;
+}
+
+void grammar_image_build(Grammar_Image *image, Arena *a, Grammar grammar, const uint8_t digest[SHA256_DIGEST_SIZE]) {
+    size_t header = grammar_image_append(image, NULL, sizeof(Grammar_Cache_Header));
+
+    Grammar_Nodes nodes = {0};
+    for (size_t rule = 0; rule < grammar.count; ++rule) {
+        Grammar_Branches *branches = &grammar.items[rule];
+        for (size_t i = 0; i < branches->count; ++i) grammar_nodes_collect(a, &nodes, branches->items[i].node);
+    }
+
+    // Every node of a grammar file shares the same path, so strings are only deduplicated against the last one
+    size_t *file_paths = arena_alloc(a, nodes.count*sizeof(*file_paths));
+    for (size_t i = 0; i < nodes.count; ++i) {
+        if (i > 0 && strcmp(nodes.items[i]->file_path, nodes.items[i - 1]->file_path) == 0) {
+            file_paths[i] = file_paths[i - 1];
+        } else {
+            file_paths[i] = grammar_image_append(image, nodes.items[i]->file_path, strlen(nodes.items[i]->file_path) + 1);
+        }
+    }
+
+    size_t nodes_offset = grammar_image_append(image, NULL, nodes.count*sizeof(Node));
+    for (size_t i = 0; i < nodes.count; ++i) {
+        Node *node = nodes.items[i];
+        size_t offset = nodes_offset + i*sizeof(Node);
+        memcpy(image->data.items + offset, node, sizeof(Node));
+        grammar_image_point(image, offset + offsetof(Node, file_path), file_paths[i]);
+        for (size_t j = 0; j < node_arity(node->kind); ++j) {
+            size_t field = offset + ((char*)node_child(node, j) - (char*)node);
+            grammar_image_point(image, field, nodes_offset + grammar_nodes_index(&nodes, *node_child(node, j))*sizeof(Node));
+        }
+    }
+
+    size_t rules_offset = grammar_image_append(image, grammar.items, grammar.count*sizeof(Grammar_Branches));
+    for (size_t rule = 0; rule < grammar.count; ++rule) {
+        Grammar_Branches *branches = &grammar.items[rule];
+        size_t offset = rules_offset + rule*sizeof(Grammar_Branches);
+
+        size_t items = grammar_image_append(image, branches->items, branches->count*sizeof(Grammar_Branch));
+        grammar_image_point(image, offset + offsetof(Grammar_Branches, items), items);
+        for (size_t i = 0; i < branches->count; ++i) {
+            size_t field = items + i*sizeof(Grammar_Branch) + offsetof(Grammar_Branch, node);
+            grammar_image_point(image, field, nodes_offset + grammar_nodes_index(&nodes, branches->items[i].node)*sizeof(Node));
+        }
+        grammar_image_alias(image, offset + offsetof(Grammar_Branches, alias), &branches->alias, branches->count);
+
+        if (branches->levels_count == 0) {
+            grammar_image_null(image, offset + offsetof(Grammar_Branches, levels));
+            continue;
+        }
+        size_t levels = grammar_image_append(image, branches->levels, branches->levels_count*sizeof(Grammar_Level));
+        grammar_image_point(image, offset + offsetof(Grammar_Branches, levels), levels);
+        for (size_t l = 0; l < branches->levels_count; ++l) {
+            Grammar_Level *level = &branches->levels[l];
+            size_t level_offset = levels + l*sizeof(Grammar_Level);
+            size_t level_branches = grammar_image_append(image, level->branches, level->count*sizeof(*level->branches));
+            grammar_image_point(image, level_offset + offsetof(Grammar_Level, branches), level_branches);
+            grammar_image_alias(image, level_offset + offsetof(Grammar_Level, alias), &level->alias, level->count);
+        }
+    }
+
+    size_t grammar_offset = grammar_image_append(image, &grammar, sizeof(grammar));
+    grammar_image_point(image, grammar_offset + offsetof(Grammar, items), rules_offset);
+
+    Grammar_Cache_Header h = {
+        .magic = GRAMMAR_CACHE_MAGIC,
+        .version = GRAMMAR_CACHE_VERSION,
+        .layout = GRAMMAR_CACHE_LAYOUT,
+        .grammar_offset = grammar_offset,
+        .relocs_count = image->relocs.count,
+    };
+    memcpy(h.digest, digest, SHA256_DIGEST_SIZE);
+    h.relocs_offset = grammar_image_append(image, image->relocs.items, image->relocs.count*sizeof(*image->relocs.items));
+    h.size = image->data.count;
+    sha256(image->data.items + sizeof(h), h.size - sizeof(h), h.body_digest);
+    memcpy(image->data.items + header, &h, sizeof(h));
+}
+
+bool grammar_cache_write(Cache_Files *files, const char *cache_path, Grammar grammar, const uint8_t digest[SHA256_DIGEST_SIZE]) {
+    Grammar_Image image = {0};
+    Arena a = {0};
+    grammar_image_build(&image, &a, grammar, digest);
+
+    bool ok = write_file_atomic(cache_path, image.data.items, image.data.count);
+    if (ok) cache_files_added(files, image.data.count);
+
+    da_free(image.data);
+    da_free(image.relocs);
+    arena_free(&a);
+    return ok;
+}
+
+// Maps the image at `cache_path` if it is there and fits this build and `digest`. Never fails loudly, a missing
+// or unusable image only means the grammar gets parsed again.
+bool grammar_cache_map(const char *cache_path, const uint8_t digest[SHA256_DIGEST_SIZE], Grammar *grammar) {
+    int fd = open(cache_path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(Grammar_Cache_Header)) {
+        close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    uint8_t *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return false;
+
+    Grammar_Cache_Header h;
+    memcpy(&h, base, sizeof(h));
+    bool ok = h.magic == GRAMMAR_CACHE_MAGIC && h.version == GRAMMAR_CACHE_VERSION && h.layout == GRAMMAR_CACHE_LAYOUT &&
+              memcmp(h.digest, digest, SHA256_DIGEST_SIZE) == 0 && h.size == size &&
+              h.relocs_offset <= size && h.relocs_count <= (size - h.relocs_offset)/sizeof(size_t) &&
+              h.grammar_offset%GRAMMAR_CACHE_ALIGN == 0 && h.grammar_offset + sizeof(Grammar) <= h.relocs_offset;
+    if (ok) {
+        uint8_t body_digest[SHA256_DIGEST_SIZE];
+        sha256(base + sizeof(h), size - sizeof(h), body_digest);
+        ok = memcmp(h.body_digest, body_digest, SHA256_DIGEST_SIZE) == 0;
+    }
+    for (size_t i = 0; ok && i < h.relocs_count; ++i) {
+        size_t field;
+        memcpy(&field, base + h.relocs_offset + i*sizeof(field), sizeof(field));
+        uintptr_t target;
+        ok = field%sizeof(uintptr_t) == 0 && field + sizeof(uintptr_t) <= h.relocs_offset;
+        if (!ok) break;
+        memcpy(&target, base + field, sizeof(target));
+        ok = target < h.relocs_offset;
+        target += (uintptr_t)base;
+        memcpy(base + field, &target, sizeof(target));
+    }
+    if (!ok) {
+        munmap(base, size);
+        return false;
+    }
+
+    // The mapping stays for the rest of the process, just like node_arena
+    memcpy(grammar, base + h.grammar_offset, sizeof(*grammar));
+    return true;
+}
+
+// Loads the grammar file at `file_path`, from its cached image when there is one
+bool grammar_load(const char *file_path, Grammar *grammar) {
+    bool result = true;
+    String_Builder content = {0};
+    if (!read_entire_file(file_path, &content)) return_defer(false);
+
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    sha256(content.items, content.count, digest);
+    Cache_Files files;
+    const char *cache_path = NULL;
+    if (cache_files_open(&files, cache_dir(), "grammar-", "", "RANDOMART_GRAMMAR_CACHE_BUDGET", GRAMMAR_CACHE_DEFAULT_BUDGET)) {
+        char hex[2*SHA256_DIGEST_SIZE + 1];
+        digest_to_hex(digest, hex);
+        cache_path = temp_sprintf("%s/grammar-%s", files.dir, hex);
+        if (grammar_cache_map(cache_path, digest, grammar)) {
+            cache_files_touch(cache_path);
+            return_defer(true);
+        }
+    }
+
+    // The nodes keep pointing at their file path for error messages
+    const char *path = arena_strdup(&node_arena, file_path);
+    if (!grammar_parse(path, sb_to_sv(content), grammar)) return_defer(false);
+    if (!grammar_compile(&node_arena, grammar)) return_defer(false);
+    if (cache_path != NULL) grammar_cache_write(&files, cache_path, *grammar, digest);
+
+defer:
+    sb_free(content);
+    return result;
+}
+
+// Render daemon
+//
+// `daemon` keeps one process with the grammar built and its caches warm, and serves render requests over a Unix
+// domain socket. Every connection gets a thread that reads one request per line:
+//
+//     <seed> <width> <height> <format> [<priority>]
+//
+// <seed> may be `hex:<fingerprint>` as in batch jobs and <format> is one of image_format_names. The answer is
+// `ok <size>\n` followed by the encoded image, or `error <message>\n`. Jobs of all connections go through one
+// queue to a pool of workers: higher priority first and, within the same priority, smaller images first, so a
+// thumbnail never waits behind a poster. Every worker generates into its own thread-local node_arena, and the
+// Programs are kept in an in-memory LRU. Generation, rendering and encoding all run in parallel. A client that
+// hangs up cancels its job, whether it is still queued or already being rendered, as the workers check between
+// strips.
+
+#define DAEMON_MAX_SIDE 16384
+#define DAEMON_MAX_LINE 1024
+#define DAEMON_TREES_CAPACITY 1024
+#define DAEMON_STRIP_ROWS 32
+
+#define DAEMON_STR_(x) #x
+#define DAEMON_STR(x) DAEMON_STR_(x)
+
+typedef struct {
+    uint64_t seed;
+    size_t width;
+    size_t height;
+    Image_Format format;
+    long priority;
+    uint64_t sequence;
+    uint64_t queued_ns;
+    atomic_bool cancelled;
+    int done_fd;          // write end of a pipe, the worker writes the address of the job there when done
+    bool ok;
+    String_Builder image; // the encoded image when `ok`
+} Daemon_Job;
+
+typedef struct {
+    Daemon_Job **items; // binary heap ordered by daemon_job_before()
+    size_t count;
+    size_t capacity;
+} Daemon_Queue;
+
+typedef struct {
+    uint64_t seed;
+    uint64_t last_used; // 0 for a free slot
+    Program program;
+} Daemon_Tree;
+
+typedef struct {
+    Grammar grammar;
+
+    pthread_mutex_t queue_lock;
+    pthread_cond_t queue_ready;
+    Daemon_Queue queue;
+    uint64_t sequence;
+
+    Tree_Cache tree_cache;
+
+    pthread_mutex_t trees_lock;
+    Daemon_Tree trees[DAEMON_TREES_CAPACITY];
+    uint64_t trees_tick;
+
+    atomic_size_t served;
+    atomic_size_t cancelled;
+    atomic_size_t tree_hits;
+    atomic_size_t tree_misses;
+} Daemon;
+
+bool daemon_job_before(const Daemon_Job *a, const Daemon_Job *b) {
+    if (a->priority != b->priority) return a->priority > b->priority;
+    if (a->width*a->height != b->width*b->height) return a->width*a->height < b->width*b->height;
+    return a->sequence < b->sequence;
+}
+
+void daemon_queue_push(Daemon *d, Daemon_Job *job) {
+    pthread_mutex_lock(&d->queue_lock);
+    job->sequence = d->sequence++;
+    Daemon_Queue *q = &d->queue;
+    da_append(q, job);
+    for (size_t i = q->count - 1; i > 0 && daemon_job_before(q->items[i], q->items[(i - 1)/2]); i = (i - 1)/2) {
+        Daemon_Job *parent = q->items[(i - 1)/2];
+        q->items[(i - 1)/2] = q->items[i];
+        q->items[i] = parent;
+    }
+    pthread_cond_signal(&d->queue_ready);
+    pthread_mutex_unlock(&d->queue_lock);
+}
+
+// Takes the top of the heap, the queue must be locked and not empty
+Daemon_Job *daemon_queue_take(Daemon_Queue *q) {
+    Daemon_Job *top = q->items[0];
+    q->items[0] = q->items[--q->count];
+    for (size_t i = 0;;) {
+        size_t best = i;
+        for (size_t child = 2*i + 1; child <= 2*i + 2 && child < q->count; ++child) {
+            if (daemon_job_before(q->items[child], q->items[best])) best = child;
+        }
+        if (best == i) break;
+        Daemon_Job *tmp = q->items[best];
+        q->items[best] = q->items[i];
+        q->items[i] = tmp;
+        i = best;
+    }
+    return top;
+}
+
+Daemon_Job *daemon_queue_pop(Daemon *d) {
+    pthread_mutex_lock(&d->queue_lock);
+    while (d->queue.count == 0) pthread_cond_wait(&d->queue_ready, &d->queue_lock);
+    Daemon_Job *top = daemon_queue_take(&d->queue);
+    pthread_mutex_unlock(&d->queue_lock);
+    return top;
+}
+
+// Takes the top of the queue only if it should run before `job`
+Daemon_Job *daemon_queue_pop_before(Daemon *d, const Daemon_Job *job) {
+    Daemon_Job *top = NULL;
+    pthread_mutex_lock(&d->queue_lock);
+    if (d->queue.count > 0 && daemon_job_before(d->queue.items[0], job)) top = daemon_queue_take(&d->queue);
+    pthread_mutex_unlock(&d->queue_lock);
+    return top;
+}
+
+// Copies the Program of `seed` into `a` if it is in the LRU. The LRU is small enough for a linear scan to cost
+// nothing next to rendering.
+bool daemon_trees_get(Daemon *d, Arena *a, uint64_t seed, Program *program) {
+    bool found = false;
+    pthread_mutex_lock(&d->trees_lock);
+    for (size_t i = 0; i < DAEMON_TREES_CAPACITY; ++i) {
+        Daemon_Tree *tree = &d->trees[i];
+        if (tree->last_used == 0 || tree->seed != seed) continue;
+        tree->last_used = ++d->trees_tick;
+        *program = tree->program;
+        program->items = arena_memdup(a, tree->program.items, tree->program.count*sizeof(Instr));
+        program->capacity = program->count;
+        found = true;
+        break;
+    }
+    pthread_mutex_unlock(&d->trees_lock);
+    return found;
+}
+
+void daemon_trees_put(Daemon *d, uint64_t seed, const Program *program) {
+    pthread_mutex_lock(&d->trees_lock);
+    Daemon_Tree *victim = &d->trees[0];
+    for (size_t i = 0; i < DAEMON_TREES_CAPACITY; ++i) {
+        Daemon_Tree *tree = &d->trees[i];
+        if (tree->last_used != 0 && tree->seed == seed) {
+            victim = NULL;
+            break;
+        }
+        if (tree->last_used < victim->last_used) victim = tree;
+    }
+    if (victim != NULL) {
+        free(victim->program.items);
+        victim->seed = seed;
+        victim->last_used = ++d->trees_tick;
+        victim->program = *program;
+        victim->program.items = malloc(program->count*sizeof(Instr));
+        assert(victim->program.items != NULL && "Buy more RAM lol");
+        memcpy(victim->program.items, program->items, program->count*sizeof(Instr));
+        victim->program.capacity = program->count;
+    }
+    pthread_mutex_unlock(&d->trees_lock);
+}
+
+// The Program of `seed` in `a`, from the LRU or else generated (or loaded from the tree cache). Two workers that
+// miss on the same seed at once both generate it, which costs less than making every miss wait for the others.
+bool daemon_program(Daemon *d, Arena *a, uint64_t seed, Program *program) {
+    if (daemon_trees_get(d, a, seed, program)) {
+        atomic_fetch_add(&d->tree_hits, 1);
+        return true;
+    }
+
+    atomic_fetch_add(&d->tree_misses, 1);
+    Arena_Mark mark = arena_snapshot(&node_arena);
+    bool ok = gen_program_cached(&d->tree_cache, a, d->grammar, seed, GEN_DEPTH, NULL, program, NULL);
+    arena_rewind(&node_arena, mark);
+    if (ok) daemon_trees_put(d, seed, program);
+    return ok;
+}
+
+void daemon_run(Daemon *d, Arena *a, Daemon_Job *job);
+
+// Between strips the worker runs whatever got queued meanwhile that should have gone first, so with every worker
+// busy on a poster a thumbnail waits for one strip rather than for the whole poster
+void daemon_render(Daemon *d, Arena *a, Daemon_Job *job) {
+    Program program;
+    if (!daemon_program(d, a, job->seed, &program)) return;
+
+    RGBA32 *pixels = malloc(job->width*job->height*sizeof(RGBA32));
+    assert(pixels != NULL && "Buy more RAM lol");
+    bool cancelled = false;
+    for (size_t y = 0; y < job->height && !cancelled; y += DAEMON_STRIP_ROWS) {
+        Daemon_Job *urgent;
+        while ((urgent = daemon_queue_pop_before(d, job)) != NULL) daemon_run(d, a, urgent);
+        cancelled = atomic_load(&job->cancelled);
+        size_t rows = job->height - y;
+        if (rows > DAEMON_STRIP_ROWS) rows = DAEMON_STRIP_ROWS;
+        if (!cancelled) render_pixels_rect(&program, pixels + y*job->width, job->width, 0, y, job->width, rows, job->width, job->height);
+    }
+    if (!cancelled) job->ok = image_encode(job->format, pixels, job->width, job->height, &job->image);
+    free(pixels);
+}
+
+void daemon_run(Daemon *d, Arena *a, Daemon_Job *job) {
+    if (!atomic_load(&job->cancelled)) daemon_render(d, a, job);
+    // The job belongs to whoever queued it and may be gone as soon as this is written. Writes to a pipe this
+    // small are atomic, so many workers can share one.
+    if (write(job->done_fd, &job, sizeof(job)) != sizeof(job)) UNREACHABLE("daemon_run write");
+}
+
+void *daemon_worker(void *arg) {
+    Daemon *d = arg;
+    Arena arena = {0};
+    for (;;) {
+        daemon_run(d, &arena, daemon_queue_pop(d));
+        arena_reset(&arena);
+    }
+    return NULL;
+}
+
+// Parses a request line into `job`. Returns NULL on success or the message for the client. Runs on connection
+// threads, so unlike parse_jobs() it stays away from temp.
+const char *daemon_parse_request(Arena *a, char *line, Daemon_Job *job) {
+    char *words[6];
+    size_t words_count = 0;
+    char *saveptr = NULL;
+    for (char *word = strtok_r(line, " \t\r", &saveptr); word != NULL; word = strtok_r(NULL, " \t\r", &saveptr)) {
+        if (words_count == ARRAY_LEN(words)) return "too many fields in a request";
+        words[words_count++] = word;
+    }
+    if (words_count < 4 || words_count > 5) return "expected <seed> <width> <height> <format> [<priority>]";
+
+    char *end = NULL;
+    if (strncmp(words[0], "hex:", 4) == 0) {
+        const uint8_t *key = NULL;
+        size_t key_size = 0;
+        if (!parse_hex_fingerprint(a, sv_from_cstr(words[0] + 4), &key, &key_size)) return "invalid fingerprint";
+        uint8_t digest[SHA256_DIGEST_SIZE];
+        sha256(key, key_size, digest);
+        job->seed = seed_from_digest(digest);
+    } else {
+        job->seed = strtoull(words[0], &end, 0);
+        if (*words[0] == '\0' || *end != '\0') return "invalid seed";
+    }
+
+    size_t *sizes[] = {&job->width, &job->height};
+    for (size_t i = 0; i < ARRAY_LEN(sizes); ++i) {
+        unsigned long long value = strtoull(words[1 + i], &end, 10);
+        if (*end != '\0' || value == 0 || value > DAEMON_MAX_SIDE) return "width and height must be between 1 and "DAEMON_STR(DAEMON_MAX_SIDE);
+        *sizes[i] = value;
+    }
+
+    job->format = COUNT_IMAGE_FORMATS;
+    for (size_t i = 0; i < COUNT_IMAGE_FORMATS; ++i) {
+        if (strcmp(words[3], image_format_names[i]) == 0) job->format = i;
+    }
+    if (job->format == COUNT_IMAGE_FORMATS) return "unknown format, expected png, bmp, tga or jpg";
+
+    if (words_count > 4) {
+        job->priority = strtol(words[4], &end, 10);
+        if (*end != '\0') return "invalid priority";
+    }
+    return NULL;
+}
+
+bool send_all(int fd, const void *data, size_t size) {
+    const char *bytes = data;
+    while (size > 0) {
+        ssize_t n = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool daemon_reply_error(int fd, const char *message) {
+    char header[DAEMON_MAX_LINE];
+    int n = snprintf(header, sizeof(header), "error %s\n", message);
+    return send_all(fd, header, n);
+}
+
+bool daemon_reply_image(int fd, String_View image) {
+    char header[64];
+    int n = snprintf(header, sizeof(header), "ok %zu\n", image.count);
+    return send_all(fd, header, n) && send_all(fd, image.data, image.count);
+}
+
+// Waits until the worker is done with `job`. A client that hangs up in the meantime cancels the job, but the
+// job still has to be waited for, the worker may be in the middle of it. Returns whether the client is there.
+// Only POLLHUP counts as hanging up: on a Unix socket it means the client closed both directions, while a
+// client that just shut down its writing side (`nc -N`, POLLRDHUP) is still waiting for the image.
+bool daemon_wait(int fd, int done_fd, Daemon_Job *job) {
+    struct pollfd fds[2] = {
+        {.fd = done_fd, .events = POLLIN},
+        {.fd = fd, .events = 0},
+    };
+    bool connected = true;
+    for (;;) {
+        if (poll(fds, connected ? 2 : 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            UNREACHABLE("daemon_wait poll");
+        }
+        if (fds[0].revents & POLLIN) break;
+        if (fds[1].revents & (POLLHUP | POLLERR)) {
+            atomic_store(&job->cancelled, true);
+            connected = false;
+        }
+    }
+    Daemon_Job *done;
+    if (read(done_fd, &done, sizeof(done)) != sizeof(done)) UNREACHABLE("daemon_wait read");
+    assert(done == job);
+    return connected;
+}
+
+typedef struct {
+    Daemon *d;
+    int fd;
+} Daemon_Connection;
+
+void *daemon_connection(void *arg) {
+    Daemon_Connection conn = *(Daemon_Connection*)arg;
+    free(arg);
+    Daemon *d = conn.d;
+    Arena arena = {0};
+    char buffer[DAEMON_MAX_LINE];
+    size_t buffered = 0;
+    int done_fds[2] = {-1, -1};
+    if (pipe2(done_fds, O_CLOEXEC) < 0) {
+        nob_log(ERROR, "could not create a pipe: %s", strerror(errno));
+        goto end;
+    }
+
+    for (;;) {
+        char *newline;
+        while ((newline = memchr(buffer, '\n', buffered)) == NULL) {
+            if (buffered == sizeof(buffer)) {
+                daemon_reply_error(conn.fd, "request line is too long");
+                goto end;
+            }
+            ssize_t n = read(conn.fd, buffer + buffered, sizeof(buffer) - buffered);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) goto end;
+            buffered += n;
+        }
+        *newline = '\0';
+
+        Daemon_Job job = {.done_fd = done_fds[1]};
+        const char *error = daemon_parse_request(&arena, buffer, &job);
+        size_t line_size = newline + 1 - buffer;
+        memmove(buffer, buffer + line_size, buffered - line_size);
+        buffered -= line_size;
+        arena_reset(&arena);
+        if (error != NULL) {
+            if (!daemon_reply_error(conn.fd, error)) goto end;
+            continue;
+        }
+
+        job.queued_ns = get_time_ns();
+        daemon_queue_push(d, &job);
+        bool connected = daemon_wait(conn.fd, done_fds[0], &job);
+        double ms = NS_TO_MS(get_time_ns() - job.queued_ns);
+        if (!connected) {
+            atomic_fetch_add(&d->cancelled, 1);
+            nob_log(INFO, "seed %llu %zux%zu %s: cancelled after %.3f ms",
+                    (unsigned long long)job.seed, job.width, job.height, image_format_names[job.format], ms);
+            sb_free(job.image);
+            goto end;
+        }
+
+        bool sent;
+        if (job.ok) {
+            sent = daemon_reply_image(conn.fd, sb_to_sv(job.image));
+            atomic_fetch_add(&d->served, 1);
+            nob_log(INFO, "seed %llu %zux%zu %s: %zu bytes in %.3f ms",
+                    (unsigned long long)job.seed, job.width, job.height, image_format_names[job.format], job.image.count, ms);
+        } else {
+            sent = daemon_reply_error(conn.fd, "could not render the image");
+        }
+        sb_free(job.image);
+        if (!sent) goto end;
+    }
+
+end:
+    if (done_fds[0] >= 0) close(done_fds[0]);
+    if (done_fds[1] >= 0) close(done_fds[1]);
+    close(conn.fd);
+    arena_free(&arena);
+    return NULL;
+}
+
+// Starts `workers` worker threads. The Daemon lives as long as the process, the workers never exit.
+Daemon *daemon_new(Grammar grammar, size_t workers) {
+    Daemon *d = calloc(1, sizeof(Daemon));
+    assert(d != NULL && "Buy more RAM lol");
+    d->grammar = grammar;
+    pthread_mutex_init(&d->queue_lock, NULL);
+    pthread_cond_init(&d->queue_ready, NULL);
+    pthread_mutex_init(&d->trees_lock, NULL);
+    tree_cache_init(&d->tree_cache, grammar);
+
+    for (size_t i = 0; i < workers; ++i) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, daemon_worker, d) != 0) {
+            nob_log(ERROR, "could not start worker %zu", i);
+            return NULL;
+        }
+        pthread_detach(thread);
+    }
+    return d;
+}
+
+// $RANDOMART_SOCKET, or randomart.sock in $XDG_RUNTIME_DIR, or /tmp/randomart-<uid>.sock
+const char *daemon_socket_path(void) {
+    const char *path = getenv("RANDOMART_SOCKET");
+    if (path != NULL && *path != '\0') return path;
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    if (dir != NULL && *dir != '\0') return temp_sprintf("%s/randomart.sock", dir);
+    return temp_sprintf("/tmp/randomart-%d.sock", (int)getuid());
+}
+
+bool daemon_socket_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        nob_log(ERROR, "socket path is too long: %s", path);
+        return false;
+    }
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+// Returns the listening socket or -1
+int daemon_listen(const char *socket_path) {
+    struct sockaddr_un addr;
+    if (!daemon_socket_address(socket_path, &addr)) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        nob_log(ERROR, "could not create socket: %s", strerror(errno));
+        return -1;
+    }
+    // A socket file nobody answers on is left over from a daemon that did not exit cleanly
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+        nob_log(ERROR, "a daemon is already listening on %s", socket_path);
+        close(fd);
+        return -1;
+    }
+    unlink(socket_path);
+    close(fd);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        nob_log(ERROR, "could not listen on %s: %s", socket_path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Returns the connected socket or -1
+int daemon_connect(const char *socket_path) {
+    struct sockaddr_un addr;
+    if (!daemon_socket_address(socket_path, &addr)) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        nob_log(ERROR, "could not connect to %s: %s", socket_path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static volatile sig_atomic_t daemon_stopping = 0;
+
+void daemon_stop(int signum) {
+    UNUSED(signum);
+    daemon_stopping = 1;
+}
+
+bool command_daemon(Grammar grammar, int argc, char **argv) {
+    bool result = true;
+    const char *socket_path = daemon_socket_path();
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t workers = cpus > 0 ? cpus : 1;
+    int listen_fd = -1;
+    bool bound = false;
+
+    while (argc > 0) {
+        const char *flag = shift_args(&argc, &argv);
+        if (strcmp(flag, "-socket") == 0 || strcmp(flag, "-workers") == 0) {
+            if (argc <= 0) {
+                nob_log(ERROR, "no value is provided for %s", flag);
+                return_defer(false);
+            }
+            const char *value = shift_args(&argc, &argv);
+            if (strcmp(flag, "-socket") == 0) socket_path = value;
+            else if (!parse_size(flag, value, &workers)) return_defer(false);
+        } else {
+            nob_log(ERROR, "unexpected argument `%s`", flag);
+            return_defer(false);
+        }
+    }
+
+    listen_fd = daemon_listen(socket_path);
+    if (listen_fd < 0) return_defer(false);
+    bound = true;
+
+    Daemon *d = daemon_new(grammar, workers);
+    if (d == NULL) return_defer(false);
+
+    // No SA_RESTART, so the signal interrupts accept()
+    struct sigaction sa = {.sa_handler = daemon_stop};
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    nob_log(INFO, "listening on %s with %zu workers", socket_path, workers);
+    while (!daemon_stopping) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            nob_log(ERROR, "could not accept a connection: %s", strerror(errno));
+            return_defer(false);
+        }
+        Daemon_Connection *conn = malloc(sizeof(*conn));
+        assert(conn != NULL && "Buy more RAM lol");
+        conn->d = d;
+        conn->fd = fd;
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, daemon_connection, conn) != 0) {
+            nob_log(ERROR, "could not start a connection thread");
+            close(fd);
+            free(conn);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    nob_log(INFO, "served %zu images, %zu cancelled, trees: %zu hits, %zu misses",
+            atomic_load(&d->served), atomic_load(&d->cancelled),
+            atomic_load(&d->tree_hits), atomic_load(&d->tree_misses));
+
+defer:
+    if (listen_fd >= 0) close(listen_fd);
+    if (bound) unlink(socket_path);
+    return result;
+}
+
+// Reads the answer to one request into `sb`, `image` points at the encoded image in it
+bool daemon_read_reply(int fd, String_Builder *sb, String_View *image) {
+    // The header line and the start of the image usually arrive together
+    char *newline = NULL;
+    char buffer[4096];
+    ssize_t n;
+    sb->count = 0;
+    while (newline == NULL && (n = read(fd, buffer, sizeof(buffer))) > 0) {
+        sb_append_buf(sb, buffer, n);
+        newline = memchr(sb->items, '\n', sb->count);
+    }
+    if (newline == NULL) {
+        nob_log(ERROR, "the daemon closed the connection without an answer");
+        return false;
+    }
+    *newline = '\0';
+    size_t header_size = newline + 1 - sb->items;
+    if (strncmp(sb->items, "error ", 6) == 0) {
+        nob_log(ERROR, "daemon: %s", sb->items + 6);
+        return false;
+    }
+    char *end = NULL;
+    unsigned long long size = strncmp(sb->items, "ok ", 3) == 0 ? strtoull(sb->items + 3, &end, 10) : 0;
+    if (end == NULL || *end != '\0') {
+        nob_log(ERROR, "unexpected answer from the daemon: %s", sb->items);
+        return false;
+    }
+    while (sb->count - header_size < size && (n = read(fd, buffer, sizeof(buffer))) > 0) sb_append_buf(sb, buffer, n);
+    if (sb->count - header_size != size) {
+        nob_log(ERROR, "the daemon sent %zu bytes of an image of %llu", sb->count - header_size, size);
+        return false;
+    }
+    *image = sv_from_parts(sb->items + header_size, size);
+    return true;
+}
+
+// Sends one request to the daemon and saves the image it answers with
+bool command_client(int argc, char **argv) {
+    bool result = true;
+    const char *socket_path = daemon_socket_path();
+    const char *output_path = NULL;
+    const char *format = "png";
+    const char *seed = NULL;
+    const char *key_path = NULL;
+    size_t width = WIDTH;
+    size_t height = HEIGHT;
+    long priority = 0;
+    int fd = -1;
+    Arena arena = {0};
+    String_Builder sb = {0};
+
+    while (argc > 0) {
+        const char *flag = shift_args(&argc, &argv);
+        if (strcmp(flag, "-socket") == 0 || strcmp(flag, "-o") == 0 || strcmp(flag, "-format") == 0 ||
+            strcmp(flag, "-width") == 0 || strcmp(flag, "-height") == 0 || strcmp(flag, "-priority") == 0 ||
+            strcmp(flag, "-key") == 0) {
+            if (argc <= 0) {
+                nob_log(ERROR, "no value is provided for %s", flag);
+                return_defer(false);
+            }
+            const char *value = shift_args(&argc, &argv);
+            if      (strcmp(flag, "-socket") == 0) socket_path = value;
+            else if (strcmp(flag, "-o")      == 0) output_path = value;
+            else if (strcmp(flag, "-format") == 0) format = value;
+            else if (strcmp(flag, "-key")    == 0) key_path = value;
+            else if (strcmp(flag, "-width")  == 0) { if (!parse_size(flag, value, &width))  return_defer(false); }
+            else if (strcmp(flag, "-height") == 0) { if (!parse_size(flag, value, &height)) return_defer(false); }
+            else {
+                char *end = NULL;
+                priority = strtol(value, &end, 10);
+                if (*value == '\0' || *end != '\0') {
+                    nob_log(ERROR, "%s expects an integer, got `%s`", flag, value);
+                    return_defer(false);
+                }
+            }
+        } else if (seed == NULL) {
+            seed = flag;
+        } else {
+            nob_log(ERROR, "unexpected argument `%s`", flag);
+            return_defer(false);
+        }
+    }
+
+    if ((seed == NULL) == (key_path == NULL)) {
+        nob_log(ERROR, "client expects either a seed (or hex:<fingerprint>) or -key <file>");
+        return_defer(false);
+    }
+    if (key_path != NULL) {
+        const uint8_t *key = NULL;
+        size_t key_size = 0;
+        if (!read_key_file(&arena, key_path, &key, &key_size)) return_defer(false);
+        String_Builder hex = {0};
+        sb_append_cstr(&hex, "hex:");
+        for (size_t i = 0; i < key_size; ++i) sb_append_cstr(&hex, temp_sprintf("%02x", key[i]));
+        sb_append_null(&hex);
+        seed = arena_strdup(&arena, hex.items);
+        sb_free(hex);
+    }
+    if (output_path == NULL) output_path = temp_sprintf("output.%s", format);
+
+    fd = daemon_connect(socket_path);
+    if (fd < 0) return_defer(false);
+
+    const char *request = temp_sprintf("%s %zu %zu %s %ld\n", seed, width, height, format, priority);
+    if (!send_all(fd, request, strlen(request))) {
+        nob_log(ERROR, "could not send the request: %s", strerror(errno));
+        return_defer(false);
+    }
+
+    String_View image;
+    if (!daemon_read_reply(fd, &sb, &image)) return_defer(false);
+    if (!write_entire_file(output_path, image.data, image.count)) return_defer(false);
+    nob_log(INFO, "generated: %s", output_path);
+
+defer:
+    if (fd >= 0) close(fd);
+    sb_free(sb);
+    arena_free(&arena);
+    return result;
+}
+
+// Streaming jobs
+//
+// `stream` feeds the daemon's worker pool from stdin and stdout rather than a socket, for shell pipelines. Every
+// line of stdin is a job, which is a daemon request prefixed with an id of the caller's choosing:
+//
+//     <id> <seed> <width> <height> <format> [<priority>]
+//
+// Every result goes to stdout as soon as its job is done, so not necessarily in the order of the input:
+//
+//     <id> ok <size>\n<image>    (with -dir: <id> ok <path>\n, the image is saved as <dir>/<id>.<format>)
+//     <id> error <message>\n
+//
+// Only STREAM_INFLIGHT_PER_WORKER jobs per worker are read ahead, so a long input does not pile up in memory.
+
+#define STREAM_MAX_ID 64
+#define STREAM_INFLIGHT_PER_WORKER 4
+
+typedef struct {
+    Daemon_Job job; // first, so the address the worker hands back is the address of the Stream_Job
+    char id[STREAM_MAX_ID + 1];
+} Stream_Job;
+
+bool write_all(int fd, const void *data, size_t size) {
+    const char *bytes = data;
+    while (size > 0) {
+        ssize_t n = write(fd, bytes, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
+
+// The answers are formatted on the stack rather than in temp, which belongs to the workers while they run.
+bool stream_error(const char *id, const char *message) {
+    char header[DAEMON_MAX_LINE];
+    int n = snprintf(header, sizeof(header), "%s error %s\n", id, message);
+    return write_all(STDOUT_FILENO, header, n < (int)sizeof(header) ? (size_t)n : sizeof(header) - 1);
+}
+
+bool stream_result(Stream_Job *sj, const char *dir) {
+    Daemon_Job *job = &sj->job;
+    if (!job->ok) return stream_error(sj->id, "could not render the image");
+    char header[PATH_MAX + STREAM_MAX_ID + 8];
+    int n;
+    if (dir != NULL) {
+        char path[PATH_MAX];
+        n = snprintf(path, sizeof(path), "%s/%s.%s", dir, sj->id, image_format_names[job->format]);
+        if (n >= (int)sizeof(path)) return stream_error(sj->id, "the path of the image is too long");
+        if (!write_entire_file(path, job->image.items, job->image.count)) return stream_error(sj->id, "could not save the image");
+        n = snprintf(header, sizeof(header), "%s ok %s\n", sj->id, path);
+        return write_all(STDOUT_FILENO, header, n);
+    }
+    n = snprintf(header, sizeof(header), "%s ok %zu\n", sj->id, job->image.count);
+    return write_all(STDOUT_FILENO, header, n) && write_all(STDOUT_FILENO, job->image.items, job->image.count);
+}
+
+// Queues the job of one input line, or answers it right away when it does not parse. Returns whether a job was
+// queued.
+bool stream_submit(Daemon *d, Arena *a, char *line, int done_fd) {
+    while (isspace((unsigned char)*line)) line += 1;
+    if (*line == '\0' || *line == '#') return false;
+
+    size_t id_size = 0;
+    while (line[id_size] != '\0' && !isspace((unsigned char)line[id_size])) id_size += 1;
+    char id[STREAM_MAX_ID + 1];
+    if (id_size > STREAM_MAX_ID || memchr(line, '/', id_size) != NULL) {
+        snprintf(id, sizeof(id), "%.*s", (int)(id_size < STREAM_MAX_ID ? id_size : STREAM_MAX_ID), line);
+        stream_error(id, "ids are at most "DAEMON_STR(STREAM_MAX_ID)" characters without `/`");
+        return false;
+    }
+    memcpy(id, line, id_size);
+    id[id_size] = '\0';
+
+    Stream_Job *sj = calloc(1, sizeof(Stream_Job));
+    assert(sj != NULL && "Buy more RAM lol");
+    memcpy(sj->id, id, id_size + 1);
+    sj->job.done_fd = done_fd;
+    const char *error = daemon_parse_request(a, line + id_size, &sj->job);
+    arena_reset(a);
+    if (error != NULL) {
+        stream_error(id, error);
+        free(sj);
+        return false;
+    }
+    sj->job.queued_ns = get_time_ns();
+    daemon_queue_push(d, &sj->job);
+    return true;
+}
+
+bool command_stream(Grammar grammar, int argc, char **argv) {
+    bool result = true;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t workers = cpus > 0 ? cpus : 1;
+    const char *dir = NULL;
+    int done_fds[2] = {-1, -1};
+    String_Builder input = {0};
+    Arena arena = {0};
+
+    while (argc > 0) {
+        const char *flag = shift_args(&argc, &argv);
+        if (strcmp(flag, "-workers") == 0 || strcmp(flag, "-dir") == 0) {
+            if (argc <= 0) {
+                nob_log(ERROR, "no value is provided for %s", flag);
+                return_defer(false);
+            }
+            const char *value = shift_args(&argc, &argv);
+            if (strcmp(flag, "-dir") == 0) dir = value;
+            else if (!parse_size(flag, value, &workers)) return_defer(false);
+        } else {
+            nob_log(ERROR, "unexpected argument `%s`", flag);
+            return_defer(false);
+        }
+    }
+    if (dir != NULL && !cache_mkdir(dir)) return_defer(false);
+
+    if (pipe2(done_fds, O_CLOEXEC) < 0) {
+        nob_log(ERROR, "could not create a pipe: %s", strerror(errno));
+        return_defer(false);
+    }
+    Daemon *d = daemon_new(grammar, workers);
+    if (d == NULL) return_defer(false);
+
+    size_t max_inflight = workers*STREAM_INFLIGHT_PER_WORKER;
+    size_t inflight = 0;
+    size_t consumed = 0; // bytes of `input` that have been submitted already
+    size_t done = 0;
+    size_t failed = 0;
+    bool eof = false;
+    uint64_t start = get_time_ns();
+    while (!eof || inflight > 0 || consumed < input.count) {
+        while (inflight < max_inflight && consumed < input.count) {
+            char *line = input.items + consumed;
+            char *newline = memchr(line, '\n', input.count - consumed);
+            if (newline == NULL) {
+                if (!eof) break;
+                // The last line without a newline
+                sb_append_null(&input);
+                newline = input.items + input.count - 1;
+                line = input.items + consumed;
+            }
+            *newline = '\0';
+            consumed = newline + 1 - input.items;
+            if (stream_submit(d, &arena, line, done_fds[1])) inflight += 1;
+        }
+
+        struct pollfd fds[2] = {
+            {.fd = done_fds[0], .events = POLLIN},
+            {.fd = STDIN_FILENO, .events = POLLIN},
+        };
+        bool reading = !eof && inflight < max_inflight;
+        if (inflight == 0 && !reading) continue;
+        if (poll(fds, reading ? 2 : 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            nob_log(ERROR, "could not poll: %s", strerror(errno));
+            return_defer(false);
+        }
+
+        if (reading && (fds[1].revents & (POLLIN | POLLHUP))) {
+            if (consumed > 0) {
+                memmove(input.items, input.items + consumed, input.count - consumed);
+                input.count -= consumed;
+                consumed = 0;
+            }
+            char buffer[64*1024];
+            ssize_t n = read(STDIN_FILENO, buffer, sizeof(buffer));
+            if (n < 0 && errno != EINTR) {
+                nob_log(ERROR, "could not read jobs from stdin: %s", strerror(errno));
+                return_defer(false);
+            }
+            if (n == 0) eof = true;
+            if (n > 0) sb_append_buf(&input, buffer, n);
+        }
+
+        if (fds[0].revents & POLLIN) {
+            // Every record is a whole pointer, workers write them atomically
+            Stream_Job *finished[64];
+            ssize_t n = read(done_fds[0], finished, sizeof(finished));
+            if (n < 0 && errno != EINTR) UNREACHABLE("command_stream read");
+            for (ssize_t i = 0; i < n/(ssize_t)sizeof(*finished); ++i) {
+                Stream_Job *sj = finished[i];
+                bool ok = stream_result(sj, dir);
+                if (sj->job.ok) done += 1;
+                else            failed += 1;
+                sb_free(sj->job.image);
+                free(sj);
+                inflight -= 1;
+                if (!ok) {
+                    nob_log(ERROR, "could not write to stdout: %s", strerror(errno));
+                    return_defer(false);
+                }
+            }
+        }
+    }
+    uint64_t elapsed_ns = get_time_ns() - start;
+
+    nob_log(INFO, "streamed %zu images (%zu failed) in %.3f ms with %zu workers, trees: %zu hits, %zu misses",
+            done, failed, NS_TO_MS(elapsed_ns), workers, atomic_load(&d->tree_hits), atomic_load(&d->tree_misses));
+
+defer:
+    // Jobs still in flight on an error are left to the workers, the process is about to exit anyway
+    if (done_fds[0] >= 0) close(done_fds[0]);
+    sb_free(input);
+    arena_free(&arena);
+    return result;
+}
+
+// Fork server
+//
+// `zygote` is for callers that want every render isolated in its own process. The parent does everything that does
+// not depend on the seed once: the grammar with its alias tables, the grammar digest of the tree cache, the dynamic
+// loader and libc start-up. Then it forks a child per connection, which answers one request of the daemon protocol
+// and exits, so a request costs a fork() rather than an exec() and a start-up. The children have no threads, as
+// threads do not survive a fork. Nothing is pre-faulted for them either, because every page a child writes gets
+// copied on write, which costs about the same as faulting it in fresh.
+
+void zygote_serve_request(Grammar grammar, Tree_Cache *tree_cache, int fd) {
+    Arena arena = {0};
+    char line[DAEMON_MAX_LINE];
+    size_t count = 0;
+    char *newline = NULL;
+    while ((newline = memchr(line, '\n', count)) == NULL) {
+        if (count == sizeof(line)) {
+            daemon_reply_error(fd, "request line is too long");
+            return;
+        }
+        ssize_t n = read(fd, line + count, sizeof(line) - count);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        count += n;
+    }
+    *newline = '\0';
+
+    Daemon_Job job = {0};
+    const char *error = daemon_parse_request(&arena, line, &job);
+    if (error != NULL) {
+        daemon_reply_error(fd, error);
+        return;
+    }
+
+    Program program;
+    if (!gen_program_cached(tree_cache, &arena, grammar, job.seed, GEN_DEPTH, NULL, &program, NULL)) {
+        daemon_reply_error(fd, "could not render the image");
+        return;
+    }
+    RGBA32 *pixels = malloc(job.width*job.height*sizeof(RGBA32));
+    assert(pixels != NULL && "Buy more RAM lol");
+    render_pixels_rect(&program, pixels, job.width, 0, 0, job.width, job.height, job.width, job.height);
+    if (image_encode(job.format, pixels, job.width, job.height, &job.image)) {
+        daemon_reply_image(fd, sb_to_sv(job.image));
+    } else {
+        daemon_reply_error(fd, "could not render the image");
+    }
+    // The process exits right after, no point in freeing anything
+}
+
+// Forks a child for every connection on `listen_fd` until SIGINT or SIGTERM
+void zygote_loop(Grammar grammar, Tree_Cache *tree_cache, int listen_fd) {
+    // Children are reaped by the kernel
+    signal(SIGCHLD, SIG_IGN);
+    struct sigaction sa = {.sa_handler = daemon_stop};
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    size_t forked = 0;
+    while (!daemon_stopping) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            nob_log(ERROR, "could not accept a connection: %s", strerror(errno));
+            break;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(listen_fd);
+            signal(SIGINT, SIG_DFL);
+            signal(SIGTERM, SIG_DFL);
+            zygote_serve_request(grammar, tree_cache, fd);
+            _exit(0);
+        }
+        if (pid < 0) {
+            nob_log(ERROR, "could not fork: %s", strerror(errno));
+            daemon_reply_error(fd, "could not fork");
+        } else {
+            forked += 1;
+        }
+        close(fd);
+    }
+    nob_log(INFO, "forked %zu children", forked);
+}
+
+bool command_zygote(Grammar grammar, int argc, char **argv) {
+    const char *socket_path = daemon_socket_path();
+    while (argc > 0) {
+        const char *flag = shift_args(&argc, &argv);
+        if (strcmp(flag, "-socket") == 0) {
+            if (argc <= 0) {
+                nob_log(ERROR, "no value is provided for %s", flag);
+                return false;
+            }
+            socket_path = shift_args(&argc, &argv);
+        } else {
+            nob_log(ERROR, "unexpected argument `%s`", flag);
+            return false;
+        }
+    }
+
+    Tree_Cache tree_cache;
+    tree_cache_init(&tree_cache, grammar);
+    int listen_fd = daemon_listen(socket_path);
+    if (listen_fd < 0) return false;
+    nob_log(INFO, "listening on %s", socket_path);
+    zygote_loop(grammar, &tree_cache, listen_fd);
+    close(listen_fd);
+    unlink(socket_path);
+    return true;
+}
+
+int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted `samples`
+uint64_t percentile(const uint64_t *samples, size_t count, double p) {
+    size_t rank = ceil(p*count);
+    if (rank > 0) rank -= 1;
+    if (rank >= count) rank = count - 1;
+    return samples[rank];
+}
+
+void print_latencies(const char *name, uint64_t *samples, size_t count) {
+    qsort(samples, count, sizeof(*samples), compare_u64);
+    printf("%-8s %10.3f %10.3f %10.3f %10.3f\n", name,
+           NS_TO_MS(percentile(samples, count, 0.50)), NS_TO_MS(percentile(samples, count, 0.90)),
+           NS_TO_MS(percentile(samples, count, 0.99)), NS_TO_MS(samples[count - 1]));
+}
+
+// Time from asking for an image to having it, for an exec of `randomart batch` and for a request to a zygote,
+// both rendering the same small image so that start-up is most of what gets measured
+bool command_zygote_bench(Grammar grammar, const char *grammar_path, int argc, char **argv) {
+    bool result = true;
+    size_t runs = 100;
+    size_t width = 16;
+    size_t height = 16;
+    uint64_t seed = 42;
+    int listen_fd = -1;
+    pid_t server = -1;
+    Nob_Fd null_fd = NOB_INVALID_FD;
+    uint64_t *exec_ns = NULL;
+    uint64_t *zygote_ns = NULL;
+    String_Builder sb = {0};
+    Cmd cmd = {0};
+    Log_Level log_level = minimal_log_level;
+    const char *socket_path = temp_sprintf("/tmp/randomart-bench-%d.sock", (int)getpid());
+    const char *jobs_path = temp_sprintf("/tmp/randomart-bench-%d.jobs", (int)getpid());
+
+    while (argc > 0) {
+        const char *flag = shift_args(&argc, &argv);
+        size_t *value = NULL;
+        if      (strcmp(flag, "-runs")   == 0) value = &runs;
+        else if (strcmp(flag, "-width")  == 0) value = &width;
+        else if (strcmp(flag, "-height") == 0) value = &height;
+        if (value == NULL) {
+            nob_log(ERROR, "unexpected argument `%s`", flag);
+            return_defer(false);
+        }
+        if (argc <= 0) {
+            nob_log(ERROR, "no value is provided for %s", flag);
+            return_defer(false);
+        }
+        if (!parse_size(flag, shift_args(&argc, &argv), value)) return_defer(false);
+    }
+
+    char exe_path[PATH_MAX];
+    if (!self_exe_path(exe_path)) return_defer(false);
+
+    const char *job = temp_sprintf("%llu %zu %zu /dev/null\n", (unsigned long long)seed, width, height);
+    if (!write_entire_file(jobs_path, job, strlen(job))) return_defer(false);
+    null_fd = fd_open_for_write("/dev/null");
+    if (null_fd == NOB_INVALID_FD) return_defer(false);
+
+    Tree_Cache tree_cache;
+    tree_cache_init(&tree_cache, grammar);
+    listen_fd = daemon_listen(socket_path);
+    if (listen_fd < 0) return_defer(false);
+    server = fork();
+    if (server < 0) {
+        nob_log(ERROR, "could not fork: %s", strerror(errno));
+        return_defer(false);
+    }
+    if (server == 0) {
+        minimal_log_level = WARNING;
+        zygote_loop(grammar, &tree_cache, listen_fd);
+        _exit(0);
+    }
+
+    exec_ns = malloc(runs*sizeof(uint64_t));
+    zygote_ns = malloc(runs*sizeof(uint64_t));
+    assert(exec_ns != NULL && zygote_ns != NULL && "Buy more RAM lol");
+
+    // Otherwise every exec logs its command line
+    minimal_log_level = WARNING;
+    // After the first run the exec'd batch would copy its image out of the render cache, which the zygote never
+    // looks at. With it off both sides only share the tree cache and the difference is start-up.
+    setenv("RANDOMART_RENDER_CACHE_BUDGET", "0", 1);
+    cmd_append(&cmd, exe_path);
+    if (grammar_path != NULL) cmd_append(&cmd, "-grammar", grammar_path);
+    cmd_append(&cmd, "batch", jobs_path);
+    const char *request = temp_sprintf("%llu %zu %zu png\n", (unsigned long long)seed, width, height);
+    for (size_t i = 0; i < runs; ++i) {
+        uint64_t start = get_time_ns();
+        if (!cmd_run_sync_redirect(cmd, (Nob_Cmd_Redirect) {.fdout = &null_fd, .fderr = &null_fd})) return_defer(false);
+        exec_ns[i] = get_time_ns() - start;
+
+        start = get_time_ns();
+        int fd = daemon_connect(socket_path);
+        if (fd < 0) return_defer(false);
+        String_View image;
+        bool ok = send_all(fd, request, strlen(request)) && daemon_read_reply(fd, &sb, &image);
+        close(fd);
+        if (!ok) return_defer(false);
+        zygote_ns[i] = get_time_ns() - start;
+    }
+    minimal_log_level = log_level;
+
+    printf("%zu runs of a %zux%zu image, milliseconds\n", runs, width, height);
+    printf("%-8s %10s %10s %10s %10s\n", "", "p50", "p90", "p99", "max");
+    print_latencies("exec", exec_ns, runs);
+    print_latencies("zygote", zygote_ns, runs);
+
+defer:
+    minimal_log_level = log_level;
+    if (server > 0) {
+        kill(server, SIGTERM);
+        waitpid(server, NULL, 0);
+    }
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        unlink(socket_path);
+    }
+    if (null_fd != NOB_INVALID_FD) fd_close(null_fd);
+    remove(jobs_path);
+    free(exec_ns);
+    free(zygote_ns);
+    cmd_free(cmd);
+    sb_free(sb);
+    return result;
+}
+
+// Writes the same many small files with every output backend and reports how long the caller was blocked in
+// output_writer_submit() and how long it took until all of them were on disk
+bool command_write_bench(int argc, char **argv) {
+    bool result = true;
+    size_t files = 10000;
+    size_t size = 4096;
+    size_t fsync_batch = 0;
+    const char *dir = NULL;
+    const char *own_dir = NULL; // made up here rather than given, so removed at the end
+    char *payload = NULL;
+
+    while (argc > 0) {
+        const char *flag = shift_args(&argc, &argv);
+        if (argc <= 0) {
+            nob_log(ERROR, "no value is provided for %s", flag);
+            return_defer(false);
+        }
+        const char *value = shift_args(&argc, &argv);
+        if (strcmp(flag, "-dir") == 0) {
+            dir = value;
+            continue;
+        }
+        size_t *out = NULL;
+        if      (strcmp(flag, "-files") == 0) out = &files;
+        else if (strcmp(flag, "-size")  == 0) out = &size;
+        else if (strcmp(flag, "-fsync") == 0) out = &fsync_batch;
+        if (out == NULL) {
+            nob_log(ERROR, "unexpected argument `%s`", flag);
+            return_defer(false);
+        }
+        if (!parse_size(flag, value, out)) return_defer(false);
+    }
+
+    if (dir == NULL) {
+        dir = temp_sprintf("/tmp/randomart-write-bench-%d", (int)getpid());
+        own_dir = dir;
+    }
+    if (!cache_mkdir(dir)) return_defer(false);
+    payload = malloc(size);
+    assert(payload != NULL && "Buy more RAM lol");
+    for (size_t i = 0; i < size; ++i) payload[i] = i*31 + 7;
+
+    printf("%zu files of %zu bytes in %s, fsync %s\n", files, size, dir,
+           fsync_batch > 0 ? temp_sprintf("every %zu files", fsync_batch) : "off");
+    printf("%-8s %12s %12s %12s %10s\n", "", "blocked ms", "total ms", "files/s", "MiB/s");
+    for (size_t backend = 0; backend < COUNT_OUTPUT_BACKENDS; ++backend) {
+        const char *backend_dir = temp_sprintf("%s/%s", dir, output_backend_names[backend]);
+        if (!cache_mkdir(backend_dir)) return_defer(false);
+
+        Output_Writer writer;
+        uint64_t blocked_ns = 0;
+        uint64_t start = get_time_ns();
+        output_writer_init(&writer, backend, fsync_batch);
+        for (size_t i = 0; i < files; ++i) {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%06zu.png", backend_dir, i);
+            String_Builder data = {0};
+            sb_append_buf(&data, payload, size);
+            uint64_t submit_start = get_time_ns();
+            output_writer_submit(&writer, path, &data, false);
+            blocked_ns += get_time_ns() - submit_start;
+        }
+        size_t failed = output_writer_finish(&writer);
+        uint64_t total_ns = get_time_ns() - start;
+
+        // Not the backend that was asked for when io_uring fell back to threads
+        printf("%-8s %12.3f %12.3f %12.0f %10.1f\n", output_backend_names[writer.backend],
+               NS_TO_MS(blocked_ns), NS_TO_MS(total_ns), files/(total_ns/1e9),
+               atomic_load(&writer.bytes)/1024.0/1024.0/(total_ns/1e9));
+
+        for (size_t i = 0; i < files; ++i) {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%06zu.png", backend_dir, i);
+            unlink(path);
+        }
+        rmdir(backend_dir);
+        if (failed > 0) {
+            nob_log(ERROR, "%zu files could not be written", failed);
+            return_defer(false);
+        }
+    }
+
+defer:
+    if (own_dir != NULL) rmdir(own_dir);
+    free(payload);
+    return result;
+}
+
+// Arena benchmark
+//
+// Compares the ways threads can allocate small objects at the same time: malloc() and free(), one arena behind a
+// mutex (what sharing node_arena would take), one arena through arena_alloc_atomic(), and an arena per thread
+// that is merged into a shared one at the end, the way the sheet workers hand their Programs over. All threads
+// start at once on a barrier, so they contend for as long as they allocate.
+
+typedef enum {
+    ARENA_BENCH_MALLOC,
+    ARENA_BENCH_LOCKED,
+    ARENA_BENCH_ATOMIC,
+    ARENA_BENCH_LOCAL,
+    COUNT_ARENA_BENCH_MODES,
+} Arena_Bench_Mode;
+
+static const char *arena_bench_mode_names[COUNT_ARENA_BENCH_MODES] = {
+    [ARENA_BENCH_MALLOC] = "malloc",
+    [ARENA_BENCH_LOCKED] = "locked",
+    [ARENA_BENCH_ATOMIC] = "atomic",
+    [ARENA_BENCH_LOCAL]  = "local",
+};
+
+typedef struct {
+    Arena_Bench_Mode mode;
+    size_t allocs;
+    size_t size;
+    Arena *shared;
+    pthread_mutex_t *lock;
+    pthread_barrier_t *start;
+    void **pointers; // what malloc() returned, to be freed afterwards
+} Arena_Bench;
+
+void *arena_bench_thread(void *arg) {
+    Arena_Bench *b = arg;
+    Arena local = {0};
+    pthread_barrier_wait(b->start);
+    for (size_t i = 0; i < b->allocs; ++i) {
+        char *p = NULL;
+        switch (b->mode) {
+            case ARENA_BENCH_MALLOC:
+                p = malloc(b->size);
+                assert(p != NULL && "Buy more RAM lol");
+                b->pointers[i] = p;
+                break;
+            case ARENA_BENCH_LOCKED:
+                pthread_mutex_lock(b->lock);
+                p = arena_alloc(b->shared, b->size);
+                pthread_mutex_unlock(b->lock);
+                break;
+            case ARENA_BENCH_ATOMIC:
+                p = arena_alloc_atomic(b->shared, b->size);
+                break;
+            case ARENA_BENCH_LOCAL:
+                p = arena_alloc(&local, b->size);
+                break;
+            case COUNT_ARENA_BENCH_MODES:
+            default: UNREACHABLE("arena_bench_thread");
+        }
+        // Like a Node, every object is written right after it is allocated
+        memset(p, (int)i, b->size);
+    }
+    if (b->mode == ARENA_BENCH_LOCAL) {
+        pthread_mutex_lock(b->lock);
+        arena_merge(b->shared, &local);
+        pthread_mutex_unlock(b->lock);
+    }
+    return NULL;
+}
+
+bool command_arena_bench(int argc, char **argv) {
+    bool result = true;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t threads_count = cpus > 1 ? cpus : 2;
+    size_t allocs = 1000000;
+    size_t size = sizeof(Node);
+    pthread_t *threads = NULL;
+    Arena_Bench *benches = NULL;
+
+    while (argc > 0) {
+        const char *flag = shift_args(&argc, &argv);
+        size_t *value = NULL;
+        if      (strcmp(flag, "-threads") == 0) value = &threads_count;
+        else if (strcmp(flag, "-allocs")  == 0) value = &allocs;
+        else if (strcmp(flag, "-size")    == 0) value = &size;
+        if (value == NULL) {
+            nob_log(ERROR, "unexpected argument `%s`", flag);
+            return_defer(false);
+        }
+        if (argc <= 0) {
+            nob_log(ERROR, "no value is provided for %s", flag);
+            return_defer(false);
+        }
+        if (!parse_size(flag, shift_args(&argc, &argv), value)) return_defer(false);
+    }
+
+    threads = malloc(threads_count*sizeof(pthread_t));
+    assert(threads != NULL && "Buy more RAM lol");
+    benches = calloc(threads_count, sizeof(Arena_Bench));
+    assert(benches != NULL && "Buy more RAM lol");
+
+    printf("%zu threads, %zu allocations of %zu bytes each\n", threads_count, allocs, size);
+    printf("%-8s %12s %12s %14s\n", "", "alloc ms", "free ms", "allocs/s");
+    for (size_t mode = 0; mode < COUNT_ARENA_BENCH_MODES; ++mode) {
+        Arena shared = {0};
+        pthread_mutex_t lock;
+        pthread_barrier_t start;
+        pthread_mutex_init(&lock, NULL);
+        pthread_barrier_init(&start, NULL, threads_count + 1);
+        for (size_t i = 0; i < threads_count; ++i) {
+            benches[i] = (Arena_Bench) {
+                .mode = mode,
+                .allocs = allocs,
+                .size = size,
+                .shared = &shared,
+                .lock = &lock,
+                .start = &start,
+            };
+            if (mode == ARENA_BENCH_MALLOC) {
+                benches[i].pointers = malloc(allocs*sizeof(void*));
+                assert(benches[i].pointers != NULL && "Buy more RAM lol");
+            }
+            if (pthread_create(&threads[i], NULL, arena_bench_thread, &benches[i]) != 0) UNREACHABLE("could not start a bench thread");
+        }
+
+        pthread_barrier_wait(&start);
+        uint64_t alloc_start = get_time_ns();
+        for (size_t i = 0; i < threads_count; ++i) pthread_join(threads[i], NULL);
+        uint64_t free_start = get_time_ns();
+        if (mode == ARENA_BENCH_MALLOC) {
+            for (size_t i = 0; i < threads_count; ++i) {
+                for (size_t k = 0; k < allocs; ++k) free(benches[i].pointers[k]);
+            }
+        } else {
+            arena_free(&shared);
+        }
+        uint64_t end = get_time_ns();
+
+        for (size_t i = 0; i < threads_count; ++i) free(benches[i].pointers);
+        pthread_barrier_destroy(&start);
+        pthread_mutex_destroy(&lock);
+        printf("%-8s %12.3f %12.3f %14.0f\n", arena_bench_mode_names[mode], NS_TO_MS(free_start - alloc_start),
+               NS_TO_MS(end - free_start), threads_count*allocs/((free_start - alloc_start)/1e9));
+    }
+
+defer:
+    free(threads);
+    free(benches);
+    return result;
+}
+
+void usage(const char *program_name) {
+    fprintf(stderr, "Usage: %s [-grammar <file>] [command] [options]\n", program_name);
+    fprintf(stderr, "    -grammar <file>            use the grammar of <file> instead of the default one (see `grammar`)\n");
+    fprintf(stderr, "Commands:\n");
+    fprintf(stderr, "    (none)                     render a random image into output.png\n");
+    fprintf(stderr, "    dzi [options] <name>       render a Deep Zoom Image pyramid into <name>.dzi and <name>_files/\n");
+    fprintf(stderr, "        -width <n>             width of the finest level (default %d)\n", WIDTH);
+    fprintf(stderr, "        -height <n>            height of the finest level (default %d)\n", HEIGHT);
+    fprintf(stderr, "        -tile <n>              tile size, must be even (default %d)\n", DZI_DEFAULT_TILE_SIZE);
+    fprintf(stderr, "        -seed <n>              seed of the generated function (default current time)\n");
+    fprintf(stderr, "    key [options] [<file>]     render the image of the key material in <file> (`-` for stdin)\n");
+    fprintf(stderr, "        -hex <fingerprint>     take the key material from a hex fingerprint instead\n");
+    fprintf(stderr, "        -o <path>              output path (default output.png)\n");
+    fprintf(stderr, "    batch [options] <jobs>     render every job of the <jobs> file (`-` for stdin), one per line:\n");
+    fprintf(stderr, "                               <seed> [<width> <height>] [<output path>]\n");
+    fprintf(stderr, "                               `hex:<fingerprint>` or `file:<path>` may be used instead of <seed>\n");
+    fprintf(stderr, "        -manifest <path>       write the per-job timing manifest into <path> instead of stdout\n");
+    fprintf(stderr, "        -max-nodes <n>         generate only trees of at most <n> nodes\n");
+    fprintf(stderr, "        -max-cost <c>          generate only trees of at most <c> estimated per-pixel cost\n");
+    fprintf(stderr, "        -depth <n>             maximum depth of the generated trees (default %d)\n", GEN_DEPTH);
+    fprintf(stderr, "        -pipeline              render, encode and write the images concurrently\n");
+    fprintf(stderr, "        -render-workers <n>    render threads of the pipeline (default number of CPUs)\n");
+    fprintf(stderr, "        -encode-workers <n>    encode threads of the pipeline or of -processes (default half the CPUs)\n");
+    fprintf(stderr, "        -processes <n>         render in <n> worker processes, restarting the ones that crash\n");
+    fprintf(stderr, "        -writer <backend>      write the files with sync, threads or uring (default sync)\n");
+    fprintf(stderr, "        -fsync <n>             fsync the written files in batches of <n> (default off)\n");
+    fprintf(stderr, "        -tar <path>            put all images into one tar archive (`-` for stdout), named by their\n");
+    fprintf(stderr, "                               output paths\n");
+    fprintf(stderr, "        -tar-index <path>      where the offset and size of every image go (default <path>.index)\n");
+    fprintf(stderr, "        -shm <name>            hand the pixels to a consumer through a ring of framebuffers in the\n");
+    fprintf(stderr, "                               POSIX shared memory <name> (see `shm-consume`) instead of writing files\n");
+    fprintf(stderr, "        -shm-slots <n>         number of framebuffers in the ring (default %d)\n", FB_RING_DEFAULT_SLOTS);
+    fprintf(stderr, "    shm-consume <name>         print the frames of the ring of `batch -shm <name>` as they arrive\n");
+    fprintf(stderr, "        -dir <dir>             also save them as PNGs, named like the output paths of their jobs\n");
+    fprintf(stderr, "    sheet [options] <jobs>     render the seeds or keys of a jobs file (as batch reads it) side by side\n");
+    fprintf(stderr, "                               into one contact sheet, in parallel\n");
+    fprintf(stderr, "        -cell <n>              width and height of every image (default %d)\n", SHEET_DEFAULT_CELL);
+    fprintf(stderr, "        -gap <n>               pixels between the images (default %d)\n", SHEET_DEFAULT_GAP);
+    fprintf(stderr, "        -cols <n>              images per row (default as square as possible)\n");
+    fprintf(stderr, "        -depth <n>             maximum depth of the generated trees (default %d)\n", GEN_DEPTH);
+    fprintf(stderr, "        -workers <n>           number of render threads (default number of CPUs)\n");
+    fprintf(stderr, "        -o <path>              output path (default sheet.png)\n");
+    fprintf(stderr, "    daemon [options]           serve render requests on a Unix socket (see `client`)\n");
+    fprintf(stderr, "        -socket <path>         socket path (default $RANDOMART_SOCKET, $XDG_RUNTIME_DIR/randomart.sock\n");
+    fprintf(stderr, "                               or /tmp/randomart-<uid>.sock)\n");
+    fprintf(stderr, "        -workers <n>           number of render threads (default number of CPUs)\n");
+    fprintf(stderr, "    client [options] <seed>    ask the daemon for the image of <seed> (or hex:<fingerprint>)\n");
+    fprintf(stderr, "        -key <file>            ask for the image of the key material in <file> (`-` for stdin) instead\n");
+    fprintf(stderr, "        -socket <path>         socket path of the daemon\n");
+    fprintf(stderr, "        -width <n>             width of the image (default %d)\n", WIDTH);
+    fprintf(stderr, "        -height <n>            height of the image (default %d)\n", HEIGHT);
+    fprintf(stderr, "        -format <f>            png, bmp, tga or jpg (default png)\n");
+    fprintf(stderr, "        -priority <n>          higher is served first (default 0)\n");
+    fprintf(stderr, "        -o <path>              output path (default output.<format>)\n");
+    fprintf(stderr, "    stream [options]           render jobs `<id> <seed> <width> <height> <format> [<priority>]` from stdin,\n");
+    fprintf(stderr, "                               writing `<id> ok <size>` and the image (or `<id> error <message>`)\n");
+    fprintf(stderr, "                               to stdout as they complete\n");
+    fprintf(stderr, "        -workers <n>           number of render threads (default number of CPUs)\n");
+    fprintf(stderr, "        -dir <dir>             save the images as <dir>/<id>.<format> and write `<id> ok <path>` instead\n");
+    fprintf(stderr, "    zygote [options]           fork a process per request of the daemon protocol, for isolation\n");
+    fprintf(stderr, "        -socket <path>         socket path (same default as daemon)\n");
+    fprintf(stderr, "    zygote-bench [options]     compare the latency percentiles of exec and of a zygote\n");
+    fprintf(stderr, "        -runs <n>              number of requests of each (default 100)\n");
+    fprintf(stderr, "        -width <n>             width of the rendered image (default 16)\n");
+    fprintf(stderr, "        -height <n>            height of the rendered image (default 16)\n");
+    fprintf(stderr, "    write-bench [options]      compare the output backends on writing many small files\n");
+    fprintf(stderr, "        -files <n>             number of files (default 10000)\n");
+    fprintf(stderr, "        -size <n>              size of every file in bytes (default 4096)\n");
+    fprintf(stderr, "        -fsync <n>             fsync the files in batches of <n> (default off)\n");
+    fprintf(stderr, "        -dir <path>            where to write them (default /tmp/randomart-write-bench-<pid>)\n");
+    fprintf(stderr, "    arena-bench [options]      compare malloc and the arenas on allocating from many threads at once\n");
+    fprintf(stderr, "        -threads <n>           number of threads (default the number of CPUs, at least 2)\n");
+    fprintf(stderr, "        -allocs <n>            allocations per thread (default 1000000)\n");
+    fprintf(stderr, "        -size <n>              size of every allocation in bytes (default that of a Node)\n");
+    fprintf(stderr, "    tree [options]             print the tree of a seed (cached like batch and key) or of an encoded tree\n");
+    fprintf(stderr, "        -seed <n>              seed to generate the tree of\n");
+    fprintf(stderr, "        -depth <n>             generation depth (default %d)\n", GEN_DEPTH);
+    fprintf(stderr, "        -i <path>              print the encoded tree at <path> instead\n");
+    fprintf(stderr, "        -o <path>              also save the tree encoded into <path>\n");
+    fprintf(stderr, "    tree-check [options]       check that encoded trees decode into bit-identical images\n");
+    fprintf(stderr, "        -seeds <n>             number of seeds to check (default 200)\n");
+    fprintf(stderr, "        -depth <n>             generation depth (default %d)\n", GEN_DEPTH);
+    fprintf(stderr, "        -size <n>              width and height of the compared images (default 32)\n");
+    fprintf(stderr, "    render [options] <file>    render a function as printed by the other commands (`-` for stdin)\n");
+    fprintf(stderr, "        -width <n>             width of the image (default %d)\n", WIDTH);
+    fprintf(stderr, "        -height <n>            height of the image (default %d)\n", HEIGHT);
+    fprintf(stderr, "        -o <path>              output path (default output.png)\n");
+    fprintf(stderr, "    gen-stats [options]        compare time, attempts and memory of the retrying and the min-depth generator\n");
+    fprintf(stderr, "        -seeds <n>             number of seeds to generate (default 1000)\n");
+    fprintf(stderr, "        -depth <n>             generation depth (default %d)\n", GEN_DEPTH);
+    fprintf(stderr, "    estimate [options]         expected tree size and per-pixel cost of the grammar, checked by sampling\n");
+    fprintf(stderr, "        -depth <n>             generation depth (default %d)\n", GEN_DEPTH);
+    fprintf(stderr, "        -samples <n>           number of trees to sample (default 1000)\n");
+    fprintf(stderr, "        -calibration <n>       number of samples rendered to calibrate the cost (default 20)\n");
+    fprintf(stderr, "        -width <n>             width to predict the render time for (default %d)\n", WIDTH);
+    fprintf(stderr, "        -height <n>            height to predict the render time for (default %d)\n", HEIGHT);
+    fprintf(stderr, "    grammar                    print the grammar in the format -grammar reads\n");
+    fprintf(stderr, "    grammar-c [options]        print the default grammar as static C tables (src/default_grammar.h)\n");
+    fprintf(stderr, "        -name <ident>          name of the generated Grammar (default default_grammar)\n");
+    fprintf(stderr, "        -o <path>              output path (default stdout)\n");
+    fprintf(stderr, "    help                       print this message\n");
+}
+
+int main(int argc, char **argv) {
+    const char *program_name = shift_args(&argc, &argv);
+
+    Grammar grammar = default_grammar;
+    const char *grammar_path = NULL;
+    if (argc > 0 && strcmp(argv[0], "-grammar") == 0) {
+        shift_args(&argc, &argv);
+        if (argc <= 0) {
+            usage(program_name);
+            nob_log(ERROR, "no grammar file is provided for -grammar");
+            return 1;
+        }
+        grammar_path = shift_args(&argc, &argv);
+        if (!grammar_load(grammar_path, &grammar)) return 1;
+    }
+
+    if (argc > 0) {
+        const char *command_name = shift_args(&argc, &argv);
+        if (strcmp(command_name, "grammar-c") == 0) {
+            // Without a grammar file the tables are baked from the runtime builder, so they can be regenerated
+            // after build_default_grammar() changes
+            if (grammar_path == NULL) {
+                memset(&grammar, 0, sizeof(grammar));
+                build_default_grammar(&grammar);
+                if (!grammar_compile(&node_arena, &grammar)) return 1;
+            }
+            return command_grammar_c(grammar, argc, argv) ? 0 : 1;
+        }
+        if (strcmp(command_name, "grammar") == 0) {
+            grammar_print(grammar);
+            return 0;
+        }
+        if (strcmp(command_name, "dzi") == 0) return command_dzi(grammar, argc, argv) ? 0 : 1;
+        if (strcmp(command_name, "key") == 0) return command_key(grammar, argc, argv) ? 0 : 1;
+        if (strcmp(command_name, "tree") == 0) return command_tree(grammar, argc, argv) ? 0 : 1;
+        if (strcmp(command_name, "tree-check") == 0) return command_tree_check(grammar, argc, argv) ? 0 : 1;
+        if (strcmp(command_name, "render") == 0) return command_render(argc, argv) ? 0 : 1;
+        if (strcmp(command_name, "sheet") == 0) return command_sheet(grammar, argc, argv) ? 0 : 1;
+        if (strcmp(command_name, "batch") == 0) return command_batch(grammar, grammar_path, argc, argv) ? 0 : 1;
+        if (strcmp(command_name, "shm-consume") == 0) return command_shm_consume(argc, argv) ? 0 : 1;
+        if (strcmp(command_name, "shard-worker") == 0) return command_shard_worker(grammar, argc, argv) ? 0 : 1;
+        if (strcmp(command_name, "daemon") == 0) return command_daemon(grammar, argc, argv) ? 0 : 1;
+        if (strcmp(command_name, "client") == 0) return command_client(argc, argv) ? 0 : 1;
+        if (strcmp(command_name, "stream") == 0) return command_stream(grammar, argc, argv) ? 0 : 1;
+        if (strcmp(command_name, "zygote") == 0) return command_zygote(grammar, argc, argv) ? 0 : 1;
+        if (strcmp(command_name, "zygote-bench") == 0) return command_zygote_bench(grammar, grammar_path, argc, argv) ? 0 : 1;
+        if (strcmp(command_name, "write-bench") == 0) return command_write_bench(argc, argv) ? 0 : 1;
+        if (strcmp(command_name, "arena-bench") == 0) return command_arena_bench(argc, argv) ? 0 : 1;
+        if (strcmp(command_name, "gen-stats") == 0) return command_gen_stats(grammar, argc, argv) ? 0 : 1;
+        if (strcmp(command_name, "estimate") == 0) return command_estimate(grammar, argc, argv) ? 0 : 1;
+        if (strcmp(command_name, "help") == 0) {
+            usage(program_name);
+            return 0;
+        }
+        usage(program_name);
+        nob_log(ERROR, "unknown command `%s`", command_name);
+        return 1;
+    }
 
-    Node *f = gen_rule(grammar, e, 20);
+    uint64_t seed = time(0);
+    nob_log(INFO, "seed: %llu", (unsigned long long)seed);
+    Node *f = gen_function(grammar, seed, GEN_DEPTH, NULL);
     if (!f) {
         nob_log(ERROR, "the generation process could not terminate.");
         return 1;